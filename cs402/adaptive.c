@@ -0,0 +1,268 @@
+#include "db.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/*
+ * One server that picks its locking as it runs, instead of one binary per
+ * strategy (server_adaptive).  The index is db_fine.c's, built with node
+ * locks that can be turned off (db_adaptive.o), and every shard has both a
+ * mutex and a reader-writer lock.  The lock hooks take
+ *
+ *	mutex mode	the shard's mutex, readers and writers alike, as in
+ *			db_coarse.c: the cheapest lock when few threads share
+ *	rw mode		its rwlock, read or write locked, as in db_rw.c, so
+ *			readers share the shard
+ *	fine mode	its rwlock read locked by everyone, with the node locks
+ *			of db_fine.c taken inside the operations, so writers
+ *			to different parts of the shard run together
+ *
+ * A monitor thread samples the lock counters of stats.c every
+ * ADAPT_INTERVAL_MS and picks a mode from how many threads are busy, the
+ * share of writes and how often a database lock had to be waited for.  A
+ * switch waits for a quiescent point: new operations are held off, every
+ * shard's mutex is taken and its rwlock write locked, so nothing is in
+ * flight, and only then does the mode change.  A hook reads the mode, takes
+ * that mode's lock and reads the mode again, trying again if a switch got
+ * in between.
+ */
+
+enum { MODE_MUTEX, MODE_RW, MODE_FINE };
+static char *mode_names[] = { "mutex", "rw", "fine" };
+
+/* How often the monitor looks, and the traffic it needs to see to judge */
+#define ADAPT_INTERVAL_MS 500
+#define ADAPT_MIN_OPS 200
+/* Below this share of writes the traffic is read-heavy */
+#define ADAPT_READ_HEAVY 0.2
+/* At this share of lock acquisitions that waited, writers are contended */
+#define ADAPT_CONTENDED 0.05
+/* Switches remembered for the stats command */
+#define ADAPT_HISTORY 8
+
+typedef struct ShardLocks {
+	pthread_mutex_t mutex;
+	pthread_rwlock_t rwlock;
+} __attribute__((aligned(64))) shard_locks_t;
+
+/* Locks of the shards and the calling thread's */
+static shard_locks_t shard0 = { PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_RWLOCK_INITIALIZER };
+static shard_locks_t *shards[MAX_SHARDS] = { &shard0 };
+static int nshard_locks = 1;
+static __thread shard_locks_t *locks = &shard0;
+
+/* The mode, and whether db_fine.c takes node locks, change only while every
+ * shard lock is held.  switching holds off threads about to take their
+ * first hook; one already holding a hook goes on, since a multi-key command
+ * takes the hooks of several shards and the switch may be waiting for it. */
+static int mode = MODE_MUTEX;
+int node_locking = 0;
+static int switching = 0;
+static __thread int hooks_held = 0;
+
+/* Switches so far, the latest ADAPT_HISTORY of them kept */
+typedef struct Switch {
+	double at;		/* Seconds since the monitor started */
+	int from, to;
+	char reason[96];
+} switch_t;
+
+static switch_t history[ADAPT_HISTORY];
+static int switches = 0;
+static long started;
+static pthread_mutex_t mutex_history = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t monitor_once = PTHREAD_ONCE_INIT;
+
+void index_shards(int);
+void index_use(int);
+void tombstone_print(FILE *);
+
+/* Change to mode to at a quiescent point, recording why */
+static void switch_mode(int to, char *reason) {
+    switch_t *s;
+    int from = mode;
+    int i;
+
+    __atomic_store_n(&switching, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < nshard_locks; i++) {
+	pthread_mutex_lock(&shards[i]->mutex);
+	pthread_rwlock_wrlock(&shards[i]->rwlock);
+    }
+    node_locking = to == MODE_FINE;
+    __atomic_store_n(&mode, to, __ATOMIC_RELEASE);
+    for (i = nshard_locks - 1; i >= 0; i--) {
+	pthread_rwlock_unlock(&shards[i]->rwlock);
+	pthread_mutex_unlock(&shards[i]->mutex);
+    }
+    __atomic_store_n(&switching, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&mutex_history);
+    s = &history[switches++ % ADAPT_HISTORY];
+    s->at = (stats_now() - started) / 1e9;
+    s->from = from;
+    s->to = to;
+    snprintf(s->reason, sizeof(s->reason), "%s", reason);
+    pthread_mutex_unlock(&mutex_history);
+}
+
+/* Body of the monitor thread.  A mode is only switched to once two samples
+ * in a row ask for it, so a burst does not flip the server back and forth,
+ * and once in fine mode, write-heavy traffic keeps it there: its node locks
+ * are what keep the database locks uncontended. */
+static void *monitor_run(void *arg) {
+    long acquired[LOCK_KINDS], contended[LOCK_KINDS];
+    long last_reads = 0, last_writes = 0, last_waits = 0;
+    long reads, writes, waits;
+    double wfrac, cfrac;
+    struct timespec pause;
+    char reason[96];
+    int active, want;
+    int pending = -1;
+
+    pause.tv_sec = ADAPT_INTERVAL_MS / 1000;
+    pause.tv_nsec = (ADAPT_INTERVAL_MS % 1000) * 1000000L;
+    for (;;) {
+	nanosleep(&pause, NULL);
+	active = stats_lock_sample(acquired, contended);
+	reads = acquired[LOCK_DB_READ] - last_reads;
+	writes = acquired[LOCK_DB_WRITE] - last_writes;
+	waits = contended[LOCK_DB_READ] + contended[LOCK_DB_WRITE] - last_waits;
+	last_reads = acquired[LOCK_DB_READ];
+	last_writes = acquired[LOCK_DB_WRITE];
+	last_waits = contended[LOCK_DB_READ] + contended[LOCK_DB_WRITE];
+	if (reads + writes < ADAPT_MIN_OPS) {
+	    pending = -1;
+	    continue;
+	}
+
+	wfrac = (double) writes / (reads + writes);
+	cfrac = (double) waits / (reads + writes);
+	if (active <= 1) {
+	    want = MODE_MUTEX;
+	    snprintf(reason, sizeof(reason), "one thread busy");
+	} else if (wfrac < ADAPT_READ_HEAVY) {
+	    want = MODE_RW;
+	    snprintf(reason, sizeof(reason), "read-heavy: %.0f%% writes, %d threads",
+		    100 * wfrac, active);
+	} else if (mode == MODE_FINE || cfrac >= ADAPT_CONTENDED) {
+	    want = MODE_FINE;
+	    snprintf(reason, sizeof(reason),
+		    "write-heavy: %.0f%% writes, %d threads, %.0f%% of locks waited",
+		    100 * wfrac, active, 100 * cfrac);
+	} else {
+	    want = MODE_MUTEX;
+	    snprintf(reason, sizeof(reason),
+		    "write-heavy but uncontended: %.1f%% of locks waited", 100 * cfrac);
+	}
+
+	if (want == __atomic_load_n(&mode, __ATOMIC_RELAXED)) {
+	    pending = -1;
+	} else if (want != pending) {
+	    pending = want;
+	} else {
+	    switch_mode(want, reason);
+	    pending = -1;
+	}
+    }
+    return NULL;
+}
+
+/* The stats command's report of the mode and the latest switches, and of
+ * db_fine.c's compaction */
+static void adaptive_print(FILE *out) {
+    switch_t *s;
+    int i;
+
+    pthread_mutex_lock(&mutex_history);
+    fprintf(out, "locking mode: %s, %d switches\n",
+	    mode_names[__atomic_load_n(&mode, __ATOMIC_RELAXED)], switches);
+    for (i = switches > ADAPT_HISTORY ? switches - ADAPT_HISTORY : 0;
+	    i < switches; i++) {
+	s = &history[i % ADAPT_HISTORY];
+	fprintf(out, "  %8.1fs %s -> %s: %s\n", s->at, mode_names[s->from],
+		mode_names[s->to], s->reason);
+    }
+    pthread_mutex_unlock(&mutex_history);
+    tombstone_print(out);
+}
+
+static void monitor_start(void) {
+    pthread_t thread;
+
+    started = stats_now();
+    stats_variant = adaptive_print;
+    if (pthread_create(&thread, NULL, monitor_run, NULL) == 0)
+	pthread_detach(thread);
+    else
+	perror("adaptive monitor");
+}
+
+/* Release what lock_hook took in mode m */
+static void unlock_hook(int m) {
+    if (m == MODE_MUTEX) pthread_mutex_unlock(&locks->mutex);
+    else pthread_rwlock_unlock(&locks->rwlock);
+}
+
+/* Take the calling thread's shard lock for the mode in force, counting it as
+ * a read or a write whatever the lock is, so the monitor sees the mix */
+static void lock_hook(int write) {
+    int kind = write ? LOCK_DB_WRITE : LOCK_DB_READ;
+    int m;
+
+    pthread_once(&monitor_once, monitor_start);
+    if (hooks_held == 0)
+	while (__atomic_load_n(&switching, __ATOMIC_ACQUIRE)) sched_yield();
+    for (;;) {
+	m = __atomic_load_n(&mode, __ATOMIC_ACQUIRE);
+	if (m == MODE_MUTEX)
+	    stats_mutex_lock(&locks->mutex, kind);
+	else if (m == MODE_RW && write)
+	    stats_wrlock(&locks->rwlock, kind, NULL);
+	else
+	    stats_rdlock(&locks->rwlock, kind, NULL);
+	if (__atomic_load_n(&mode, __ATOMIC_RELAXED) == m) break;
+	unlock_hook(m);
+    }
+    hooks_held++;
+}
+
+void db_read_lock() { lock_hook(0); }
+void db_write_lock() { lock_hook(1); }
+
+/* Holding a hook keeps the mode from changing */
+void db_read_unlock() {
+    hooks_held--;
+    unlock_hook(__atomic_load_n(&mode, __ATOMIC_RELAXED));
+}
+
+void db_write_unlock() {
+    hooks_held--;
+    unlock_hook(__atomic_load_n(&mode, __ATOMIC_RELAXED));
+}
+
+/* Make shards 1 .. n-1: the index's head sentinels and a pair of locks each,
+ * on a cache line of their own */
+void db_shards(int n) {
+    int i;
+
+    index_shards(n);
+    for (i = 1; i < n; i++) {
+	if (posix_memalign((void **) &shards[i], 64, sizeof(shard_locks_t))) {
+	    perror("db_shards");
+	    exit(1);
+	}
+	pthread_mutex_init(&shards[i]->mutex, NULL);
+	pthread_rwlock_init(&shards[i]->rwlock, NULL);
+    }
+    nshard_locks = n;
+}
+
+void db_use(int shard) {
+    index_use(shard);
+    locks = shards[shard];
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Run the in-process benchmark for every database variant at 1 to 64
+# concurrent clients.  Extra arguments are workload options passed on to
+# dbbench_<variant>, e.g.
+#	./bench.sh -m 50:25:25 -k 100000 -z 0.99
+# To measure whole servers (fifos and all) use dbbench instead.
+VARIANTS="coarse fine rw rcu optimistic adaptive shm"
+
+make -s $(for v in $VARIANTS; do echo dbbench_$v; done) || exit 1
+printf "%-20s %4s %12s %9s %9s %9s\n" variant clients ops/s "p50 us" "p99 us" "p999 us"
+for c in 1 2 4 8 16 32 64; do
+    for v in $VARIANTS; do
+	./dbbench_$v -c $c -n $((400000 / c)) "$@"
+    done
+done
@@ -0,0 +1,128 @@
+#include "skiplist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Benchmark for the database index (skiplist.c).  For key counts growing by
+ * 4x up to a maximum (default 4M), load the index with keys in sorted order
+ * (like the test1 and tree files) and in random order, then report the
+ * average and worst number of nodes a lookup visits and the lookup rate.
+ * Both should stay flat (logarithmic) as the key count grows; a plain binary
+ * tree fed sorted keys visits n/2 nodes per lookup on average.
+ *
+ * Usage: bench_index [max_keys]
+ */
+
+#define LOOKUPS 200000
+
+/* Seconds since some fixed point, as a double */
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The nodes visited by search() looking for name: one per step right plus
+ * one per level.  This mirrors search() in skiplist.c. */
+static int lookup_depth(char *name) {
+    node_t *pred = &head;
+    node_t *next;
+    search_key_t key;
+    int steps = 0;
+    int i;
+
+    key_make(&key, name);
+    for (i = head.level - 1; i >= 0; i--) {
+	while ((next = pred->next[i]) && NODE_CMP(next, &key) < 0) {
+	    pred = next;
+	    steps++;
+	}
+	steps++;
+    }
+    return steps;
+}
+
+/* Remove every node, leaving an empty list */
+static void clear() {
+    node_t *n = head.next[0];
+    node_t *next;
+    int i;
+
+    while (n) {
+	next = n->next[0];
+	node_destroy(n);
+	n = next;
+    }
+    for (i = 0; i < MAX_LEVEL; i++) head.next[i] = NULL;
+    head.level = 1;
+}
+
+/* Load n keys in the given order and print one line of results */
+static void run(int n, int sorted, char (*keys)[16], int *order) {
+    char result[64];
+    double start, elapsed;
+    long total = 0;
+    int worst = 0;
+    int i, d;
+
+    for (i = 0; i < n; i++) order[i] = i;
+    if (!sorted) {
+	for (i = n - 1; i > 0; i--) {
+	    int j = random() % (i + 1);
+	    int t = order[i];
+
+	    order[i] = order[j];
+	    order[j] = t;
+	}
+    }
+
+    start = now();
+    for (i = 0; i < n; i++) add(keys[order[i]], "v");
+    elapsed = now() - start;
+
+    for (i = 0; i < LOOKUPS; i++) {
+	d = lookup_depth(keys[random() % n]);
+	total += d;
+	if (d > worst) worst = d;
+    }
+
+    start = now();
+    for (i = 0; i < LOOKUPS; i++) query(keys[random() % n], result, sizeof(result));
+    printf("%9d %-7s %7.2f %6d %6d %12.0f %12.0f\n", n,
+	    sorted ? "sorted" : "random", (double) total / LOOKUPS, worst,
+	    head.level, LOOKUPS / (now() - start), n / elapsed);
+    clear();
+}
+
+int main(int argc, char *argv[]) {
+    int max = (argc > 1) ? atoi(argv[1]) : 4 << 20;
+    char (*keys)[16];
+    int *order;
+    int n, i;
+
+    if (max < 1024) {
+	fprintf(stderr, "Usage: bench_index [max_keys >= 1024]\n");
+	exit(1);
+    }
+    if (!(keys = malloc(max * sizeof(*keys))) ||
+	    !(order = malloc(max * sizeof(int)))) {
+	perror("malloc");
+	exit(1);
+    }
+    /* Zero padded so sorted order is also numeric order */
+    for (i = 0; i < max; i++) snprintf(keys[i], sizeof(keys[i]), "k%010d", i);
+
+    srandom(402);
+    printf("%9s %-7s %7s %6s %6s %12s %12s\n", "keys", "order", "avg", "max",
+	    "levels", "lookups/s", "inserts/s");
+    for (n = 1024; n <= max; n *= 4) {
+	run(n, 1, keys, order);
+	run(n, 0, keys, order);
+    }
+    free(keys);
+    free(order);
+    return 0;
+}
@@ -0,0 +1,401 @@
+#include "db.h"
+#include "shard.h"
+#include "wal.h"
+#include "bulkload.h"
+#include "pin.h"
+#include "qcache.h"
+#include "key.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Most threads a load uses, and the least input worth a thread of its own */
+#define LOAD_THREADS 64
+#define PARSE_MIN (1 << 20)
+/* Runs this short are insertion sorted */
+#define SORT_SMALL 16
+
+/* One parsed line.  name and value point into the file's buffer.  The name's
+ * prefix (key.h) decides most comparisons without touching the name itself,
+ * which is a cache miss away. */
+typedef struct Entry {
+	uint64_t prefix[2];
+	char *name;
+	char *value;
+	int shard;
+} entry_t;
+
+/* A parsing thread's slice of the file and what it made of it */
+typedef struct Parse {
+	char *start, *end;
+	entry_t *entry;		/* The slice's adds, sorted by key */
+	long n, cap;
+	long bad;		/* Lines that are not well-formed adds */
+} parse_t;
+
+/* One merge of two adjacent sorted runs of from into to */
+typedef struct Merge {
+	entry_t *from, *to;
+	long lo, mid, hi;	/* The runs are [lo, mid) and [mid, hi) */
+} merge_t;
+
+/* A loading thread's shards: first, first + step, ... */
+typedef struct Load {
+	entry_t *entry;		/* All keys, grouped by shard */
+	long *start;		/* Shard s has entry[start[s]] .. entry[start[s + 1] - 1] */
+	int first, step;
+	long added;
+	unsigned long lsn;	/* Last log record written */
+} load_t;
+
+/* Run fn on each of the n records of size bytes at arg, in parallel.  If a
+ * thread cannot be started its share is run here instead. */
+static void run_parallel(void *(*fn)(void *), void *arg, size_t size, int n)
+{
+    pthread_t threads[LOAD_THREADS];
+    int started[LOAD_THREADS];
+    int i;
+
+    for (i = 1; i < n; i++)
+	started[i] = pthread_create(&threads[i], NULL, fn,
+		(char *) arg + i * size) == 0;
+    fn(arg);
+    for (i = 1; i < n; i++)
+	if (started[i]) pthread_join(threads[i], NULL);
+	else fn((char *) arg + i * size);
+}
+
+/* Compare the keys of a and b as strcmp would */
+static inline int entry_cmp(entry_t *a, entry_t *b)
+{
+    if (a->prefix[0] != b->prefix[0]) return a->prefix[0] < b->prefix[0] ? -1 : 1;
+    if (a->prefix[1] != b->prefix[1]) return a->prefix[1] < b->prefix[1] ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+/* Merge the sorted runs a[0 .. na) and b[0 .. nb) into out.  On equal keys
+ * a's entry comes first, so sorting is stable. */
+static void merge(entry_t *a, long na, entry_t *b, long nb, entry_t *out)
+{
+    while (na > 0 && nb > 0)
+	if (entry_cmp(b, a) < 0) {
+	    *out++ = *b++;
+	    nb--;
+	} else {
+	    *out++ = *a++;
+	    na--;
+	}
+    memcpy(out, a, na * sizeof(entry_t));
+    memcpy(out + na, b, nb * sizeof(entry_t));
+}
+
+static void sort_into(entry_t *, entry_t *, long);
+
+/* Stable insertion sort of e[0 .. n) */
+static void insertion_sort(entry_t *e, long n)
+{
+    entry_t x;
+    long i, j;
+
+    for (i = 1; i < n; i++) {
+	x = e[i];
+	for (j = i; j > 0 && entry_cmp(&e[j - 1], &x) > 0; j--) e[j] = e[j - 1];
+	e[j] = x;
+    }
+}
+
+/* Stable merge sort of e[0 .. n), with tmp as scratch space.  The halves are
+ * sorted into tmp and merged back, so nothing is copied just to move it. */
+static void sort_entries(entry_t *e, entry_t *tmp, long n)
+{
+    long h = n / 2;
+
+    if (n <= SORT_SMALL) {
+	insertion_sort(e, n);
+	return;
+    }
+    sort_into(e, tmp, h);
+    sort_into(e + h, tmp + h, n - h);
+    merge(tmp, h, tmp + h, n - h, e);
+}
+
+/* Sort e[0 .. n) into out, using e as scratch space */
+static void sort_into(entry_t *e, entry_t *out, long n)
+{
+    long h = n / 2;
+
+    if (n <= SORT_SMALL) {
+	memcpy(out, e, n * sizeof(entry_t));
+	insertion_sort(out, n);
+	return;
+    }
+    sort_entries(e, out, h);
+    sort_entries(e + h, out + h, n - h);
+    merge(e, h, e + h, n - h, out);
+}
+
+/* The end of the token starting at p, which is at most 255 characters, as
+ * parse_op reads it.  The token is cut short if it is longer. */
+static char *token_end(char *p)
+{
+    char *q;
+
+    for (q = p; *q && *q != ' ' && *q != '\t' && *q != '\n' && *q != '\r' &&
+	    *q != '\v' && *q != '\f'; q++)
+	;
+    if (q - p > 255) p[255] = '\0';
+    return q;
+}
+
+static char *skip_blanks(char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')
+	p++;
+    return p;
+}
+
+/* Thread body: parse a slice of lines into entries, in place, and sort them */
+static void *parse_slice(void *arg)
+{
+    parse_t *p = (parse_t *) arg;
+    entry_t *nentry, *tmp;
+    char *line, *eol, *name, *value, *end;
+
+    for (line = p->start; line < p->end; line = eol + 1) {
+	if (!(eol = memchr(line, '\n', p->end - line))) eol = p->end;
+	if (line[0] != 'a') {
+	    p->bad++;
+	    continue;
+	}
+	name = skip_blanks(line + 1);
+	end = token_end(name);
+	value = skip_blanks(end);
+	if (end == name || value >= eol || *value == '\n') {
+	    p->bad++;
+	    continue;
+	}
+	*end = '\0';
+	*token_end(value) = '\0';
+
+	if (p->n == p->cap) {
+	    p->cap = p->cap ? 2 * p->cap : 4096;
+	    if (!(nentry = (entry_t *) realloc(p->entry,
+		    p->cap * sizeof(entry_t)))) {
+		p->n = -1;
+		return NULL;
+	    }
+	    p->entry = nentry;
+	}
+	p->entry[p->n].name = name;
+	p->entry[p->n].value = value;
+	p->entry[p->n].shard = shard_of(name);
+	key_prefix(name, p->entry[p->n++].prefix);
+    }
+
+    if (!(tmp = (entry_t *) malloc(p->n * sizeof(entry_t) + 1))) {
+	p->n = -1;
+	return NULL;
+    }
+    sort_entries(p->entry, tmp, p->n);
+    free(tmp);
+    return NULL;
+}
+
+/* Thread body: one merge of a round */
+static void *merge_runs(void *arg)
+{
+    merge_t *m = (merge_t *) arg;
+
+    merge(m->from + m->lo, m->mid - m->lo, m->from + m->mid, m->hi - m->mid,
+	    m->to + m->lo);
+    return NULL;
+}
+
+/* Thread body: append each of this thread's shards' keys under one hold of
+ * the shard's write lock, logging them as add would */
+static void *load_shards(void *arg)
+{
+    load_t *l = (load_t *) arg;
+    bulk_t bulk;
+    entry_t *e;
+    int done, locked;
+    long i;
+    int s;
+
+    for (s = l->first; s < nshards; s += l->step) {
+	db_use(s);
+	qcache_change_begin(s);
+	if (bulk_online) {
+	    db_write_lock();
+	    bulk_start(&bulk);
+	}
+	for (i = l->start[s]; i < l->start[s + 1]; i++) {
+	    e = &l->entry[i];
+	    if (!bulk_online) db_write_lock();
+	    locked = pin_change_begin(e->name);
+	    done = bulk_online ? bulk_append(&bulk, e->name, e->value) :
+		add(e->name, e->value);
+	    if (done && wal_enabled) l->lsn = wal_append('a', e->name, e->value);
+	    pin_change_end(e->name, locked);
+	    if (!bulk_online) db_write_unlock();
+	    l->added += done;
+	}
+	if (bulk_online) db_write_unlock();
+	qcache_change_end(s);
+    }
+    return NULL;
+}
+
+/* Read all of path into a buffer with a NUL after it.  Return it, with its
+ * length in *size, or NULL. */
+static char *read_file(char *path, long *size)
+{
+    struct stat st;
+    char *buf;
+    ssize_t got;
+    long n = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) return NULL;
+    if (fstat(fd, &st) == -1 || !(buf = (char *) malloc(st.st_size + 1))) {
+	close(fd);
+	return NULL;
+    }
+    while (n < st.st_size && (got = read(fd, buf + n, st.st_size - n)) > 0)
+	n += got;
+    close(fd);
+    buf[n] = '\0';
+    *size = n;
+    return buf;
+}
+
+/*
+ * Load the adds in the file path and describe the outcome in response, which
+ * holds len characters.  Lines other than well-formed adds are counted and
+ * skipped.  A key already in the database, or earlier in the file, is left
+ * as it was, and the response counts those separately.
+ */
+void bulk_load_file(char *path, char *response, int len)
+{
+    parse_t parse[LOAD_THREADS];
+    merge_t merges[LOAD_THREADS];
+    load_t loads[LOAD_THREADS];
+    entry_t *all = NULL, *other = NULL, *swap;
+    long *run = NULL, *start = NULL;
+    char *buf, *p;
+    long size, n = 0, kept, bad = 0, added = 0;
+    unsigned long lsn = 0;
+    int nthreads, nruns, nmerges;
+    long k;
+    int i, s;
+
+    if (!(buf = read_file(path, &size))) {
+	strncpy(response, "bad file name", len - 1);
+	return;
+    }
+
+    /* Slices end at line ends */
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > size / PARSE_MIN) nthreads = size / PARSE_MIN;
+    if (nthreads > LOAD_THREADS) nthreads = LOAD_THREADS;
+    if (nthreads < 1) nthreads = 1;
+    memset(parse, 0, sizeof(parse));
+    for (i = 0, p = buf; i < nthreads; i++) {
+	parse[i].start = p;
+	p = i == nthreads - 1 ? buf + size : buf + size / nthreads * (i + 1);
+	if (p < parse[i].start) p = parse[i].start;
+	while (p < buf + size && *p != '\n') p++;
+	if (p < buf + size) p++;
+	parse[i].end = p;
+    }
+    run_parallel(parse_slice, parse, sizeof(parse_t), nthreads);
+
+    /* Gather the sorted slices into one array of runs */
+    for (i = 0; i < nthreads; i++) {
+	if (parse[i].n < 0) goto nomem;
+	n += parse[i].n;
+	bad += parse[i].bad;
+    }
+    all = (entry_t *) malloc(n * sizeof(entry_t) + 1);
+    other = (entry_t *) malloc(n * sizeof(entry_t) + 1);
+    run = (long *) malloc((nthreads + 1) * sizeof(long));
+    start = (long *) calloc(nshards + 1, sizeof(long));
+    if (!all || !other || !run || !start) goto nomem;
+    for (i = 0, run[0] = 0; i < nthreads; i++) {
+	memcpy(all + run[i], parse[i].entry, parse[i].n * sizeof(entry_t));
+	run[i + 1] = run[i] + parse[i].n;
+    }
+
+    /* Merge pairs of runs, in parallel, until there is one */
+    for (nruns = nthreads; nruns > 1; nruns = (nruns + 1) / 2) {
+	for (i = nmerges = 0; i + 1 < nruns; i += 2, nmerges++) {
+	    merges[nmerges].from = all;
+	    merges[nmerges].to = other;
+	    merges[nmerges].lo = run[i];
+	    merges[nmerges].mid = run[i + 1];
+	    merges[nmerges].hi = run[i + 2];
+	    run[i / 2] = run[i];
+	}
+	if (i < nruns) {
+	    memcpy(other + run[i], all + run[i],
+		    (run[i + 1] - run[i]) * sizeof(entry_t));
+	    run[i / 2] = run[i];
+	}
+	run[(nruns + 1) / 2] = n;
+	run_parallel(merge_runs, merges, sizeof(merge_t), nmerges);
+	swap = all;
+	all = other;
+	other = swap;
+    }
+
+    /* Drop repeated keys, keeping the first line of each */
+    for (k = 0, kept = 0; k < n; k++)
+	if (kept == 0 || entry_cmp(&all[k], &all[kept - 1]))
+	    all[kept++] = all[k];
+
+    /* Group by shard, still in key order within each */
+    for (k = 0; k < kept; k++) start[all[k].shard + 1]++;
+    for (s = 0; s < nshards; s++) start[s + 1] += start[s];
+    for (k = 0; k < kept; k++) other[start[all[k].shard]++] = all[k];
+    for (s = nshards; s > 0; s--) start[s] = start[s - 1];
+    start[0] = 0;
+
+    nthreads = nshards < LOAD_THREADS ? nshards : LOAD_THREADS;
+    if (nthreads > sysconf(_SC_NPROCESSORS_ONLN))
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    for (i = 0; i < nthreads; i++) {
+	loads[i].entry = other;
+	loads[i].start = start;
+	loads[i].first = i;
+	loads[i].step = nthreads;
+	loads[i].added = 0;
+	loads[i].lsn = 0;
+    }
+    run_parallel(load_shards, loads, sizeof(load_t), nthreads);
+    for (i = 0; i < nthreads; i++) {
+	added += loads[i].added;
+	if (loads[i].lsn > lsn) lsn = loads[i].lsn;
+    }
+    wal_commit(lsn);
+
+    snprintf(response, len, "added %ld, %ld already in database, "
+	    "%ld repeated in file, %ld ill-formed", added, kept - added,
+	    n - kept, bad);
+    goto done;
+
+nomem:
+    strncpy(response, "out of memory", len - 1);
+done:
+    for (i = 0; i < LOAD_THREADS; i++) free(parse[i].entry);
+    free(all);
+    free(other);
+    free(run);
+    free(start);
+    free(buf);
+}
@@ -0,0 +1,11 @@
+#ifndef BULKLOAD_H
+#define BULKLOAD_H
+/*
+ * The F command: load a file of "a name value" lines in parallel.  Threads
+ * parse and sort slices of the file, the sorted slices are merged pairwise in
+ * parallel, duplicate keys are dropped (the first line wins, as it would
+ * with f) and each shard's keys are appended to it in order under one hold
+ * of its write lock (bulk_append in db.h), shards in parallel.
+ */
+void bulk_load_file(char *, char *, int);
+#endif
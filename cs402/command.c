@@ -0,0 +1,641 @@
+#include "db.h"
+#include "wal.h"
+#include "stats.h"
+#include "shard.h"
+#include "bulkload.h"
+#include "pin.h"
+#include "qcache.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+ * The command language shared by every database variant.  Each variant
+ * (db_coarse.c, db_fine.c, db_rw.c, db_rcu.c) supplies query, add and xremove
+ * and the lock hooks declared in db.h; this file parses commands and brackets
+ * each operation with the hooks.  Batches (the b command and the contents of
+ * an f file) bracket whole runs of operations instead, and the multi-key
+ * commands hold the write hooks of every shard they touch for the variant's
+ * multi to work under.
+ */
+
+/* Commands are carried out in batches of at most this many */
+#define BATCH_MAX 64
+
+/* One parsed command of a batch */
+typedef struct Op {
+	char code;		/* 'q', 'a' or 'd'; 0 for anything else */
+	char *command;		/* The command line itself */
+	char name[256];
+	char value[256];
+	char response[256];
+	int shard;		/* shard_of(name); -1 once executed in a batch */
+	unsigned long lsn;	/* Log record of the change, if one was made */
+} op_t;
+
+/* Which hooks a run of operations is executed between */
+enum { LOCK_NONE, LOCK_READ, LOCK_WRITE };
+
+/*
+ * Parse a q, a or d command into op, leaving code 0 if command is something
+ * else.  Return false, with the error in response, if command is one of those
+ * but ill-formed.
+ */
+static int parse_op(char *command, op_t *op, char *response, int len)
+{
+    op->command = command;
+    op->code = 0;
+    op->lsn = 0;
+    op->name[0] = op->value[0] = '\0';
+    if (strlen(command) <= 1) return 1;
+
+    switch (command[0]) {
+    case 'q':
+    case 'd':
+	sscanf(&command[1], "%255s", op->name);
+	if (strlen(op->name) == 0) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return 0;
+	}
+	break;
+    case 'a':
+	sscanf(&command[1], "%255s %255s", op->name, op->value);
+	if ((strlen(op->name) == 0) || (strlen(op->value) == 0)) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return 0;
+	}
+	break;
+    default:
+	return 1;
+    }
+    op->code = command[0];
+    return 1;
+}
+
+/* The hooks op must be executed between */
+static int op_lock(op_t *op)
+{
+    if (op->code == 'q') return LOCK_READ;
+    if (op->code == 'a' || op->code == 'd') return LOCK_WRITE;
+    return LOCK_NONE;
+}
+
+/* Make the change a parsed a or d asks for, saving the key's old state for
+ * any pins first and, if it was made and the database is durable, logging
+ * it.  Cached answers from its shard are invalidated.  Return true if it was
+ * made. */
+static int change(op_t *op)
+{
+    int done, locked;
+
+    qcache_change_begin(op->shard);
+    locked = pin_change_begin(op->name);
+    done = op->code == 'a' ? add(op->name, op->value) : xremove(op->name);
+    if (done && wal_enabled) op->lsn = wal_append(op->code, op->name, op->value);
+    pin_change_end(op->name, locked);
+    qcache_change_end(op->shard);
+    return done;
+}
+
+/* Carry out a parsed q, a or d, whose shard is set.  The caller holds the
+ * matching lock. */
+static void execute_op(op_t *op, char *response, int len)
+{
+    stats_key(op->name);
+    switch (op->code) {
+    case 'q':
+	qcache_query(op->name, op->shard, response, len);
+	if (strlen(response) == 0) {
+	    strncpy(response, "not found", len - 1);
+	}
+	return;
+    case 'a':
+	if (change(op)) {
+	    strncpy(response, "added", len - 1);
+	} else {
+	    strncpy(response, "already in database", len - 1);
+	}
+	return;
+    case 'd':
+	if (change(op)) {
+	    strncpy(response, "removed", len - 1);
+	} else {
+	    strncpy(response, "not in database", len - 1);
+	}
+	return;
+    }
+}
+
+/*
+ * Replace name's value with value if expect is NULL or is the value now (the
+ * u and c commands), in place: the key keeps its node's height rather than
+ * being deleted and added again.  The change is logged as an update, which
+ * replays as the u command.
+ */
+static void update_command(char *name, char *value, char *expect,
+	char *response, int len)
+{
+    unsigned long lsn = 0;
+    int shard = shard_of(name);
+    int done, locked;
+
+    stats_key(name);
+    qcache_change_begin(shard);
+    db_use(shard);
+    db_write_lock();
+    locked = pin_change_begin(name);
+    done = update(name, value, expect);
+    if (done > 0 && wal_enabled) lsn = wal_append('u', name, value);
+    pin_change_end(name, locked);
+    db_write_unlock();
+    qcache_change_end(shard);
+    wal_commit(lsn);
+    strncpy(response, done > 0 ? "updated" : done == 0 ? "not in database" :
+	    "value differs", len - 1);
+}
+
+/* qsort order of multi-key operations: by shard, then by key */
+static int multi_order(const void *a, const void *b)
+{
+    const multi_t *x = *(const multi_t **) a, *y = *(const multi_t **) b;
+
+    if (x->shard != y->shard) return x->shard - y->shard;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * Carry out mq, ma or md: the query, add or delete of every key given, as one
+ * atomic operation.  The answers are joined by "; " in the order the keys
+ * were given.  The lock hooks of every shard involved are taken in shard
+ * order, the pin stripes of the keys after them (pin_changes_begin), and the
+ * variant's multi does the rest.  An mq takes the read hooks where they
+ * keep writers out (multi_read_locked), so it does not shut out readers.  The keys a change did make are
+ * logged as one record, so a crash keeps all of them or none.
+ */
+static void multi_command(char *command, char *response, int len)
+{
+    char names[MULTI_MAX][256];
+    char values[MULTI_MAX][256];
+    multi_t ops[MULTI_MAX];
+    multi_t *sorted[MULTI_MAX];
+    multi_t run[MULTI_MAX];
+    char *keys[MULTI_MAX];
+    char code = command[1];
+    char *line, *tok, *rest;
+    char *record = NULL;
+    unsigned long lsn = 0;
+    int i, n, m, used, locked, shared;
+    int bad = 0;
+
+    if (code != 'q' && code != 'a' && code != 'd') {
+	strncpy(response, "ill-formed command", len - 1);
+	return;
+    }
+
+    /* Parse the keys, and for ma the values */
+    if (!(line = strdup(&command[2]))) {
+	strncpy(response, "out of memory", len - 1);
+	return;
+    }
+    n = 0;
+    for (tok = strtok_r(line, " \t\n", &rest); tok;
+	    tok = strtok_r(NULL, " \t\n", &rest)) {
+	if ((bad = n == MULTI_MAX)) break;
+	snprintf(names[n], sizeof(names[n]), "%s", tok);
+	values[n][0] = '\0';
+	if (code == 'a') {
+	    if ((bad = !(tok = strtok_r(NULL, " \t\n", &rest)))) break;
+	    snprintf(values[n], sizeof(values[n]), "%s", tok);
+	}
+	ops[n].code = code;
+	ops[n].name = names[n];
+	ops[n].value = values[n];
+	ops[n].len = sizeof(values[n]);
+	ops[n].shard = shard_of(names[n]);
+	ops[n].done = 0;
+	sorted[n] = &ops[n];
+	n++;
+    }
+    free(line);
+    if (bad || n == 0) {
+	strncpy(response, "ill-formed command", len - 1);
+	return;
+    }
+    /* Sort, each key once.  A key given twice is answered once for mq but
+     * makes no sense to change twice at once. */
+    qsort(sorted, n, sizeof(multi_t *), multi_order);
+    for (i = m = 0; i < n; i++) {
+	if (m > 0 && multi_order(&sorted[i], &sorted[i - 1]) == 0) {
+	    if (code != 'q') {
+		strncpy(response, "ill-formed command", len - 1);
+		return;
+	    }
+	    continue;
+	}
+	run[m] = *sorted[i];
+	keys[m] = run[m].name;
+	stats_key(keys[m]);
+	m++;
+    }
+
+    for (i = 0; i < m; i++)
+	if (code != 'q' && (i == 0 || run[i].shard != run[i - 1].shard))
+	    qcache_change_begin(run[i].shard);
+    shared = code == 'q' && multi_read_locked;
+    for (i = 0; i < m; i++)
+	if (i == 0 || run[i].shard != run[i - 1].shard) {
+	    db_use(run[i].shard);
+	    if (shared) db_read_lock();
+	    else db_write_lock();
+	}
+    locked = code != 'q' ? pin_changes_begin(keys, m) : 0;
+
+    multi(run, m);
+
+    if (code != 'q' && wal_enabled && (record = malloc(strlen(command) + 3))) {
+	used = sprintf(record, "m%c", code);
+	for (i = 0; i < m; i++)
+	    if (run[i].done)
+		used += code == 'a' ?
+		    sprintf(record + used, " %s %s", run[i].name, run[i].value) :
+		    sprintf(record + used, " %s", run[i].name);
+	if (used > 2) lsn = wal_append_command(record);
+	free(record);
+    }
+    if (code != 'q') pin_changes_end(keys, m, locked);
+    for (i = m - 1; i >= 0; i--)
+	if (i == 0 || run[i].shard != run[i - 1].shard) {
+	    db_use(run[i].shard);
+	    if (shared) db_read_unlock();
+	    else db_write_unlock();
+	}
+    for (i = 0; i < m; i++)
+	if (code != 'q' && (i == 0 || run[i].shard != run[i - 1].shard))
+	    qcache_change_end(run[i].shard);
+    wal_commit(lsn);
+
+    /* Answer in the order the keys were given */
+    response[0] = '\0';
+    for (i = used = 0; i < n && used < len - 1; i++) {
+	for (m = 0; strcmp(run[m].name, ops[i].name); m++)
+	    ;
+	line = code == 'q' ? run[m].value :
+	    code == 'a' ? (run[m].done ? "added" : "already in database") :
+	    (run[m].done ? "removed" : "not in database");
+	used += snprintf(response + used, len - used, "%s%s",
+		used ? "; " : "", line);
+    }
+}
+
+/* A range or prefix scan being answered */
+typedef struct Range {
+	char *hi;		/* Largest key wanted, or NULL */
+	char *prefix;		/* Prefix of every key wanted, or NULL */
+	int limit;		/* Keys still wanted; -1 is no limit */
+	char *response;
+	int len;		/* Room in response */
+	int used;		/* Characters of response filled */
+	int count;		/* Keys in response */
+	char next[256];		/* First key not returned, if there are more */
+} range_t;
+
+/* scan callback: add "name value" to the response while the key is in range,
+ * wanted and fits, with room left over to say where to continue. */
+static int range_record(char *name, char *value, void *arg)
+{
+    range_t *r = (range_t *) arg;
+    int n;
+
+    if (r->hi && strcmp(name, r->hi) > 0) return 0;
+    if (r->prefix && strncmp(name, r->prefix, strlen(r->prefix))) return 0;
+    if (r->limit == 0) goto more;
+
+    n = snprintf(r->response + r->used, r->len - r->used, "%s%s %s",
+	    r->count ? "; " : "", name, value);
+    /* The first key goes in even if truncated, so a cursor always moves */
+    if (r->count > 0 && r->used + n + (int) strlen(name) + 8 >= r->len) {
+	r->response[r->used] = '\0';
+	goto more;
+    }
+    r->used += n;
+    if (r->used > r->len - 1) r->used = r->len - 1;
+    r->count++;
+    if (r->limit > 0) r->limit--;
+    return 1;
+
+more:
+    snprintf(r->next, sizeof(r->next), "%s", name);
+    return 0;
+}
+
+/*
+ * Answer a scan of the keys from from on that are at most hi and start with
+ * prefix (either may be NULL), at most limit of them (-1 for as many as fit).
+ * The response is "name value; name value ..." in key order, ending with
+ * "; more <key>" if the scan stopped early: repeating the command from key
+ * continues it.  The shards are merged by scan_all, which copies keys out
+ * of each a chunk at a time under its read lock, so writers are not blocked
+ * for the length of the scan.  If pin is not 0 the keys are those of that
+ * pinned view (pin.c) instead of the live database.
+ */
+static void range_scan(int pin, char *from, char *hi, char *prefix, int limit,
+	char *response, int len)
+{
+    range_t r;
+    int found;
+
+    r.hi = hi;
+    r.prefix = prefix;
+    r.limit = limit;
+    r.response = response;
+    r.len = len;
+    r.used = r.count = 0;
+    r.next[0] = '\0';
+    response[0] = '\0';
+
+    found = pin ? pin_scan(pin, from, range_record, &r) :
+	    scan_all(from, range_record, &r) ? 1 : -1;
+    if (found == 0) {
+	strncpy(response, "no such pin", len - 1);
+	return;
+    }
+    if (found < 0) {
+	strncpy(response, "out of memory", len - 1);
+	return;
+    }
+
+    if (r.count == 0 && !r.next[0])
+	strncpy(response, "no keys", len - 1);
+    else if (r.next[0])
+	snprintf(response + r.used, len - r.used, "%smore %s",
+		r.count ? "; " : "", r.next);
+}
+
+/*
+ * Execute the n commands in ops in order.  Each run of consecutive queries is
+ * carried out under one read lock and each run of adds and deletes under one
+ * write lock, so a batch pays for a lock acquisition per run instead of per
+ * command.  Anything else (files, nested batches, errors) runs on its own
+ * through interpret_command.  Each op's result is left in its response, and
+ * the batch's changes are committed to the log together at the end.
+ *
+ * The lock hooks are per shard, so a run is carried out a shard at a time:
+ * the run's ops on its first shard, in order, under one hold of that shard's
+ * lock, then those on the next shard and so on.  Ops on different shards
+ * have different keys, so this has the same results as running them in
+ * order.
+ */
+static void execute_batch(op_t *ops, int n)
+{
+    unsigned long lsn = 0;
+    int i, j, k, m, s, lock;
+
+    for (i = 0; i < n; i = j) {
+	lock = op_lock(&ops[i]);
+	if (lock == LOCK_NONE) {
+	    if (ops[i].response[0] == '\0')
+		interpret_command(ops[i].command, ops[i].response,
+			sizeof(ops[i].response));
+	    j = i + 1;
+	    continue;
+	}
+	for (j = i; j < n && op_lock(&ops[j]) == lock; j++) {
+	    ops[j].shard = shard_of(ops[j].name);
+	    /* Queries the cache answers need no lock */
+	    if (lock == LOCK_READ && qcache_lookup(ops[j].name, ops[j].shard,
+		    ops[j].response, sizeof(ops[j].response))) {
+		stats_key(ops[j].name);
+		ops[j].shard = -1;
+	    }
+	}
+	for (k = i; k < j; k++) {
+	    if ((s = ops[k].shard) < 0) continue;
+	    db_use(s);
+	    if (lock == LOCK_READ) db_read_lock();
+	    else db_write_lock();
+	    for (m = k; m < j; m++) {
+		if (ops[m].shard != s) continue;
+		execute_op(&ops[m], ops[m].response, sizeof(ops[m].response));
+		if (ops[m].lsn > lsn) lsn = ops[m].lsn;
+		ops[m].shard = -1;
+	    }
+	    if (lock == LOCK_READ) db_read_unlock();
+	    else db_write_unlock();
+	}
+    }
+    wal_commit(lsn);
+}
+
+/* Add command to the batch as its nth op.  Return the new count. */
+static int batch_add(op_t *ops, int n, char *command)
+{
+    memset(ops[n].response, 0, sizeof(ops[n].response));
+    parse_op(command, &ops[n], ops[n].response, sizeof(ops[n].response));
+    return n + 1;
+}
+
+/*
+ * Parse the command in command, execute it on the DB rooted at head and return
+ * a string describing the results.  Response must be a writable string that
+ * can hold len characters.  The response is stored in response.
+ */
+void interpret_command(char *command, char *response, int len)
+{
+    char name[256];
+    char hi[256];
+    op_t op;
+    op_t *ops;
+    char *line, *next, *cmd;
+    int n, i, used;
+    int limit;
+    int pin;
+
+    /* Every command but P has arguments */
+    if (strlen(command) <= 1 && command[0] != 'P') {
+	strncpy(response, "ill-formed command", len - 1);
+	return;
+    }
+
+    switch (command[0]) {
+    case 'q':
+    case 'a':
+    case 'd':
+	/* Query, add to or delete from the database */
+	if (!parse_op(command, &op, response, len)) return;
+
+	op.shard = shard_of(op.name);
+	if (op.code == 'q' && qcache_lookup(op.name, op.shard, response, len)) {
+	    stats_key(op.name);
+	    return;
+	}
+	db_use(op.shard);
+	if (op_lock(&op) == LOCK_READ) db_read_lock(); //Lock before database operation
+	else db_write_lock();
+	execute_op(&op, response, len);
+	if (op_lock(&op) == LOCK_READ) db_read_unlock(); //Unlock after database operation
+	else db_write_unlock();
+	/* Answer only once the change is durable */
+	wal_commit(op.lsn);
+	return;
+
+    case 'm':
+	/* Multi-key: mq k1 k2 ..., ma k1 v1 k2 v2 ..., md k1 k2 ..., all at
+	 * once */
+	multi_command(command, response, len);
+	return;
+
+    case 'u':
+	/* Update: u key value replaces the value of a key that is there */
+	if (sscanf(&command[1], "%255s %255s", name, hi) != 2) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+	update_command(name, hi, NULL, response, len);
+	return;
+
+    case 'c':
+	/* Compare and swap: c key old new updates the key only if its value
+	 * is old */
+	{
+	    char expect[256];
+
+	    if (sscanf(&command[1], "%255s %255s %255s", name, expect, hi) != 3) {
+		strncpy(response, "ill-formed command", len - 1);
+		return;
+	    }
+	    update_command(name, hi, expect, response, len);
+	}
+	return;
+
+    case 'r':
+	/* Range: r lo hi [limit], the keys from lo to hi inclusive */
+	name[0] = '\0';
+	limit = -1;
+	if (sscanf(&command[1], "%255s %255s %d", name, hi, &limit) < 2 ||
+		limit == 0 || limit < -1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+	range_scan(0, name, hi, NULL, limit, response, len);
+	return;
+
+    case 'R':
+	/* Range of a pinned view: R pin lo hi [limit] */
+	name[0] = '\0';
+	limit = -1;
+	if (sscanf(&command[1], "%d %255s %255s %d", &pin, name, hi,
+		&limit) < 3 || pin <= 0 || limit == 0 || limit < -1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+	range_scan(pin, name, hi, NULL, limit, response, len);
+	return;
+
+    case 'P':
+	/* Pin the database as it is now, for R; U releases the pin */
+	if ((pin = pin_create()) == -2)
+	    strncpy(response, "no pins on a shared database", len - 1);
+	else if (pin < 0)
+	    strncpy(response, "too many pins", len - 1);
+	else
+	    snprintf(response, len, "pinned %d", pin);
+	return;
+
+    case 'U':
+	if (sscanf(&command[1], "%d", &pin) != 1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+	strncpy(response, pin_release(pin) ? "released" : "no such pin",
+		len - 1);
+	return;
+
+    case 'p':
+	/* Prefix: p prefix [limit [from]], the keys starting with prefix */
+	name[0] = '\0';
+	limit = -1;
+	n = sscanf(&command[1], "%255s %d %255s", name, &limit, hi);
+	if (n < 1 || limit == 0 || limit < -1) {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+	range_scan(0, n == 3 ? hi : name, NULL, name, limit, response, len);
+	return;
+
+    case 'b':
+	/* A batch: b command; command; ...  The results come back in order,
+	 * separated the same way. */
+	ops = (op_t *) malloc(BATCH_MAX * sizeof(op_t));
+	if (!ops || !(line = strdup(&command[1]))) {
+	    free(ops);
+	    strncpy(response, "out of memory", len - 1);
+	    return;
+	}
+	response[0] = '\0';
+	used = 0;
+	next = line;
+	while (next) {
+	    for (n = 0; next && n < BATCH_MAX; ) {
+		cmd = strsep(&next, ";\n");
+		while (*cmd == ' ' || *cmd == '\t') cmd++;
+		if (*cmd) n = batch_add(ops, n, cmd);
+	    }
+	    execute_batch(ops, n);
+	    for (i = 0; i < n && used < len - 1; i++)
+		used += snprintf(response + used, len - used, "%s%s",
+			used ? "; " : "", ops[i].response);
+	}
+	free(line);
+	free(ops);
+	if (used == 0) strncpy(response, "ill-formed command", len - 1);
+	return;
+
+    case 'f':
+	/* process the commands in a file (silently), a batch at a time */
+	name[0] = '\0';
+	sscanf(&command[1], "%255s", name);
+	if (name[0] == '\0') {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+
+	{
+	    char ibuf[BATCH_MAX][256];
+	    FILE *finput = fopen(name, "r");
+	    if (!finput) {
+		strncpy(response, "bad file name", len - 1);
+		return;
+	    }
+	    if (!(ops = (op_t *) malloc(BATCH_MAX * sizeof(op_t)))) {
+		fclose(finput);
+		strncpy(response, "out of memory", len - 1);
+		return;
+	    }
+	    do {
+		for (n = 0; n < BATCH_MAX &&
+			fgets(ibuf[n], sizeof(ibuf[n]), finput) != 0; )
+		    n = batch_add(ops, n, ibuf[n]);
+		execute_batch(ops, n);
+	    } while (n == BATCH_MAX);
+	    free(ops);
+	    fclose(finput);
+	}
+	strncpy(response, "file processed", len - 1);
+	return;
+
+    case 'F':
+	/* Bulk load a file of adds, in parallel */
+	name[0] = '\0';
+	sscanf(&command[1], "%255s", name);
+	if (name[0] == '\0') {
+	    strncpy(response, "ill-formed command", len - 1);
+	    return;
+	}
+	bulk_load_file(name, response, len);
+	return;
+
+    default:
+	strncpy(response, "ill-formed command", len - 1);
+	return;
+    }
+}
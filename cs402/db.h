@@ -1,12 +1,111 @@
+#ifndef DB_H
+#define DB_H
 #include <pthread.h>
 
-typedef struct Node {
+/* The database index is a skip list.  A node of height h is linked into levels
+ * 0 .. h-1 and each level is a sorted list, so a search descends from the top
+ * level of the head sentinel in O(log n) expected steps no matter what order
+ * the keys arrived in.  MAX_LEVEL levels with p = 1/4 cover 4^16 keys. */
+#define MAX_LEVEL 16
+
+/* Pick the height of a new node: 1 with probability 3/4, 2 with 3/16 and so
+ * on.  The generator state is per-thread so concurrent inserts in the locking
+ * variants do not share (or race on) a seed. */
+static inline int random_level(void) {
+    static __thread unsigned int x = 0;
+    unsigned int r;
+    int level = 1;
+
+    /* Seed from the address of the thread's own copy of x */
+    if (x == 0) x = (unsigned int)(unsigned long) &x ^ 0x9e3779b9;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    for (r = x; (r & 3) == 0 && level < MAX_LEVEL; r >>= 2) level++;
+    return level;
+}
+
+/* Every variant provides these, and command.c calls them.  query, add and
+ * xremove are only called between the matching lock and unlock hooks; a
+ * variant that synchronizes inside the operations makes the hooks no-ops. */
+void query(char *, char *, int);
+int add(char *, char *);
+int xremove(char *);
+void db_read_lock(void);
+void db_read_unlock(void);
+void db_write_lock(void);
+void db_write_unlock(void);
+
+/* Replace name's value with value in place, if expect is NULL or is the
+ * current value.  The key keeps its node height, so nothing is unlinked and
+ * relinked elsewhere.  Return 1 if the value was replaced, 0 if name is not
+ * in the database and -1 if its value is not expect.  Called between the
+ * write lock hooks. */
+int update(char *, char *, char *);
+
+/* Multi-key operations (the mq, ma and md commands).  multi carries out the n
+ * operations in ops as one atomic step: no other operation sees some of them
+ * done and others not.  ops are sorted by shard and then by key, no key is
+ * there twice and all have the same code.  The caller holds the lock hooks
+ * of every shard involved, taken in increasing shard order: the write hooks,
+ * or for 'q' the read hooks if multi_read_locked. */
+#define MULTI_MAX 32
+
+typedef struct Multi {
+	char code;		/* 'q', 'a' or 'd' */
 	char *name;
-	char *value;
-	struct Node *lchild;
-	struct Node *rchild;
-} node_t;
+	char *value;		/* The value to add; for q, where the answer goes */
+	int len;		/* For q, room in value */
+	int shard;		/* shard_of(name) */
+	int done;		/* The add or delete was made */
+} multi_t;
+
+/* True if an mq may hold just the read lock hooks, because they keep
+ * writers out or the variant's multi locks what it reads.  In db_rcu a
+ * reader takes no lock, so there an mq takes the write hooks. */
+extern const int multi_read_locked;
+
+void multi(multi_t *, int);
+
+/* Ordered access, used by snapshots.  scan calls fn on every key not smaller
+ * than from, in key order, with its value, until fn returns false; the caller
+ * holds the read lock hooks.  A bulk load appends keys that arrive in
+ * increasing order in O(1) expected time each, with bulk_t remembering the
+ * last node on every level; the caller holds the write lock hooks and no
+ * other thread may be changing the database.  A key that is out of order is
+ * just added. */
+typedef struct Bulk {
+	void *last[MAX_LEVEL];
+} bulk_t;
+
+void scan(char *, int (*)(char *, char *, void *), void *);
+/* Return the number of keys and fill per_level[i], for every level, with the
+ * number of nodes linked on level i.  Caller holds the read lock hooks. */
+long shape(long *);
+void bulk_start(bulk_t *);
+int bulk_append(bulk_t *, char *, char *);
+/* True if the write lock hooks keep every other thread from changing the
+ * shard, so a bulk load may run while clients do.  In db_fine and
+ * db_optimistic they do not; there a live load adds its keys one by one. */
+extern const int bulk_online;
+
+/* The keyspace can be split into shards by a hash of the key (shard.c), each
+ * an independent index with its own head sentinel and its own database lock.
+ * db_shards creates shards 1 .. n-1 at startup, before any other call.
+ * db_use selects the shard that the calling thread's operations, scans, bulk
+ * loads and lock hooks apply to until its next db_use; every thread starts on
+ * shard 0. */
+#define MAX_SHARDS 256
+
+void db_shards(int);
+void db_use(int);
 
-extern node_t head;
+/* Keep the database in the shared memory segment file at path, so that other
+ * server processes attached to the same file serve the same data; only
+ * db_shm.c can, and every other variant fails.  A new segment is made with
+ * the given number of shards.  Called before anything else; returns the
+ * number of shards the segment has, or -1 if it cannot be attached. */
+int db_attach(char *, int);
 
 void interpret_command(char *, char *, int);
+#endif
@@ -1,358 +1,779 @@
-//#include "db.h"
+#include "db.h"
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include "slab.h"
+#include "key.h"
+#include "stats.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <sched.h>
+#include <time.h>
 
+/* A skip list node with its own lock.  The lock protects the node's next
+ * pointers (and, for the head, level) and deleted.  Names and values never
+ * change once a node is linked.  A search step compares prefix, the first
+ * thing in the node, and so only reads name on a tie. */
 typedef struct Node {
+	uint64_t prefix[2];	/* Of name; see key.h */
+	int len;		/* strlen(name) */
+	int level;
+	int deleted;		/* A tombstone, waiting to be unlinked */
 	char *name;
 	char *value;
-	struct Node *lchild;
-	struct Node *rchild;
 	pthread_rwlock_t rwlock_node;
+	struct Node *next[];
 } node_t;
 
-node_t head;
-
-void interpret_command(char *, char *, int);
+/*
+ * Locking protocol: every operation starts at head and only ever locks nodes
+ * further right in key order, so locks are always acquired in increasing key
+ * order and there is no deadlock.  Readers couple read locks (lock the next
+ * node, then release the current one).  Writers couple write locks, but keep
+ * the predecessor on each level the node being added or removed occupies, and
+ * only those, locked until the splice is done.  A node cannot be unlinked
+ * while any of its predecessors is locked, so reading next->name under the
+ * predecessor's lock is safe.
+ *
+ * A delete only marks the node a tombstone, under the node's own lock, so it
+ * holds one write lock instead of one per level.  Every operation treats a
+ * tombstone as absent (an add replaces it) and a background thread unlinks
+ * tombstones in batches, trying its locks and leaving any key that is busy
+ * for its next round.
+ */
+node_t head = { { 0, 0 }, 0, 1, 0, "", "", PTHREAD_RWLOCK_INITIALIZER, { [MAX_LEVEL - 1] = NULL } };
 
+/* Head sentinels of the shards (head is shard 0's) and the calling thread's */
+static node_t *heads[MAX_SHARDS] = { &head };
+static __thread node_t *root = &head;
 
-/* Forward declaration */
-node_t *search(char *, node_t *, node_t **, bool);
 
-node_t head = { "", "", 0, 0 };
 /*
- * Allocate a new node with the given key, value and children. Includes a rw lock.
+ * Allocate a new node with the given key and value and room for level forward
+ * pointers. Includes a rw lock.
  */
-node_t *node_create(char *arg_name, char *arg_value, node_t * arg_left,
-	node_t * arg_right) {
+node_t *node_create(char *arg_name, char *arg_value, int level) {
     node_t *new_node;
+    char *new_node_name, *new_node_value;
+    int i;
 
-    new_node = (node_t *) malloc(sizeof(node_t));
+    /* One slab block holds the node and, if they are short, its strings */
+    new_node = (node_t *) node_alloc(sizeof(node_t) + level * sizeof(node_t *),
+	    arg_name, arg_value, &new_node_name, &new_node_value);
     if (!new_node) return NULL;
+    new_node->name = new_node_name;
+    new_node->value = new_node_value;
+    key_prefix(new_node_name, new_node->prefix);
+    new_node->len = strlen(new_node_name);
 
-    if (!(new_node->name = (char *)malloc(strlen(arg_name) + 1))) {
-	free(new_node);
-	return NULL;
-    }
-
-    if (!(new_node->value = (char *)malloc(strlen(arg_value) + 1))) {
-	free(new_node->name);
-	free(new_node);
-	return NULL;
-    }
-	
 	if(pthread_rwlock_init(&new_node->rwlock_node, NULL) !=0)
 		{
 		printf("rwlock init error, exiting \n");
 		exit(1);
 		}
-    strcpy(new_node->name, arg_name);
-    strcpy(new_node->value, arg_value);
-    new_node->lchild = arg_left;
-    new_node->rchild = arg_right;
-    
+    new_node->level = level;
+    new_node->deleted = 0;
+    for (i = 0; i < level; i++) new_node->next[i] = NULL;
+
     return new_node;
 }
 
-/* Free the data structures in node and the node itself. */
+/* Free the data structures in node and the node itself.  Inline strings go
+ * back to the slab with the node. */
 void node_destroy(node_t * node) {
-    /* Clearing name and value after they are freed is defensive programming in
-     * case the node_destroy is called again. */
-    if (node->name) {free(node->name); node->name = NULL; }
-    if (node->value) { free(node->value); node->value = NULL; }
-	if (&node->rwlock_node) {pthread_rwlock_destroy(&node->rwlock_node);}
-    free(node);
+	pthread_rwlock_destroy(&node->rwlock_node);
+    node_free(node, sizeof(node_t) + node->level * sizeof(node_t *), node->name,
+	    node->value);
+}
+
+/* Lock a node, counting the acquisition and, if it had to wait, charging the
+ * wait to the node's key for the stats command.  Built as db_adaptive.o, the
+ * node locks are only taken while adaptive.c has the fine mode on; in its
+ * other modes the lock hooks keep everyone else out. */
+#ifdef ADAPTIVE
+extern int node_locking;
+#else
+#define node_locking 1
+#endif
+
+static inline void node_rdlock(node_t *node) {
+    if (node_locking)
+	stats_rdlock(&node->rwlock_node, LOCK_NODE_READ, node->name);
+}
+
+static inline void node_wrlock(node_t *node) {
+    if (node_locking)
+	stats_wrlock(&node->rwlock_node, LOCK_NODE_WRITE, node->name);
+}
+
+static inline void node_unlock(node_t *node) {
+    if (node_locking) pthread_rwlock_unlock(&node->rwlock_node);
+}
+
+/* Release the write locks on preds[0..level-1].  A node that is the
+ * predecessor on several adjacent levels appears in preds several times but
+ * was only locked once. */
+static void unlock_preds(node_t **preds, int level) {
+    int i;
+
+    for (i = 0; i < level; i++)
+	if (i == level - 1 || preds[i] != preds[i + 1])
+	    node_unlock(preds[i]);
+}
+
+/* Tombstones not unlinked yet, over all shards, and those unlinked so far */
+static long tombstones = 0;
+static long compacted = 0;
+
+static inline int is_deleted(node_t *node) {
+    return __atomic_load_n(&node->deleted, __ATOMIC_ACQUIRE);
+}
+
+/* Descend to name with read locks, hand over hand.  Return the node with key
+ * name, if any, with the predecessor it was found from read locked in
+ * *predp (the node cannot be unlinked until that is released); if there is
+ * none, nothing is left locked. */
+static node_t *find(char *name, node_t **predp) {
+    node_t *pred = root;
+    node_t *next = NULL;
+    search_key_t key;
+    int cmp = 1;
+    int i;
+
+    key_make(&key, name);
+    node_rdlock(pred);
+    for (i = pred->level - 1; i >= 0; i--) {
+	while ((next = pred->next[i]) && (cmp = NODE_CMP(next, &key)) < 0) {
+	    /* Hand over hand: lock next before letting go of pred */
+	    node_rdlock(next);
+	    node_unlock(pred);
+	    pred = next;
+	}
+	if (next && cmp == 0) {
+	    *predp = pred;
+	    return next;
+	}
+    }
+    node_unlock(pred);
+    return NULL;
 }
 
 /* Find the node with key name and return a result or error string in result.
- * Result must have space for len characters. */
+ * Result must have space for len characters.  The value is copied while the
+ * predecessor is still read locked, so the node cannot go away under us. */
 void query(char *name, char *result, int len) {
-    node_t *target;
+    node_t *target, *pred;
 
-    target = search(name, &head, NULL, false); //This will read lock the target
+    if ((target = find(name, &pred))) {
+	if (!is_deleted(target)) {
+	    strncpy(result, target->value, len - 1);
+	    node_unlock(pred);
+	    return;
+	}
+	node_unlock(pred);
+    }
+    strncpy(result, "not found", len - 1);
+}
 
-    if (!target) {
-	strncpy(result, "not found", len - 1);
-	return;
-    } else {
-	strncpy(result, target->value, len - 1);
-	pthread_rwlock_unlock(&target->rwlock_node);
-	return;
+/* Search for name with write locks, filling preds[i] with the last node on level
+ * i whose key is smaller than name.  *levelp is the number of levels whose
+ * predecessors the caller needs kept locked: the height of the node to be
+ * added, or 0 for a removal, in which case it is set to the height of the
+ * target once that is found.  On return exactly the distinct nodes in
+ * preds[0..*levelp-1] are write locked (release them with unlock_preds); a
+ * removal that finds nothing holds no locks.  Return the node with key name,
+ * if any.
+ *
+ * Levels above those in use are filled with head, which is then locked, so
+ * an add that grows the list can update head.level. */
+node_t *search(char *name, node_t ** preds, int *levelp) {
+    node_t *pred = root;
+    node_t *next = NULL;
+    node_t *result = NULL;
+    search_key_t key;
+    int cmp = 1;
+    int i;
+
+    key_make(&key, name);
+    node_wrlock(pred);
+    for (i = MAX_LEVEL - 1; i >= root->level; i--) preds[i] = root;
+
+    for (i = root->level - 1; i >= 0; i--) {
+	while ((next = pred->next[i]) && (cmp = NODE_CMP(next, &key)) < 0) {
+	    node_wrlock(next);
+	    /* Keep pred only if it is a predecessor we still need on a level
+	     * above this one. */
+	    if (!(i + 1 < *levelp && preds[i + 1] == pred))
+		node_unlock(pred);
+	    pred = next;
+	}
+	preds[i] = pred;
+	if (next && cmp == 0 && !result) {
+	    /* Found it on its top level.  For a removal, every level from
+	     * here down is one we must keep. */
+	    result = next;
+	    if (*levelp == 0) *levelp = next->level;
+	}
     }
+
+    /* Nothing is kept for a failed removal except the node we stopped on */
+    if (*levelp == 0) node_unlock(pred);
+    return result;
 }
 
+static void compact_start(void);
+
 /* Insert a node with name and value into the proper place in the DB rooted at
- * head. */
+ * head.  A tombstone with the key is unlinked as the new node goes in, which
+ * needs its predecessors on all its levels: if it is taller than the new
+ * node, the search is repeated to lock that many.  The new node keeps its own
+ * height, so replacing tombstones does not skew the level distribution. */
 int add(char *name, char *value) {
-	node_t *parent;	    /* The new node will be the child of this node */
-	node_t *target;	    /* The existing node with key name if any */
-	node_t *newnode;    /* The new node to add */
-
-	if ((target = search(name, &head, &parent, true))) {
-	    /* There is already a node with this key in the tree */
-		pthread_rwlock_unlock(&parent->rwlock_node);
-		pthread_rwlock_unlock(&target->rwlock_node);
-	    return 0;
+	node_t *preds[MAX_LEVEL];   /* The new node follows these on each level */
+	node_t *newnode;	    /* The new node to add */
+	node_t *target;		    /* A tombstone it replaces */
+	int level;		    /* Height of the new node */
+	int locked;		    /* Levels whose predecessors are locked */
+	int h;
+	int i;
+
+	level = locked = random_level();
+	for (;;) {
+	    if (!(target = search(name, preds, &locked))) break;
+	    /* There is already a node with this key in the list */
+	    node_wrlock(target);
+	    if (!target->deleted) {
+		node_unlock(target);
+		unlock_preds(preds, locked);
+		return 0;
+	    }
+	    if (target->level <= locked) break;
+	    /* Once unlocked the tombstone may be purged or replaced and its
+	     * memory reused, so read its height first */
+	    h = target->level;
+	    node_unlock(target);
+	    unlock_preds(preds, locked);
+	    locked = h;
 	}
 
-	/* No idea how this could happen, but... */
-	if (!parent) return 0;
+	/* make the new node and splice it in after its predecessors */
+	if (!(newnode = node_create(name, value, level))) {
+	    if (target) node_unlock(target);
+	    unlock_preds(preds, locked);
+	    return 0;
+	}
+	if (target)
+	    for (i = 0; i < target->level; i++)
+		preds[i]->next[i] = target->next[i];
+	for (i = 0; i < level; i++) {
+	    newnode->next[i] = preds[i]->next[i];
+	    preds[i]->next[i] = newnode;
+	}
+	/* If the list grew, head is the locked predecessor on the new levels.
+	 * Otherwise head may not be locked and must not be touched. */
+	if (preds[level - 1] == root && level > root->level) root->level = level;
+
+	/* Nobody can be waiting for the tombstone: they would need one of
+	 * the predecessors we hold */
+	if (target) {
+	    node_unlock(target);
+	    node_destroy(target);
+	    __atomic_fetch_sub(&tombstones, 1, __ATOMIC_RELAXED);
+	}
 
-	/* make the new node and attach it to parent */
-	newnode = node_create(name, value, 0, 0);
+	/* Unlock the predecessors now that they are changed */
+	unlock_preds(preds, locked);
+	return 1;
+}
 
-	if (strcmp(name, parent->name) < 0) parent->lchild = newnode;
-	else parent->rchild = newnode;
-	
-	/* Unlock the parent now that it is changed */
-	pthread_rwlock_unlock(&parent->rwlock_node);
+/* Delete the node with key name if it is there, by making it a tombstone.
+ * Return true if something was deleted.  This holds the predecessor the node
+ * was found from read locked, so it stays linked, and write locks just the
+ * node. */
+int xremove(char *name) {
+	node_t *dnode, *pred;
+	int done;
+	int wake = 0;
+
+	if (!(dnode = find(name, &pred))) return 0;
+	node_wrlock(dnode);
+	if ((done = !dnode->deleted)) {
+	    __atomic_store_n(&dnode->deleted, 1, __ATOMIC_RELEASE);
+	    wake = __atomic_fetch_add(&tombstones, 1, __ATOMIC_RELAXED) == 0;
+	}
+	node_unlock(dnode);
+	node_unlock(pred);
+	if (wake) compact_start();
+	return done;
+}
 
-	return 1;
+/* Replace name's value with a node of the same height taking the old one's
+ * place on every level.  The old node is write locked, as in xremove, so
+ * readers already on it have moved on before it is freed. */
+int update(char *name, char *value, char *expect) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of old on each level */
+	node_t *old, *newnode;
+	int level = 0;		    /* Height of old, once found */
+	int done;
+	int i;
+
+	if (!(old = search(name, preds, &level))) return 0;
+	/* A linked node's value never changes, and old cannot be unlinked
+	 * while we hold its predecessors */
+	node_wrlock(old);
+	if (old->deleted) done = 0;
+	else if (expect && strcmp(old->value, expect)) done = -1;
+	else done = (newnode = node_create(name, value, level)) != NULL;
+	if (done == 1)
+	    for (i = 0; i < level; i++) {
+		newnode->next[i] = old->next[i];
+		preds[i]->next[i] = newnode;
+	    }
+	node_unlock(old);
+	if (done == 1) node_destroy(old);
+	unlock_preds(preds, level);
+	return done;
 }
 
 /*
- * When deleting a node with 2 children, we swap the contents leftmost child of
- * its right subtree with the node to be deleted.  This is used to swap those
- * content pointers without copying the data, which is unsafe if the
- * allocations are different sizes (copying "alamorgodo" into "ny" for
- * example).
+ * Multi-key operations lock every node they need for all their keys before
+ * changing anything (two-phase locking), and only try the locks: if one is
+ * busy, everything is released and the whole operation starts again after a
+ * pause.  A thread that holds locks never waits for one, so this cannot
+ * deadlock with hand over hand operations, which wait but only ever in key
+ * order, or with other multi-key operations.  Queries read lock, changes
+ * write lock.
  */
-static inline void swap_pointers(char **a, char **b) {
-    char *tmp = *b;
-    *b = *a;
-    *a = tmp;
-}
 
-/* Remove the node with key name from the tree if it is there.  See inline
- * comments for algorithmic details.  Return true if something was deleted. */
-int xremove(char *name) {
-	node_t *parent;	    /* Parent of the node to delete */
-	node_t *dnode;	    /* Node to delete */
-	node_t *next;	    /* used to find leftmost child of right subtree */
-	node_t **pnext;	    /* A pointer in the tree that points to next so we
-			       can change that nodes children (see below). */
-
-	/* first, find the node to be removed */
-	if (!(dnode = search(name, &head, &parent, true))) {
-	    /* it's not there */
-		pthread_rwlock_unlock(&parent->rwlock_node);
-	    return 0;
-	}
+/* The nodes a multi-key operation holds, each once */
+typedef struct Held {
+	node_t *node[MULTI_MAX * (MAX_LEVEL + 1) + 2];
+	int n;
+	int write;		/* Write locks, not read locks */
+} held_t;
 
-	/* we found it.  Now check out the easy cases.  If the node has no
-	 * right child, then we can merely replace its parent's pointer to
-	 * it with the node's left child. */
-	if (dnode->rchild == 0) {
-	    if (strcmp(dnode->name, parent->name) < 0)
-		parent->lchild = dnode->lchild;
-	    else
-		parent->rchild = dnode->lchild;
-
-	    /* done with dnode */
-	    node_destroy(dnode);//dnode is destroyed, so no need to unlock
-	} else if (dnode->lchild == 0) {
-	    /* ditto if the node had no left child */
-	    if (strcmp(dnode->name, parent->name) < 0)
-		parent->lchild = dnode->rchild;
-	    else
-		parent->rchild = dnode->rchild;
-
-	    /* done with dnode */
-	    node_destroy(dnode);//dnode is destroyed, so no need to unlock
-	} else {
-	    /* So much for the easy cases ...
-	     * We know that all nodes in a node's right subtree have
-	     * lexicographically greater names than the node does, and all
-	     * nodes in a node's left subtree have lexicographically smaller
-	     * names than the node does. So, we find the lexicographically
-	     * smallest node in the right subtree and replace the node to be
-	     * deleted with that node. This new node thus is lexicographically
-	     * smaller than all nodes in its right subtree, and greater than
-	     * all nodes in its left subtree. Thus the modified tree is well
-	     * formed. */
-
-	    /* pnext is the address of the pointer which points to next (either
-	     * parent's lchild or rchild) */
-	    pnext = &dnode->rchild;
-	    next = *pnext;
-		
-		/* Lock the next person before the check it */
-		pthread_rwlock_wrlock(&next->rwlock_node);
-		
-	    while (next->lchild != 0) {
-		    /* work our way down the lchild chain, finding the smallest
-		     * node in the subtree. */
-		    pnext = &next->lchild;
-			
-			/* Lock the next to be searched, unlock what we are no longer using */
-			pthread_rwlock_wrlock(&(*pnext)->rwlock_node);
-			pthread_rwlock_unlock(&next->rwlock_node);
-			
-		    next = *pnext;
-	    }
-	    swap_pointers(&dnode->name, &next->name);
-	    swap_pointers(&dnode->value, &next->value);
-	    *pnext = next->rchild;
+static int held_index(held_t *h, node_t *node) {
+    int i;
 
-	    node_destroy(next); //Next is destroyed, so no need to unlock
-		pthread_rwlock_unlock(&dnode->rwlock_node);
-    }
-	
-	/* Unlock the parent, regardless of what happens */
-	pthread_rwlock_unlock(&parent->rwlock_node);
+    for (i = h->n - 1; i >= 0; i--)
+	if (h->node[i] == node) return i;
+    return -1;
+}
+
+/* Lock node unless it is held already.  Return false if it is busy. */
+static int held_lock(held_t *h, node_t *node) {
+    if (held_index(h, node) >= 0) return 1;
+    if (node_locking && (h->write ? pthread_rwlock_trywrlock(&node->rwlock_node) :
+	    pthread_rwlock_tryrdlock(&node->rwlock_node)) != 0)
+	return 0;
+    h->node[h->n++] = node;
     return 1;
 }
 
-/* Search the tree, starting at parent, for a node containing name (the "target
- * node").  Return a pointer to the node, if found, otherwise return 0.  If
- * parentpp is not 0, then it points to a location at which the address of the
- * parent of the target node is stored.  If the target node is not found, the
- * location pointed to by parentpp is set to what would be the the address of
- * the parent of the target node, if it were there.
- *
- * Assumptions:
- * parent is not null and it does not contain name */
-node_t *search(char *name, node_t * parent, node_t ** parentpp, bool write_lock) {
+/* Unlock node if it was locked at or after position base of h */
+static void held_drop(held_t *h, node_t *node, int base) {
+    int i = held_index(h, node);
 
-    node_t *next;
-    node_t *result;
-	
-	/* Either read or write lock the parent */
-	if (write_lock) {
-		pthread_rwlock_wrlock(&parent->rwlock_node);
-		}
-	else {
-		pthread_rwlock_rdlock(&parent->rwlock_node);
-	}
+    if (i < base) return;
+    node_unlock(node);
+    h->node[i] = h->node[--h->n];
+}
 
-    if (strcmp(name, parent->name) < 0) next = parent->lchild;
-    else next = parent->rchild;
-	
-    if (next == NULL) {
-		result = NULL;
-    } else {
-		/* Either read or write lock the next node, if it exists */
-		if (write_lock) {
-			pthread_rwlock_wrlock(&next->rwlock_node);
-		} else {
-			pthread_rwlock_rdlock(&next->rwlock_node);
-		}
-	
-		if (strcmp(name, next->name) == 0) {
-			/* Note that this falls through to the if (parentpp .. ) statement
-			 * below. */
-			result = next;
-		} else {
-			/* "We have to go deeper!" This recurses and returns from here
-			 * after the recursion has returned result and set parentpp */
-			pthread_rwlock_unlock(&parent->rwlock_node); //Unlock Parent now, since we know we are not there
-			result = search(name, next, parentpp, write_lock);
-			
-			/*Since we acquire a lock on next during search when it i called the search's parent, we need to unlock it, but only the read ones */
-			if (!write_lock) pthread_rwlock_unlock(&next->rwlock_node); 
-			return result;
-		}
+static void held_release(held_t *h) {
+    while (h->n > 0) node_unlock(h->node[--h->n]);
+}
+
+/* Descend to op's key as search does, trying locks instead of waiting for
+ * them and keeping whatever earlier keys hold.  The predecessors are kept
+ * locked on the *levelp lowest levels; *levelp is the height of the node to
+ * add, or 0 to unlink, which becomes the height of the target if there is one
+ * and 1 if not.  Return false if a lock was busy; *targetp is the node with
+ * op's key, if any, and is locked too. */
+static int multi_search(held_t *h, multi_t *op, node_t **preds,
+	node_t **targetp, int *levelp) {
+    node_t *start = heads[op->shard];
+    node_t *pred = start;
+    node_t *next = NULL;
+    search_key_t key;
+    int base = h->n;
+    int cmp = 1;
+    int i;
+
+    *targetp = NULL;
+    key_make(&key, op->name);
+    if (!held_lock(h, pred)) return 0;
+    for (i = MAX_LEVEL - 1; i >= start->level; i--) preds[i] = start;
+
+    for (i = start->level - 1; i >= 0; i--) {
+	while ((next = pred->next[i]) && (cmp = NODE_CMP(next, &key)) < 0) {
+	    if (!held_lock(h, next)) return 0;
+	    if (!(i + 1 < *levelp && preds[i + 1] == pred))
+		held_drop(h, pred, base);
+	    pred = next;
+	}
+	preds[i] = pred;
+	if (next && cmp == 0 && !*targetp) {
+	    *targetp = next;
+	    if (*levelp == 0) *levelp = next->level;
+	}
     }
+    if (*levelp == 0) *levelp = 1;
+    return !(*targetp && !held_lock(h, *targetp));
+}
 
-    /* record a parent if we are looking for one */
-    if (parentpp != 0) {*parentpp = parent;}
-	else {pthread_rwlock_unlock(&parent->rwlock_node);}
+/* Carry out ops atomically: lock what every key needs, then make the changes
+ * from the last key to the first.  A change only touches nodes after the
+ * predecessors of smaller keys, so those stay right.  Queries and removals
+ * need only their targets; an add that replaces a tombstone unlinks it, so
+ * it needs predecessors on at least as many levels as the tombstone has. */
+void multi(multi_t *ops, int n) {
+    node_t *preds[MULTI_MAX][MAX_LEVEL];
+    node_t *targets[MULTI_MAX];
+    node_t *removed[MULTI_MAX];
+    int levels[MULTI_MAX];	/* Levels whose predecessors are locked */
+    int heights[MULTI_MAX];	/* Height of an add's new node */
+    int forced[MULTI_MAX];	/* Levels an add must lock, or 0 */
+    node_t *newnode, *start, *target;
+    struct timespec pause;
+    held_t h;
+    int i, j, k, tries;
+    int wake = 0;
+
+    h.n = 0;
+    h.write = ops[0].code != 'q';
+    for (j = 0; j < n; j++) forced[j] = 0;
+    for (tries = 0; ; tries++) {
+	for (j = 0; j < n; j++) {
+	    levels[j] = 1;
+	    if (ops[j].code == 'a') {
+		heights[j] = random_level();
+		levels[j] = heights[j] > forced[j] ? heights[j] : forced[j];
+	    }
+	    if (!multi_search(&h, &ops[j], preds[j], &targets[j], &levels[j]))
+		break;
+	    if ((target = targets[j]) && ops[j].code == 'a' &&
+		    target->deleted && target->level > levels[j]) {
+		forced[j] = target->level;
+		break;
+	    }
+	}
+	if (j == n) break;
+	held_release(&h);
+	/* Back off for longer the more often we lose */
+	if (tries < 4) {
+	    sched_yield();
+	} else {
+	    pause.tv_sec = 0;
+	    pause.tv_nsec = (random_level() * 1000L) << (tries < 14 ? tries - 4 : 10);
+	    nanosleep(&pause, NULL);
+	}
+    }
 
-    return (result);
+    for (k = 0, j = n - 1; j >= 0; j--) {
+	start = heads[ops[j].shard];
+	target = targets[j];
+	switch (ops[j].code) {
+	case 'q':
+	    strncpy(ops[j].value, target && !target->deleted ? target->value :
+		    "not found", ops[j].len - 1);
+	    break;
+	case 'a':
+	    if (target && !target->deleted) {
+		ops[j].done = 0;
+		break;
+	    }
+	    if (!(ops[j].done =
+		    (newnode = node_create(ops[j].name, ops[j].value, heights[j])) != NULL))
+		break;
+	    if (target) {
+		for (i = 0; i < target->level; i++)
+		    preds[j][i]->next[i] = target->next[i];
+		removed[k++] = target;
+	    }
+	    for (i = 0; i < heights[j]; i++) {
+		newnode->next[i] = preds[j][i]->next[i];
+		preds[j][i]->next[i] = newnode;
+	    }
+	    if (preds[j][heights[j] - 1] == start && heights[j] > start->level)
+		start->level = heights[j];
+	    break;
+	case 'd':
+	    if ((ops[j].done = target && !target->deleted)) {
+		__atomic_store_n(&target->deleted, 1, __ATOMIC_RELEASE);
+		if (__atomic_fetch_add(&tombstones, 1, __ATOMIC_RELAXED) == 0)
+		    wake = 1;
+	    }
+	    break;
+	}
+    }
+    held_release(&h);
+    __atomic_fetch_sub(&tombstones, k, __ATOMIC_RELAXED);
+    while (k > 0) node_destroy(removed[--k]);
+    if (wake) compact_start();
 }
 
 /*
- * Parse the command in command, execute it on the DB rooted at head and return
- * a string describing the results.  Response must be a writable string that
- * can hold len characters.  The response is stored in response.
+ * Compaction.  A thread started by the first delete sleeps until there are
+ * tombstones (a delete that makes the first one signals cond_compact), then
+ * every COMPACT_INTERVAL_MS while there still are, shard by shard, collects
+ * up to COMPACT_BATCH tombstones on a read-only walk, then unlinks each one with multi_search's
+ * trylocks.  A tombstone whose nodes are busy is left for the next round, so
+ * compaction only does its work where the list is quiet; a full batch means
+ * there may be more, and unless none of it could be unlinked the shard is gone
+ * over again at once.
  */
-void interpret_command(char *command, char *response, int len)
-{
-    char value[256];
-    char ibuf[256];
-    char name[256];
-
-    if (strlen(command) <= 1) {
-	strncpy(response, "ill-formed command", len - 1);
-	return;
+#define COMPACT_INTERVAL_MS 100
+#define COMPACT_BATCH 64
+
+static int nheads = 1;
+static pthread_once_t compact_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mutex_compact = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_compact = PTHREAD_COND_INITIALIZER;
+
+/* Unlink the tombstone with key name from shard, if nothing it needs is
+ * locked.  Called with the shard's write hook held.  Return true if it was
+ * unlinked. */
+static int purge(int shard, char *name) {
+    node_t *preds[MAX_LEVEL];
+    node_t *start = heads[shard];
+    node_t *target;
+    multi_t op;
+    held_t h;
+    int level = 0;
+    int i;
+
+    op.code = 'd';
+    op.name = name;
+    op.shard = shard;
+    h.n = 0;
+    h.write = 1;
+    if (!multi_search(&h, &op, preds, &target, &level) || !target ||
+	    !target->deleted) {
+	held_release(&h);
+	return 0;
     }
+    for (i = 0; i < level; i++) preds[i]->next[i] = target->next[i];
+    if (preds[level - 1] == start)
+	while (start->level > 1 && start->next[start->level - 1] == NULL)
+	    start->level--;
+    held_release(&h);
+    node_destroy(target);
+    __atomic_fetch_sub(&tombstones, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&compacted, 1, __ATOMIC_RELAXED);
+    return 1;
+}
 
-    switch (command[0]) {
-    case 'q':
-	/* Query */
-	sscanf(&command[1], "%255s", name);
-	if (strlen(name) == 0) {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
-	}
+/* Copy the names of up to COMPACT_BATCH tombstones of shard into names,
+ * walking level 0 hand over hand.  Return how many. */
+static int collect(int shard, char **names) {
+    node_t *pred = heads[shard];
+    node_t *next;
+    int n = 0;
+
+    node_rdlock(pred);
+    while (n < COMPACT_BATCH && (next = pred->next[0])) {
+	node_rdlock(next);
+	node_unlock(pred);
+	pred = next;
+	if (is_deleted(pred) && (names[n] = strdup(pred->name))) n++;
+    }
+    node_unlock(pred);
+    return n;
+}
 
-	query(name, response, len);
-	if (strlen(response) == 0) {
-	    strncpy(response, "not found", len - 1);
+static void *compact_run(void *arg) {
+    char *names[COMPACT_BATCH];
+    struct timespec pause;
+    int shard, n, purged, i;
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = COMPACT_INTERVAL_MS * 1000000L;
+    for (;;) {
+	/* Idle until a delete leaves something to do */
+	pthread_mutex_lock(&mutex_compact);
+	while (__atomic_load_n(&tombstones, __ATOMIC_RELAXED) == 0)
+	    pthread_cond_wait(&cond_compact, &mutex_compact);
+	pthread_mutex_unlock(&mutex_compact);
+	nanosleep(&pause, NULL);
+	for (shard = 0; shard < nheads; shard++) {
+	    db_use(shard);
+	    do {
+		db_read_lock();
+		n = collect(shard, names);
+		db_read_unlock();
+		for (purged = i = 0; i < n; i++) {
+		    db_write_lock();
+		    purged += purge(shard, names[i]);
+		    db_write_unlock();
+		    free(names[i]);
+		}
+	    } while (n == COMPACT_BATCH && purged > 0);
 	}
+    }
+    return NULL;
+}
 
-	return;
+/* The stats command's report of deletes not yet compacted */
+void tombstone_print(FILE *out) {
+    fprintf(out, "tombstones: %ld waiting, %ld compacted\n",
+	    __atomic_load_n(&tombstones, __ATOMIC_RELAXED),
+	    __atomic_load_n(&compacted, __ATOMIC_RELAXED));
+}
 
-    case 'a':
-	/* Add to the database */
-	sscanf(&command[1], "%255s %255s", name, value);
-	if ((strlen(name) == 0) || (strlen(value) == 0)) {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
-	}
+static void compact_thread(void) {
+    pthread_t thread;
 
-	if (add(name, value)) {
-	    strncpy(response, "added", len - 1);
-	} else {
-	    strncpy(response, "already in database", len - 1);
-	}
+    if (pthread_create(&thread, NULL, compact_run, NULL) == 0)
+	pthread_detach(thread);
+    else
+	perror("compaction");
+}
 
-	return;
+/* There were no tombstones and now there are: start the compaction thread
+ * the first time, and wake it.  Taking the mutex means the thread is either
+ * about to see the count or already waiting for the signal. */
+static void compact_start(void) {
+    pthread_once(&compact_once, compact_thread);
+    pthread_mutex_lock(&mutex_compact);
+    pthread_cond_signal(&cond_compact);
+    pthread_mutex_unlock(&mutex_compact);
+}
 
-    case 'd':
-	/* Delete from the database */
-	sscanf(&command[1], "%255s", name);
-	if (strlen(name) == 0) {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
+/* Call fn on every key not smaller than from, in order, until it returns
+ * false.  This descends like query and then walks level 0 hand over hand, so
+ * fn is called with the node it is given read locked. */
+void scan(char *from, int (*fn)(char *, char *, void *), void *arg) {
+    node_t *pred = root;
+    node_t *next;
+    search_key_t key;
+    int i;
+
+    key_make(&key, from);
+    node_rdlock(pred);
+    for (i = pred->level - 1; i >= 0; i--)
+	while ((next = pred->next[i]) && NODE_CMP(next, &key) < 0) {
+	    node_rdlock(next);
+	    node_unlock(pred);
+	    pred = next;
 	}
+    while ((next = pred->next[0])) {
+	node_rdlock(next);
+	node_unlock(pred);
+	pred = next;
+	if (!is_deleted(pred) && !fn(pred->name, pred->value, arg)) break;
+    }
+    node_unlock(pred);
+}
 
-	if (xremove(name)) {
-	    strncpy(response, "removed", len - 1);
-	} else {
-	    strncpy(response, "not in database", len - 1);
-	}
+/* Count the nodes on each level, from the heights of the nodes on level 0,
+ * walking hand over hand as scan does */
+long shape(long *per_level) {
+    node_t *pred = root;
+    node_t *next;
+    long nodes = 0;
+    int i;
+
+    for (i = 0; i < MAX_LEVEL; i++) per_level[i] = 0;
+    node_rdlock(pred);
+    while ((next = pred->next[0])) {
+	node_rdlock(next);
+	node_unlock(pred);
+	pred = next;
+	if (is_deleted(pred)) continue;
+	nodes++;
+	for (i = 0; i < pred->level; i++) per_level[i]++;
+    }
+    node_unlock(pred);
+    return nodes;
+}
 
-	    return;
+/* The hooks take no lock, so appending nodes unlocked is only safe when no
+ * client is running */
+const int bulk_online = 0;
+/* multi locks the nodes an mq reads when node locks are on; when they are
+ * off (adaptive's mutex and rw modes) the read hooks keep writers out */
+const int multi_read_locked = 1;
+
+/* Start a bulk load: find the last node on every level */
+void bulk_start(bulk_t *bulk) {
+    node_t *pred = root;
+    int i;
+
+    for (i = MAX_LEVEL - 1; i >= 0; i--) {
+	while (pred->next[i]) pred = pred->next[i];
+	bulk->last[i] = pred;
+    }
+}
 
-    case 'f':
-	/* process the commands in a file (silently) */
-	sscanf(&command[1], "%255s", name);
-	if (name[0] == '\0') {
-	    strncpy(response, "ill-formed command", len - 1);
-	    return;
+/* Append name, which must sort after every key in the list, by linking a new
+ * node after the last node on each of its levels.  Nobody else is changing
+ * the list, so no node locks are needed. */
+int bulk_append(bulk_t *bulk, char *name, char *value) {
+	node_t **last = (node_t **) bulk->last;
+	node_t *newnode;
+	int level;
+	int done;
+	int i;
+
+	if (last[0] != root && strcmp(last[0]->name, name) >= 0) {
+	    /* Out of order.  The new node may land after some last[i]. */
+	    done = add(name, value);
+	    for (i = 0; i < MAX_LEVEL; i++)
+		while (last[i]->next[i]) last[i] = last[i]->next[i];
+	    return done;
 	}
 
-	{
-	    FILE *finput = fopen(name, "r");
-	    if (!finput) {
-		strncpy(response, "bad file name", len - 1);
-		return;
-	    }
-	    while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-		interpret_command(ibuf, response, len);
-	    }
-	    fclose(finput);
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+	for (i = 0; i < level; i++) {
+	    last[i]->next[i] = newnode;
+	    last[i] = newnode;
 	}
-	strncpy(response, "file processed", len - 1);
-	return;
+	if (level > root->level) root->level = level;
+	return 1;
+}
 
-    default:
-	strncpy(response, "ill-formed command", len - 1);
-	return;
+#ifndef ADAPTIVE
+/* There is no database-wide lock: query, add and xremove lock the nodes they
+ * touch themselves. */
+void db_read_lock() { }
+void db_read_unlock() { }
+void db_write_lock() { }
+void db_write_unlock() { }
+#else
+/* adaptive.c adds its shard locks around these */
+#define db_shards index_shards
+#define db_use index_use
+#endif
+
+/* Make the head sentinels of shards 1 .. n-1.  The node locks are the only
+ * locks, so there is nothing else to a shard. */
+void db_shards(int n) {
+    int i;
+
+#ifndef ADAPTIVE
+    /* The stats report tombstones from the start, not from the first delete */
+    stats_variant = tombstone_print;
+#endif
+    for (i = 1; i < n; i++) {
+	if (!(heads[i] = (node_t *) calloc(1, sizeof(node_t) +
+		MAX_LEVEL * sizeof(node_t *)))) {
+	    perror("db_shards");
+	    exit(1);
+	}
+	heads[i]->name = heads[i]->value = "";
+	heads[i]->level = 1;
+	pthread_rwlock_init(&heads[i]->rwlock_node, NULL);
     }
+    nheads = n;
+}
+
+void db_use(int shard) { root = heads[shard]; }
+
+/* The database lives in this process's heap and cannot be shared */
+int db_attach(char *path, int shards) {
+    fprintf(stderr, "%s: this server cannot share its database\n", path);
+    return -1;
 }
@@ -0,0 +1,634 @@
+#include "db.h"
+#include "epoch.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "slab.h"
+#include "key.h"
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "stats.h"
+
+/* A skip list node with a version counter in place of a lock.  The version
+ * is odd while a writer holds the node and goes up by two on every release,
+ * so a reader that sees the same even version before and after looking at
+ * the node's next pointers knows nobody changed them meanwhile. */
+typedef struct Node {
+	uint64_t prefix[2];	/* Of name; see key.h */
+	int len;		/* strlen(name) */
+	unsigned int version;	/* odd while write locked */
+	int marked;		/* 1: logically deleted, being unlinked; 2: being
+				 * replaced by update, still live */
+	int fully_linked;	/* linked on all of its levels */
+	int level;
+	char *name;
+	char *value;
+	struct Node *next[];
+} node_t;
+
+/*
+ * Optimistic (lazy) skip list.  Nobody locks anything on the way down: each
+ * step reads the current node's version, follows its link, and validates the
+ * version, starting over from head if a writer got in.  Readers therefore
+ * never write shared memory.  Writers lock just the nodes whose links they
+ * change, the predecessors of the node they add or remove plus the removed
+ * node itself, check that the predecessors are still live and still point
+ * where the search said, and retry the whole operation if not.  Locks are
+ * taken from level 0 up, which is decreasing key order in every thread.
+ *
+ * Nodes are read without locks, so a removed node is handed to epoch_retire
+ * and both readers and writers run inside an epoch critical section.
+ */
+node_t head = { { 0, 0 }, 0, 0, 0, 1, MAX_LEVEL, "", "", { [MAX_LEVEL - 1] = NULL } };
+
+/* Head sentinels of the shards (head is shard 0's) and the calling thread's */
+static node_t *heads[MAX_SHARDS] = { &head };
+static __thread node_t *root = &head;
+
+
+/*
+ * Allocate a new node with the given key and value and room for level forward
+ * pointers.  The pointers are left NULL for the caller to link.
+ */
+node_t *node_create(char *arg_name, char *arg_value, int level) {
+    node_t *new_node;
+    char *new_node_name, *new_node_value;
+    int i;
+
+    /* One slab block holds the node and, if they are short, its strings */
+    new_node = (node_t *) node_alloc(sizeof(node_t) + level * sizeof(node_t *),
+	    arg_name, arg_value, &new_node_name, &new_node_value);
+    if (!new_node) return NULL;
+    new_node->name = new_node_name;
+    new_node->value = new_node_value;
+    key_prefix(new_node_name, new_node->prefix);
+    new_node->len = strlen(new_node_name);
+
+    new_node->version = 0;
+    new_node->marked = 0;
+    new_node->fully_linked = 0;
+    new_node->level = level;
+    for (i = 0; i < level; i++) new_node->next[i] = NULL;
+
+    return new_node;
+}
+
+/* Free the data structures in node and the node itself.  Inline strings go
+ * back to the slab with the node. */
+void node_destroy(node_t * node) {
+    node_free(node, sizeof(node_t) + node->level * sizeof(node_t *), node->name,
+	    node->value);
+}
+
+/* node_destroy with the signature epoch_retire wants */
+static void node_retire(void *node) {
+    node_destroy((node_t *) node);
+}
+
+/* Take the node's version lock: move it from even to odd.  Time spent
+ * spinning is counted for the stats command. */
+static void node_lock(node_t *node) {
+    unsigned int v;
+    long start = -1;
+
+    for (;;) {
+	v = __atomic_load_n(&node->version, __ATOMIC_RELAXED);
+	if (!(v & 1) && __atomic_compare_exchange_n(&node->version, &v, v + 1,
+		    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    break;
+	if (start == -1) start = stats_now();
+	sched_yield();
+    }
+    stats_lock(LOCK_NODE_WRITE, node->name, start == -1 ? -1 : stats_now() - start);
+}
+
+/* Release the version lock, publishing a new even version */
+static void node_unlock(node_t *node) {
+    __atomic_store_n(&node->version,
+	    __atomic_load_n(&node->version, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+/* Return the node's version once no writer holds it */
+static unsigned int read_begin(node_t *node) {
+    unsigned int v;
+
+    while ((v = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE)) & 1)
+	sched_yield();
+    return v;
+}
+
+/* True if the node has not been locked since read_begin returned v */
+static int read_validate(node_t *node, unsigned int v) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == v;
+}
+
+/* Release the locks on preds[0..highest].  A node that is the predecessor on
+ * several adjacent levels was only locked once. */
+static void unlock_preds(node_t **preds, int highest) {
+    int i;
+
+    for (i = 0; i <= highest; i++)
+	if (i == highest || preds[i] != preds[i + 1])
+	    node_unlock(preds[i]);
+}
+
+/* Lock preds[0..level-1] and check that each is still live and still links
+ * to succs[i] on level i (succ is the node being removed, if remove is set,
+ * otherwise it must not be marked either).  Return true if so; on failure
+ * everything is unlocked again. */
+static int lock_preds(node_t **preds, node_t **succs, int level, int remove) {
+    node_t *pred, *succ;
+    node_t *prev = NULL;
+    int valid = 1;
+    int highest = -1;
+    int i;
+
+    for (i = 0; valid && i < level; i++) {
+	pred = preds[i];
+	succ = succs[i];
+	if (pred != prev) {
+	    node_lock(pred);
+	    highest = i;
+	    prev = pred;
+	}
+	valid = !__atomic_load_n(&pred->marked, __ATOMIC_ACQUIRE) &&
+	    (remove || !succ || !__atomic_load_n(&succ->marked, __ATOMIC_ACQUIRE)) &&
+	    pred->next[i] == succ;
+    }
+    if (!valid) unlock_preds(preds, highest);
+    return valid;
+}
+
+/* Walk from head to name without taking any lock.  preds[i] is set to the
+ * last node on level i whose key is smaller than name and succs[i] to the
+ * node after it.  Return the highest level on which name was found, or -1. */
+static int search(char *name, node_t ** preds, node_t ** succs) {
+    node_t *pred, *next;
+    search_key_t key;
+    unsigned int v;
+    int found, cmp, i;
+
+    key_make(&key, name);
+retry:
+    found = -1;
+    pred = root;
+    v = read_begin(pred);
+    for (i = MAX_LEVEL - 1; i >= 0; i--) {
+	for (;;) {
+	    next = __atomic_load_n(&pred->next[i], __ATOMIC_ACQUIRE);
+	    cmp = next ? NODE_CMP(next, &key) : 1;
+	    /* A writer changed pred while we looked: start over */
+	    if (!read_validate(pred, v)) goto retry;
+	    if (cmp >= 0) break;
+	    pred = next;
+	    v = read_begin(pred);
+	}
+	if (found == -1 && cmp == 0) found = i;
+	preds[i] = pred;
+	succs[i] = next;
+    }
+    return found;
+}
+
+/* Find the node with key name and return a result or error string in result.
+ * Result must have space for len characters. */
+void query(char *name, char *result, int len) {
+    node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+    node_t *target;
+    int found;
+
+    found = search(name, preds, succs);
+    target = (found >= 0) ? succs[found] : NULL;
+
+    /* A node only counts once it is fully linked and until it is marked
+     * deleted.  One being replaced holds the value until its replacement is
+     * linked in. */
+    if (!target || !__atomic_load_n(&target->fully_linked, __ATOMIC_ACQUIRE) ||
+	    __atomic_load_n(&target->marked, __ATOMIC_ACQUIRE) == 1) {
+	strncpy(result, "not found", len - 1);
+	return;
+    } else {
+	strncpy(result, target->value, len - 1);
+	return;
+    }
+}
+
+/* Insert a node with name and value into the list rooted at head.  Return
+ * false if the key is already there. */
+int add(char *name, char *value) {
+	node_t *preds[MAX_LEVEL];   /* The new node follows these on each level */
+	node_t *succs[MAX_LEVEL];   /* ... and precedes these */
+	node_t *newnode;	    /* The new node to add */
+	node_t *target;
+	int level = random_level(); /* Height of the new node */
+	int found;
+	int i;
+
+	for (;;) {
+	    if ((found = search(name, preds, succs)) != -1) {
+		target = succs[found];
+		if (__atomic_load_n(&target->marked, __ATOMIC_ACQUIRE) != 1) {
+		    /* Already there; wait for its insert to finish so a query
+		     * right after this sees it. */
+		    while (!__atomic_load_n(&target->fully_linked, __ATOMIC_ACQUIRE))
+			sched_yield();
+		    return 0;
+		}
+		/* It is being removed; try again once it is gone */
+		sched_yield();
+		continue;
+	    }
+	    if (lock_preds(preds, succs, level, 0)) break;
+	}
+
+	if (!(newnode = node_create(name, value, level))) {
+	    unlock_preds(preds, level - 1);
+	    return 0;
+	}
+	for (i = 0; i < level; i++) newnode->next[i] = succs[i];
+	for (i = 0; i < level; i++)
+	    __atomic_store_n(&preds[i]->next[i], newnode, __ATOMIC_RELEASE);
+	__atomic_store_n(&newnode->fully_linked, 1, __ATOMIC_RELEASE);
+
+	unlock_preds(preds, level - 1);
+	return 1;
+}
+
+/* Remove the node with key name from the list if it is there.  Return true if
+ * something was deleted. */
+int xremove(char *name) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of dnode on each level */
+	node_t *succs[MAX_LEVEL];
+	node_t *dnode = NULL;	    /* Node to delete */
+	int level = 0;		    /* Height of dnode */
+	int found;
+	int i;
+
+	for (;;) {
+	    found = search(name, preds, succs);
+	    if (!dnode) {
+		/* Only a fully linked node found on its top level is ours to
+		 * remove; anything else is mid-insert or mid-remove. */
+		if (found == -1) return 0;
+		dnode = succs[found];
+		if (__atomic_load_n(&dnode->marked, __ATOMIC_ACQUIRE) == 2) {
+		    /* Being replaced; remove the replacement instead */
+		    dnode = NULL;
+		    sched_yield();
+		    continue;
+		}
+		if (!__atomic_load_n(&dnode->fully_linked, __ATOMIC_ACQUIRE) ||
+			dnode->level - 1 != found ||
+			__atomic_load_n(&dnode->marked, __ATOMIC_ACQUIRE))
+		    return 0;
+
+		/* Claim it by marking it under its own lock */
+		node_lock(dnode);
+		if (dnode->marked) {
+		    node_unlock(dnode);
+		    if (dnode->marked == 1) return 0;
+		    dnode = NULL;
+		    continue;
+		}
+		__atomic_store_n(&dnode->marked, 1, __ATOMIC_RELEASE);
+		level = dnode->level;
+	    }
+	    /* dnode stays locked and marked; retry until its predecessors
+	     * hold still long enough to unlink it */
+	    if (lock_preds(preds, succs, level, 1)) break;
+	}
+
+	for (i = level - 1; i >= 0; i--)
+	    __atomic_store_n(&preds[i]->next[i], dnode->next[i], __ATOMIC_RELEASE);
+	node_unlock(dnode);
+	unlock_preds(preds, level - 1);
+
+	/* Lock-free readers may still be on dnode; free it after they leave */
+	epoch_retire(dnode, node_retire);
+	return 1;
+}
+
+/* Replace name's value with a node of the same height.  The old node is
+ * claimed like a removal, but marked as being replaced, which readers treat
+ * as still live and writers as a reason to retry.  The new node takes its
+ * place on every level under the predecessors' locks; the old node's own
+ * links are left alone, so a scan on it carries on past the key instead of
+ * meeting it twice. */
+int update(char *name, char *value, char *expect) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of old on each level */
+	node_t *succs[MAX_LEVEL];
+	node_t *old = NULL;	    /* Node being replaced */
+	node_t *newnode = NULL;
+	int level = 0;		    /* Height of old */
+	int found;
+	int i;
+
+	for (;;) {
+	    found = search(name, preds, succs);
+	    if (!old) {
+		if (found == -1) break;
+		old = succs[found];
+		if (__atomic_load_n(&old->marked, __ATOMIC_ACQUIRE) == 2) {
+		    old = NULL;
+		    sched_yield();
+		    continue;
+		}
+		if (!__atomic_load_n(&old->fully_linked, __ATOMIC_ACQUIRE) ||
+			old->level - 1 != found ||
+			__atomic_load_n(&old->marked, __ATOMIC_ACQUIRE)) {
+		    old = NULL;
+		    break;
+		}
+		node_lock(old);
+		if (old->marked) {
+		    node_unlock(old);
+		    if (old->marked == 1) {
+			old = NULL;
+			break;
+		    }
+		    old = NULL;
+		    continue;
+		}
+		/* A node's value never changes, so this is the current one */
+		if (expect && strcmp(old->value, expect)) {
+		    node_unlock(old);
+		    return -1;
+		}
+		level = old->level;
+		if (!(newnode = node_create(name, value, level))) {
+		    node_unlock(old);
+		    return 0;
+		}
+		__atomic_store_n(&old->marked, 2, __ATOMIC_RELEASE);
+	    }
+	    if (lock_preds(preds, succs, level, 1)) break;
+	}
+	if (!old) return 0;
+
+	for (i = 0; i < level; i++) newnode->next[i] = old->next[i];
+	newnode->fully_linked = 1;
+	for (i = level - 1; i >= 0; i--)
+	    __atomic_store_n(&preds[i]->next[i], newnode, __ATOMIC_RELEASE);
+	node_unlock(old);
+	unlock_preds(preds, level - 1);
+	epoch_retire(old, node_retire);
+	return 1;
+}
+
+/*
+ * Multi-key operations search for all their keys first, without locks, then
+ * try to take every version lock they need and check, as lock_preds does,
+ * that nothing moved since the searches.  A lock that is busy or a check
+ * that fails releases everything and starts over after a pause; a thread
+ * holding locks never waits for one, so this cannot deadlock.  Each key's
+ * predecessor on level 0 is locked even for a query or a change that finds
+ * nothing to do, so no other writer can change the key until all the
+ * answers are settled, and a reader that gets to any of the keys waits on
+ * that lock.
+ */
+
+/* The nodes a multi-key operation holds, each once */
+typedef struct Held {
+	node_t *node[MULTI_MAX * (MAX_LEVEL + 1)];
+	int n;
+} held_t;
+
+/* Take node's version lock unless it is held already.  Return false if it
+ * is busy. */
+static int held_lock(held_t *h, node_t *node) {
+    unsigned int v;
+    int i;
+
+    for (i = 0; i < h->n; i++)
+	if (h->node[i] == node) return 1;
+    v = __atomic_load_n(&node->version, __ATOMIC_RELAXED);
+    if ((v & 1) || !__atomic_compare_exchange_n(&node->version, &v, v + 1,
+		0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	return 0;
+    h->node[h->n++] = node;
+    return 1;
+}
+
+static void held_release(held_t *h) {
+    while (h->n > 0) node_unlock(h->node[--h->n]);
+}
+
+/* Lock what op needs, given its search: the predecessors on the levels it
+ * changes and the node it removes, or just the predecessor on level 0 if it
+ * changes nothing.  *levelp is the height of the node to add; it is set to
+ * the number of levels locked.  *targetp is the live node with op's key, if
+ * any.  Return false if a lock was busy or something moved. */
+static int multi_lock(held_t *h, multi_t *op, node_t **preds, node_t **succs,
+	int found, node_t **targetp, int *levelp) {
+    node_t *target = found >= 0 ? succs[found] : NULL;
+    int marked = target ? __atomic_load_n(&target->marked, __ATOMIC_ACQUIRE) : 0;
+    int i;
+
+    /* Wait out inserts and removals of the key itself */
+    if (target && (!__atomic_load_n(&target->fully_linked, __ATOMIC_ACQUIRE) ||
+	    (marked && op->code != 'q') || target->level - 1 != found))
+	return 0;
+    *targetp = target && marked != 1 ? target : NULL;
+    if (op->code == 'd' && *targetp)
+	*levelp = target->level;
+    else if (op->code != 'a' || *targetp)
+	*levelp = 1;
+    if (op->code == 'd' && *targetp &&
+	    (!held_lock(h, target) || target->marked))
+	return 0;
+    for (i = 0; i < *levelp; i++) {
+	if (!held_lock(h, preds[i])) return 0;
+	if (preds[i]->marked || preds[i]->next[i] != succs[i] ||
+		(op->code == 'a' && succs[i] && succs[i]->marked))
+	    return 0;
+    }
+    return 1;
+}
+
+/* Carry out ops atomically: lock what every key needs, then make the changes
+ * from the last key to the first.  A change only touches nodes after the
+ * predecessors of smaller keys, so those stay right.  Added nodes are fully
+ * linked and removed ones marked while everything is still locked. */
+void multi(multi_t *ops, int n) {
+    node_t *preds[MULTI_MAX][MAX_LEVEL], *succs[MULTI_MAX][MAX_LEVEL];
+    node_t *targets[MULTI_MAX];
+    int levels[MULTI_MAX];
+    node_t *newnode;
+    struct timespec pause;
+    held_t h;
+    int found[MULTI_MAX];
+    int i, j, tries;
+
+    h.n = 0;
+    for (tries = 0; ; tries++) {
+	/* Search first: a search waits for locked nodes, our own included */
+	for (j = 0; j < n; j++) {
+	    root = heads[ops[j].shard];
+	    levels[j] = random_level();
+	    found[j] = search(ops[j].name, preds[j], succs[j]);
+	}
+	for (j = 0; j < n; j++)
+	    if (!multi_lock(&h, &ops[j], preds[j], succs[j], found[j],
+		    &targets[j], &levels[j]))
+		break;
+	if (j == n) break;
+	held_release(&h);
+	/* Back off for longer the more often we lose */
+	if (tries < 4) {
+	    sched_yield();
+	} else {
+	    pause.tv_sec = 0;
+	    pause.tv_nsec = (random_level() * 1000L) << (tries < 14 ? tries - 4 : 10);
+	    nanosleep(&pause, NULL);
+	}
+    }
+
+    for (j = n - 1; j >= 0; j--) {
+	switch (ops[j].code) {
+	case 'q':
+	    strncpy(ops[j].value, targets[j] ? targets[j]->value : "not found",
+		    ops[j].len - 1);
+	    break;
+	case 'a':
+	    if ((ops[j].done = !targets[j] &&
+		    (newnode = node_create(ops[j].name, ops[j].value, levels[j])))) {
+		for (i = 0; i < levels[j]; i++)
+		    newnode->next[i] = preds[j][i]->next[i];
+		for (i = 0; i < levels[j]; i++)
+		    __atomic_store_n(&preds[j][i]->next[i], newnode, __ATOMIC_RELEASE);
+		targets[j] = newnode;
+	    }
+	    break;
+	case 'd':
+	    if ((ops[j].done = targets[j] != NULL)) {
+		__atomic_store_n(&targets[j]->marked, 1, __ATOMIC_RELEASE);
+		for (i = levels[j] - 1; i >= 0; i--)
+		    __atomic_store_n(&preds[j][i]->next[i], targets[j]->next[i],
+			    __ATOMIC_RELEASE);
+	    }
+	    break;
+	}
+    }
+    for (j = 0; j < n; j++)
+	if (ops[j].code == 'a' && ops[j].done)
+	    __atomic_store_n(&targets[j]->fully_linked, 1, __ATOMIC_RELEASE);
+    held_release(&h);
+    for (j = 0; j < n; j++)
+	if (ops[j].code == 'd' && ops[j].done)
+	    epoch_retire(targets[j], node_retire);
+}
+
+/* Call fn on every key not smaller than from, in order, until it returns
+ * false.  Nodes that are not fully linked yet or are being removed are
+ * skipped, as query does; one being replaced is still visited. */
+void scan(char *from, int (*fn)(char *, char *, void *), void *arg) {
+    node_t *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+    node_t *n;
+
+    search(from, preds, succs);
+    for (n = succs[0]; n; n = __atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE))
+	if (__atomic_load_n(&n->fully_linked, __ATOMIC_ACQUIRE) &&
+		__atomic_load_n(&n->marked, __ATOMIC_ACQUIRE) != 1 &&
+		!fn(n->name, n->value, arg))
+	    break;
+}
+
+/* Count the nodes on each level, from the heights of the live nodes on level
+ * 0 */
+long shape(long *per_level) {
+    node_t *n;
+    long nodes = 0;
+    int i;
+
+    for (i = 0; i < MAX_LEVEL; i++) per_level[i] = 0;
+    for (n = __atomic_load_n(&root->next[0], __ATOMIC_ACQUIRE); n;
+	    n = __atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE)) {
+	if (!__atomic_load_n(&n->fully_linked, __ATOMIC_ACQUIRE) ||
+		__atomic_load_n(&n->marked, __ATOMIC_ACQUIRE))
+	    continue;
+	nodes++;
+	for (i = 0; i < n->level; i++) per_level[i]++;
+    }
+    return nodes;
+}
+
+/* The hooks only enter an epoch, so appending nodes unlocked is only safe
+ * when no client is running */
+const int bulk_online = 0;
+/* multi locks the nodes an mq reads, whatever the hooks */
+const int multi_read_locked = 1;
+
+/* Start a bulk load: find the last node on every level */
+void bulk_start(bulk_t *bulk) {
+    node_t *pred = root;
+    int i;
+
+    for (i = MAX_LEVEL - 1; i >= 0; i--) {
+	while (pred->next[i]) pred = pred->next[i];
+	bulk->last[i] = pred;
+    }
+}
+
+/* Append name, which must sort after every key in the list, by linking a new
+ * node after the last node on each of its levels.  Nobody else is changing
+ * the list, so no node locks are needed. */
+int bulk_append(bulk_t *bulk, char *name, char *value) {
+	node_t **last = (node_t **) bulk->last;
+	node_t *newnode;
+	int level;
+	int done;
+	int i;
+
+	if (last[0] != root && strcmp(last[0]->name, name) >= 0) {
+	    /* Out of order.  The new node may land after some last[i]. */
+	    done = add(name, value);
+	    for (i = 0; i < MAX_LEVEL; i++)
+		while (last[i]->next[i]) last[i] = last[i]->next[i];
+	    return done;
+	}
+
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+	newnode->fully_linked = 1;
+	for (i = 0; i < level; i++) {
+	    __atomic_store_n(&last[i]->next[i], newnode, __ATOMIC_RELEASE);
+	    last[i] = newnode;
+	}
+	return 1;
+}
+
+/* Every operation walks the list without locks, so all of them run inside an
+ * epoch critical section instead of under a database lock. */
+void db_read_lock() { epoch_enter(); }
+void db_read_unlock() { epoch_exit(); }
+void db_write_lock() { epoch_enter(); }
+void db_write_unlock() { epoch_exit(); }
+
+/* Make the head sentinels of shards 1 .. n-1.  Versions and marks start at 0
+ * and, like head, they are linked on every level from the start. */
+void db_shards(int n) {
+    int i;
+
+    for (i = 1; i < n; i++) {
+	if (!(heads[i] = (node_t *) calloc(1, sizeof(node_t) +
+		MAX_LEVEL * sizeof(node_t *)))) {
+	    perror("db_shards");
+	    exit(1);
+	}
+	heads[i]->name = heads[i]->value = "";
+	heads[i]->fully_linked = 1;
+	heads[i]->level = MAX_LEVEL;
+    }
+}
+
+void db_use(int shard) { root = heads[shard]; }
+
+/* The database lives in this process's heap and cannot be shared */
+int db_attach(char *path, int shards) {
+    fprintf(stderr, "%s: this server cannot share its database\n", path);
+    return -1;
+}
@@ -0,0 +1,351 @@
+#include "skiplist.h"
+#include "epoch.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <sched.h>
+#include "slab.h"
+#include "stats.h"
+
+/*
+ * Read-copy-update flavoured skip list.  Queries take no lock and write no
+ * shared memory: they only announce themselves in their own epoch record
+ * (epoch.c) and follow next pointers with acquire loads.  Adds and removes
+ * are serialized by one writer mutex and publish their changes with release
+ * stores, so a reader sees either the old or the new link, never a half
+ * built node.  A removed node keeps its next pointers and is handed to
+ * epoch_retire, so a reader standing on it can still walk off it and it is
+ * only freed once every reader that might be there has left.
+ *
+ * This uses the node layout of skiplist.c but not its (unsynchronized) code.
+ */
+
+/* Serializes writers against each other; readers never take it */
+pthread_mutex_t mutex_writer = PTHREAD_MUTEX_INITIALIZER;
+
+/* A bulk load holding mutex_writer publishes nodes the way add does, so
+ * readers may run alongside */
+const int bulk_online = 1;
+/* Readers take no lock, so an mq takes the writer mutexes to see its keys
+ * at one moment */
+const int multi_read_locked = 0;
+
+node_t head = { { 0, 0 }, 0, 1, "", "", { [MAX_LEVEL - 1] = NULL } };
+
+/* Head sentinels of the shards (head is shard 0's) and the calling thread's */
+static node_t *heads[MAX_SHARDS] = { &head };
+static __thread node_t *root = &head;
+
+/* Counts ma and md commands begun and ended in a shard, each on a cache line
+ * of its own: odd while one is changing the shard.  A query waits for an
+ * even count and tries again if it moved, so it never sees a multi-key
+ * change half made. */
+typedef struct MultiSeq {
+	unsigned long seq;
+} __attribute__((aligned(64))) multi_seq_t;
+
+static multi_seq_t multi_seqs[MAX_SHARDS];
+static __thread multi_seq_t *multi_seq = &multi_seqs[0];
+
+
+/*
+ * Allocate a new node with the given key and value and room for level forward
+ * pointers.  The pointers are left NULL for the caller to link.
+ */
+node_t *node_create(char *arg_name, char *arg_value, int level) {
+    node_t *new_node;
+    char *new_node_name, *new_node_value;
+    int i;
+
+    /* One slab block holds the node and, if they are short, its strings */
+    new_node = (node_t *) node_alloc(sizeof(node_t) + level * sizeof(node_t *),
+	    arg_name, arg_value, &new_node_name, &new_node_value);
+    if (!new_node) return NULL;
+    new_node->name = new_node_name;
+    new_node->value = new_node_value;
+    key_prefix(new_node_name, new_node->prefix);
+    new_node->len = strlen(new_node_name);
+
+    new_node->level = level;
+    for (i = 0; i < level; i++) new_node->next[i] = NULL;
+
+    return new_node;
+}
+
+/* Free the data structures in node and the node itself.  Inline strings go
+ * back to the slab with the node. */
+void node_destroy(node_t * node) {
+    node_free(node, sizeof(node_t) + node->level * sizeof(node_t *), node->name,
+	    node->value);
+}
+
+/* node_destroy with the signature epoch_retire wants */
+static void node_retire(void *node) {
+    node_destroy((node_t *) node);
+}
+
+/* Search for name starting at the sentinel start, as search() in skiplist.c
+ * does, but load every shared pointer with acquire semantics so it is safe
+ * against a concurrent writer.  Readers call this inside an epoch critical
+ * section and pass NULL for preds; writers hold mutex_writer. */
+node_t *search(char *name, node_t * start, node_t ** preds) {
+    node_t *pred = start;
+    node_t *next = NULL;
+    search_key_t key;
+    int i;
+    int cmp = 1;
+
+    key_make(&key, name);
+    for (i = __atomic_load_n(&start->level, __ATOMIC_ACQUIRE) - 1; i >= 0; i--) {
+	while ((next = __atomic_load_n(&pred->next[i], __ATOMIC_ACQUIRE)) &&
+		(cmp = NODE_CMP(next, &key)) < 0)
+	    pred = next;
+	if (preds) preds[i] = pred;
+	else if (next && cmp == 0) return next;
+    }
+
+    return (next && cmp == 0) ? next : NULL;
+}
+
+/* Find the node with key name and return a result or error string in result.
+ * Result must have space for len characters.  The lookup is repeated if an
+ * ma or md was changing the shard meanwhile (multi_seq). */
+void query(char *name, char *result, int len) {
+    node_t *target;
+    unsigned long seq;
+
+    do {
+	while ((seq = __atomic_load_n(&multi_seq->seq, __ATOMIC_ACQUIRE)) & 1)
+	    sched_yield();
+	target = search(name, root, NULL);
+	strncpy(result, target ? target->value : "not found", len - 1);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&multi_seq->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* Insert a node with name and value into the list rooted at head.  Return
+ * false if the key is already there.  Caller holds mutex_writer. */
+int add(char *name, char *value) {
+	node_t *preds[MAX_LEVEL];   /* The new node follows these on each level */
+	node_t *newnode;	    /* The new node to add */
+	int level;		    /* Height of the new node */
+	int i;
+
+	if (search(name, root, preds)) {
+	    /* There is already a node with this key in the list */
+	    return 0;
+	}
+
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+
+	/* Levels the list did not use yet start at the head */
+	for (i = root->level; i < level; i++) preds[i] = root;
+
+	/* Fill in the new node completely while nobody can see it, then
+	 * publish it bottom up.  A reader that finds it on level i can also
+	 * find it on every level below. */
+	for (i = 0; i < level; i++) newnode->next[i] = preds[i]->next[i];
+	for (i = 0; i < level; i++)
+	    __atomic_store_n(&preds[i]->next[i], newnode, __ATOMIC_RELEASE);
+	if (level > root->level)
+	    __atomic_store_n(&root->level, level, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Remove the node with key name from the list if it is there.  Return true if
+ * something was deleted.  Caller holds mutex_writer. */
+int xremove(char *name) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of dnode on each level */
+	node_t *dnode;		    /* Node to delete */
+	int i;
+
+	/* first, find the node to be removed */
+	if (!(dnode = search(name, root, preds))) {
+	    /* it's not there */
+	    return 0;
+	}
+
+	/* Unlink it top down.  dnode's own next pointers are left alone so a
+	 * reader already on it still reaches the rest of the list. */
+	for (i = dnode->level - 1; i >= 0; i--)
+	    __atomic_store_n(&preds[i]->next[i], dnode->next[i], __ATOMIC_RELEASE);
+
+	/* Drop levels that are now empty */
+	while (root->level > 1 && root->next[root->level - 1] == NULL)
+	    __atomic_store_n(&root->level, root->level - 1, __ATOMIC_RELEASE);
+
+	/* Readers may still be on dnode; free it after they are gone */
+	epoch_retire(dnode, node_retire);
+	return 1;
+}
+
+/* Replace name's value with a copy of its node holding the new value.  The
+ * old node's next pointers are turned to the copy before the copy is
+ * published, so a reader standing on the old node still finds the key.
+ * Caller holds mutex_writer. */
+int update(char *name, char *value, char *expect) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of the node on each level */
+	node_t *old, *newnode;
+	int i;
+
+	if (!(old = search(name, root, preds))) return 0;
+	if (expect && strcmp(old->value, expect)) return -1;
+	if (!(newnode = node_create(name, value, old->level))) return 0;
+	for (i = 0; i < old->level; i++) newnode->next[i] = old->next[i];
+	for (i = 0; i < old->level; i++)
+	    __atomic_store_n(&old->next[i], newnode, __ATOMIC_RELEASE);
+	for (i = 0; i < old->level; i++)
+	    __atomic_store_n(&preds[i]->next[i], newnode, __ATOMIC_RELEASE);
+	epoch_retire(old, node_retire);
+	return 1;
+}
+
+/* The callers hold the writer mutex of every shard in ops, so no other
+ * writer and no other multi-key operation runs alongside.  Queries take no
+ * lock, so an ma or md holds the multi_seq of each of its shards odd while
+ * it changes them, and queries wait it out. */
+void multi(multi_t *ops, int n) {
+    int i;
+
+    /* The count is bumped before the first change is published: the
+     * release stores that publish them keep it first */
+    if (ops[0].code != 'q')
+	for (i = 0; i < n; i++)
+	    if (i == 0 || ops[i].shard != ops[i - 1].shard)
+		__atomic_add_fetch(&multi_seqs[ops[i].shard].seq, 1,
+			__ATOMIC_SEQ_CST);
+    for (i = 0; i < n; i++) {
+	root = heads[ops[i].shard];
+	multi_seq = &multi_seqs[ops[i].shard];
+	switch (ops[i].code) {
+	case 'q':
+	    query(ops[i].name, ops[i].value, ops[i].len);
+	    break;
+	case 'a':
+	    ops[i].done = add(ops[i].name, ops[i].value);
+	    break;
+	case 'd':
+	    ops[i].done = xremove(ops[i].name);
+	    break;
+	}
+    }
+    if (ops[0].code != 'q')
+	for (i = 0; i < n; i++)
+	    if (i == 0 || ops[i].shard != ops[i - 1].shard)
+		__atomic_add_fetch(&multi_seqs[ops[i].shard].seq, 1,
+			__ATOMIC_RELEASE);
+}
+
+/* Call fn on every key not smaller than from, in order, until it returns
+ * false.  Like a query this runs in an epoch critical section, so it sees
+ * every key that was there throughout and none that was never there. */
+void scan(char *from, int (*fn)(char *, char *, void *), void *arg) {
+    node_t *preds[MAX_LEVEL];
+    node_t *n;
+
+    search(from, root, preds);
+    for (n = __atomic_load_n(&preds[0]->next[0], __ATOMIC_ACQUIRE);
+	    n && fn(n->name, n->value, arg);
+	    n = __atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE))
+	;
+}
+
+/* Count the nodes on each level, from the heights of the nodes on level 0 */
+long shape(long *per_level) {
+    node_t *n;
+    long nodes = 0;
+    int i;
+
+    for (i = 0; i < MAX_LEVEL; i++) per_level[i] = 0;
+    for (n = __atomic_load_n(&root->next[0], __ATOMIC_ACQUIRE); n; n = __atomic_load_n(&n->next[0], __ATOMIC_ACQUIRE)) {
+	nodes++;
+	for (i = 0; i < n->level; i++) per_level[i]++;
+    }
+    return nodes;
+}
+
+/* Start a bulk load: find the last node on every level.  Caller holds
+ * mutex_writer. */
+void bulk_start(bulk_t *bulk) {
+    node_t *pred = root;
+    int i;
+
+    for (i = MAX_LEVEL - 1; i >= 0; i--) {
+	while (pred->next[i]) pred = pred->next[i];
+	bulk->last[i] = pred;
+    }
+}
+
+/* Append name, which must sort after every key in the list, by publishing a
+ * new node after the last node on each of its levels, bottom up as add does.
+ * Caller holds mutex_writer. */
+int bulk_append(bulk_t *bulk, char *name, char *value) {
+	node_t **last = (node_t **) bulk->last;
+	node_t *newnode;
+	int level;
+	int done;
+	int i;
+
+	if (last[0] != root && strcmp(last[0]->name, name) >= 0) {
+	    /* Out of order.  The new node may land after some last[i]. */
+	    done = add(name, value);
+	    for (i = 0; i < MAX_LEVEL; i++)
+		while (last[i]->next[i]) last[i] = last[i]->next[i];
+	    return done;
+	}
+
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+	for (i = 0; i < level; i++) {
+	    __atomic_store_n(&last[i]->next[i], newnode, __ATOMIC_RELEASE);
+	    last[i] = newnode;
+	}
+	if (level > root->level)
+	    __atomic_store_n(&root->level, level, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Writer mutexes of the shards (mutex_writer is shard 0's) and the calling
+ * thread's */
+static pthread_mutex_t *writers[MAX_SHARDS] = { &mutex_writer };
+static __thread pthread_mutex_t *writer = &mutex_writer;
+
+/* A query is an epoch critical section, not a lock */
+void db_read_lock() { epoch_enter(); }
+void db_read_unlock() { epoch_exit(); }
+/* Writers only exclude each other, and only within a shard */
+void db_write_lock() { stats_mutex_lock(writer, LOCK_DB_WRITE); }
+void db_write_unlock() { pthread_mutex_unlock(writer); }
+
+/* Make shards 1 .. n-1: a head sentinel and a writer mutex each, the mutex
+ * on a cache line of its own so writers to different shards share nothing */
+void db_shards(int n) {
+    int i;
+
+    for (i = 1; i < n; i++) {
+	if (!(heads[i] = (node_t *) calloc(1, sizeof(node_t) +
+		MAX_LEVEL * sizeof(node_t *))) ||
+		posix_memalign((void **) &writers[i], 64, 64)) {
+	    perror("db_shards");
+	    exit(1);
+	}
+	heads[i]->name = heads[i]->value = "";
+	heads[i]->level = 1;
+	pthread_mutex_init(writers[i], NULL);
+    }
+}
+
+void db_use(int shard) {
+    root = heads[shard];
+    writer = writers[shard];
+    multi_seq = &multi_seqs[shard];
+}
+
+/* The database lives in this process's heap and cannot be shared */
+int db_attach(char *path, int shards) {
+    fprintf(stderr, "%s: this server cannot share its database\n", path);
+    return -1;
+}
@@ -0,0 +1,527 @@
+#include "db.h"
+#include "key.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "stats.h"
+
+/*
+ * The skip list of skiplist.c, kept in a shared memory segment so that
+ * several server processes can serve the same database (server_shm -m
+ * file).  Everything the index needs is in the segment: the head sentinels,
+ * the nodes with their strings, the allocator's free lists and the shards'
+ * reader-writer locks, which are process-shared.  The segment is mapped at
+ * a different address in every process, so links are offsets from its start
+ * rather than pointers; 0, the segment header, is the null link.
+ *
+ * The segment is a file, so the data outlives any one server: a frontend
+ * that crashes loses its clients, not the database.  Every attached process
+ * holds a shared flock on the file.  The first to attach, finding no other
+ * holder, initializes the locks afresh.  The allocator's mutex is robust, and
+ * each shard's writers hold a robust mutex around its write lock, so a
+ * server that died holding either is noticed: the allocator just carries on,
+ * but a shard may have been left half changed, so a server that finds its
+ * writer gone exits rather than hang, and the locks are made afresh once
+ * every server has restarted.  A server that dies holding only a read lock
+ * cannot be told from a slow one, and its shard's writers wait until every
+ * server restarts.  Without -m the segment is anonymous memory private to
+ * the process.
+ */
+
+/* Size of a new segment; the file is sparse, so this is an upper bound */
+#define SEGMENT_SIZE (1L << 30)
+/* Identifies the layout below */
+#define SEGMENT_MAGIC "cs402db1"
+/* Allocation size classes: powers of two from 1 << CLASS_MIN bytes */
+#define CLASS_MIN 5
+#define CLASSES 32
+/* A reader kept waiting this long checks whether the writer died */
+#define HOLDER_CHECK_S 1
+
+typedef uint64_t link_t;
+
+/* A node, followed in the same block by name and value, NUL terminated */
+typedef struct Node {
+	uint64_t prefix[2];	/* Of name; see key.h */
+	int len;		/* strlen(name) */
+	int level;
+	link_t next[];
+} node_t;
+
+typedef struct Shard {
+	pthread_rwlock_t lock;
+	pthread_mutex_t writer;	/* Robust; held by a writer with lock */
+	link_t head;
+} __attribute__((aligned(64))) shard_t;
+
+typedef struct Segment {
+	char magic[8];
+	size_t size;		/* Bytes mapped */
+	size_t layout;		/* sizeof(segment_t), to catch other builds */
+	int shards;		/* Shards the database was created with */
+	pthread_mutex_t alloc_lock;
+	link_t top;		/* Segment memory not handed out yet starts here */
+	link_t free[CLASSES];	/* Freed blocks by class, linked through them */
+	shard_t shard[MAX_SHARDS];
+} segment_t;
+
+static segment_t *seg = NULL;
+static pthread_once_t seg_once = PTHREAD_ONCE_INIT;
+/* The calling thread's shard */
+static __thread int cur = 0;
+
+/* Holding the write lock, a bulk load has the shard to itself, in every
+ * process */
+const int bulk_online = 1;
+/* The read lock keeps writers out, so an mq need not shut out readers */
+const int multi_read_locked = 1;
+
+#define AT(l) ((node_t *) ((char *) seg + (l)))
+#define LINK(n) ((link_t) ((char *) (n) - (char *) seg))
+#define NAME(n) ((char *) &(n)->next[(n)->level])
+#define VALUE(n) (NAME(n) + (n)->len + 1)
+#define NEXT(n, i) ((n)->next[i] ? AT((n)->next[i]) : NULL)
+#define ROOT() AT(seg->shard[cur].head)
+
+/* Block size class of size bytes */
+static int size_class(size_t size) {
+    int c = 0;
+
+    while (((size_t) 1 << (c + CLASS_MIN)) < size) c++;
+    return c;
+}
+
+/* Lock the allocator.  If a server died holding it, every change it could
+ * have been making is a single store, so at worst a block is lost. */
+static void seg_alloc_lock(void) {
+    if (pthread_mutex_lock(&seg->alloc_lock) == EOWNERDEAD)
+	pthread_mutex_consistent(&seg->alloc_lock);
+}
+
+/* A block of at least size bytes of the segment, or NULL if it is full */
+static void *seg_alloc(size_t size) {
+    int c = size_class(size);
+    link_t b;
+
+    if (c >= CLASSES) return NULL;
+    seg_alloc_lock();
+    if ((b = seg->free[c])) {
+	seg->free[c] = *(link_t *) AT(b);
+    } else if (seg->top + ((size_t) 1 << (c + CLASS_MIN)) <= seg->size) {
+	b = seg->top;
+	seg->top += (size_t) 1 << (c + CLASS_MIN);
+    }
+    pthread_mutex_unlock(&seg->alloc_lock);
+    return b ? AT(b) : NULL;
+}
+
+static void seg_free(void *block, size_t size) {
+    int c = size_class(size);
+
+    seg_alloc_lock();
+    *(link_t *) block = seg->free[c];
+    seg->free[c] = LINK(block);
+    pthread_mutex_unlock(&seg->alloc_lock);
+}
+
+static size_t node_size(int level, int len, char *value) {
+    return sizeof(node_t) + level * sizeof(link_t) + len + strlen(value) + 2;
+}
+
+/* Allocate a node with copies of name and value and room for level links,
+ * left 0 for the caller to set */
+static node_t *node_create(char *name, char *value, int level) {
+    int len = strlen(name);
+    node_t *node;
+    int i;
+
+    if (!(node = (node_t *) seg_alloc(node_size(level, len, value))))
+	return NULL;
+    key_prefix(name, node->prefix);
+    node->len = len;
+    node->level = level;
+    for (i = 0; i < level; i++) node->next[i] = 0;
+    memcpy(NAME(node), name, len + 1);
+    strcpy(VALUE(node), value);
+    return node;
+}
+
+static void node_destroy(node_t *node) {
+    seg_free(node, node_size(node->level, node->len, VALUE(node)));
+}
+
+/* Fill in a new segment: a head sentinel for every shard.  A head's name is
+ * never read, so it does not matter that its level no longer finds it. */
+static int seg_format(int shards) {
+    node_t *head;
+    int i;
+
+    seg->layout = sizeof(segment_t);
+    seg->shards = shards;
+    seg->top = (sizeof(segment_t) + 63) & ~63;
+    for (i = 0; i < CLASSES; i++) seg->free[i] = 0;
+    for (i = 0; i < MAX_SHARDS; i++) {
+	if (!(head = node_create("", "", MAX_LEVEL))) return 0;
+	head->level = 1;
+	seg->shard[i].head = LINK(head);
+    }
+    /* Last, so a segment whose creator died part way is not taken for one */
+    memcpy(seg->magic, SEGMENT_MAGIC, sizeof(seg->magic));
+    return 1;
+}
+
+/* Initialize the segment's locks for processes to share */
+static void seg_locks(void) {
+    pthread_mutexattr_t mattr;
+    pthread_rwlockattr_t rwattr;
+    int i;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&seg->alloc_lock, &mattr);
+    pthread_rwlockattr_init(&rwattr);
+    pthread_rwlockattr_setpshared(&rwattr, PTHREAD_PROCESS_SHARED);
+    for (i = 0; i < MAX_SHARDS; i++) {
+	pthread_rwlock_init(&seg->shard[i].lock, &rwattr);
+	pthread_mutex_init(&seg->shard[i].writer, &mattr);
+    }
+    pthread_rwlockattr_destroy(&rwattr);
+    pthread_mutexattr_destroy(&mattr);
+}
+
+/* Attach the database segment at path, creating it with shards shards if it
+ * does not exist.  Return its number of shards, or -1 on failure. */
+int db_attach(char *path, int shards) {
+    struct stat st;
+    void *base = MAP_FAILED;
+    int fd;
+    int alone, fresh = 0;
+
+    if (seg) {
+	fprintf(stderr, "%s: a database is attached already\n", path);
+	return -1;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+	perror(path);
+	return -1;
+    }
+    /* Alone, we may set the segment up.  Otherwise the shared lock waits
+     * for whoever is setting it up to be done. */
+    if (!(alone = flock(fd, LOCK_EX | LOCK_NB) == 0))
+	flock(fd, LOCK_SH);
+    if (fstat(fd, &st) == -1 || ((fresh = alone && st.st_size == 0) &&
+	    ftruncate(fd, st.st_size = SEGMENT_SIZE) == -1)) {
+	perror(path);
+	close(fd);
+	return -1;
+    }
+    if ((size_t) st.st_size >= sizeof(segment_t))
+	base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+	fprintf(stderr, "%s: not a database segment\n", path);
+	close(fd);
+	return -1;
+    }
+    seg = (segment_t *) base;
+    if (!fresh && (memcmp(seg->magic, SEGMENT_MAGIC, sizeof(seg->magic)) ||
+	    seg->layout != sizeof(segment_t) || seg->size != (size_t) st.st_size)) {
+	fprintf(stderr, "%s: not a database segment of this server\n", path);
+	munmap(base, st.st_size);
+	seg = NULL;
+	close(fd);
+	return -1;
+    }
+    if (fresh) {
+	seg->size = st.st_size;
+	seg_locks();
+	if (!seg_format(shards)) {
+	    fprintf(stderr, "%s: segment too small\n", path);
+	    exit(1);
+	}
+    } else if (alone) {
+	/* No other server has it: locks held by any that died are stale */
+	seg_locks();
+    }
+    /* Let other servers attach.  fd stays open, holding the shared lock,
+     * for as long as the process runs. */
+    if (alone) flock(fd, LOCK_SH);
+    return seg->shards;
+}
+
+/* Without db_attach, the database is anonymous memory of this process */
+static void seg_private(void) {
+    void *base;
+
+    if (seg) return;
+    if ((base = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+	perror("database segment");
+	exit(1);
+    }
+    seg = (segment_t *) base;
+    seg->size = SEGMENT_SIZE;
+    seg_locks();
+    if (!seg_format(1)) {
+	fprintf(stderr, "database segment too small\n");
+	exit(1);
+    }
+}
+
+/* Search the list that starts at the sentinel start for a node with key
+ * name, as search in skiplist.c does, filling preds if it is not NULL */
+static node_t *search(char *name, node_t *start, node_t **preds) {
+    node_t *pred = start;
+    node_t *next = NULL;
+    search_key_t key;
+    int i;
+    int cmp = 1;
+
+    key_make(&key, name);
+    for (i = start->level - 1; i >= 0; i--) {
+	/* Move right while the next key is smaller, then drop a level */
+	while ((next = NEXT(pred, i)) &&
+		(cmp = key_cmp(next->prefix, next->len, NAME(next), &key)) < 0)
+	    pred = next;
+	if (preds) preds[i] = pred;
+	else if (next && cmp == 0) return next;
+    }
+
+    /* next is the first node on level 0 not smaller than name */
+    return (next && cmp == 0) ? next : NULL;
+}
+
+/* Find the node with key name and return a result or error string in result.
+ * Result must have space for len characters. */
+void query(char *name, char *result, int len) {
+    node_t *target;
+
+    if (!(target = search(name, ROOT(), NULL)))
+	strncpy(result, "not found", len - 1);
+    else
+	strncpy(result, VALUE(target), len - 1);
+}
+
+/* Insert a node with name and value.  Return false if the key is already
+ * there or the segment is full. */
+int add(char *name, char *value) {
+	node_t *preds[MAX_LEVEL];   /* The new node follows these on each level */
+	node_t *root = ROOT();
+	node_t *newnode;
+	int level;
+	int i;
+
+	if (search(name, root, preds)) return 0;
+
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+
+	/* Levels the list did not use yet start at the head */
+	for (i = root->level; i < level; i++) preds[i] = root;
+	if (level > root->level) root->level = level;
+
+	for (i = 0; i < level; i++) {
+	    newnode->next[i] = preds[i]->next[i];
+	    preds[i]->next[i] = LINK(newnode);
+	}
+	return 1;
+}
+
+/* Remove the node with key name if it is there.  Return true if something
+ * was deleted. */
+int xremove(char *name) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of dnode on each level */
+	node_t *root = ROOT();
+	node_t *dnode;
+	int i;
+
+	if (!(dnode = search(name, root, preds))) return 0;
+	for (i = 0; i < dnode->level; i++)
+	    preds[i]->next[i] = dnode->next[i];
+	while (root->level > 1 && !root->next[root->level - 1])
+	    root->level--;
+	node_destroy(dnode);
+	return 1;
+}
+
+/* Replace name's value by swapping in a node of the same height */
+int update(char *name, char *value, char *expect) {
+	node_t *preds[MAX_LEVEL];
+	node_t *old, *newnode;
+	int i;
+
+	if (!(old = search(name, ROOT(), preds))) return 0;
+	if (expect && strcmp(VALUE(old), expect)) return -1;
+	if (!(newnode = node_create(name, value, old->level))) return 0;
+	for (i = 0; i < old->level; i++) {
+	    newnode->next[i] = old->next[i];
+	    preds[i]->next[i] = LINK(newnode);
+	}
+	node_destroy(old);
+	return 1;
+}
+
+/* The callers hold the write lock of every shard in ops, so the operations
+ * are simply carried out one after another */
+void multi(multi_t *ops, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+	cur = ops[i].shard;
+	switch (ops[i].code) {
+	case 'q':
+	    query(ops[i].name, ops[i].value, ops[i].len);
+	    break;
+	case 'a':
+	    ops[i].done = add(ops[i].name, ops[i].value);
+	    break;
+	case 'd':
+	    ops[i].done = xremove(ops[i].name);
+	    break;
+	}
+    }
+}
+
+/* Call fn on every key not smaller than from, in order, until it returns
+ * false */
+void scan(char *from, int (*fn)(char *, char *, void *), void *arg) {
+    node_t *preds[MAX_LEVEL];
+    node_t *n;
+    link_t l;
+
+    search(from, ROOT(), preds);
+    for (l = preds[0]->next[0]; l; l = n->next[0]) {
+	n = AT(l);
+	if (!fn(NAME(n), VALUE(n), arg)) break;
+    }
+}
+
+/* Count the nodes on each level, from the heights of the nodes on level 0 */
+long shape(long *per_level) {
+    link_t l;
+    long nodes = 0;
+    int i;
+
+    for (i = 0; i < MAX_LEVEL; i++) per_level[i] = 0;
+    for (l = ROOT()->next[0]; l; l = AT(l)->next[0]) {
+	nodes++;
+	for (i = 0; i < AT(l)->level; i++) per_level[i]++;
+    }
+    return nodes;
+}
+
+/* Start a bulk load: find the last node on every level */
+void bulk_start(bulk_t *bulk) {
+    node_t *pred = ROOT();
+    int i;
+
+    for (i = MAX_LEVEL - 1; i >= 0; i--) {
+	while (pred->next[i]) pred = AT(pred->next[i]);
+	bulk->last[i] = pred;
+    }
+}
+
+/* Append name, which must sort after every key in the list, after the last
+ * node on each of its levels */
+int bulk_append(bulk_t *bulk, char *name, char *value) {
+	node_t **last = (node_t **) bulk->last;
+	node_t *root = ROOT();
+	node_t *newnode;
+	int level;
+	int done;
+	int i;
+
+	if (last[0] != root && strcmp(NAME(last[0]), name) >= 0) {
+	    /* Out of order.  The new node may land after some last[i]. */
+	    done = add(name, value);
+	    for (i = 0; i < MAX_LEVEL; i++)
+		while (last[i]->next[i]) last[i] = AT(last[i]->next[i]);
+	    return done;
+	}
+
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+	for (i = 0; i < level; i++) {
+	    last[i]->next[i] = LINK(newnode);
+	    last[i] = newnode;
+	}
+	if (level > root->level) root->level = level;
+	return 1;
+}
+
+/* A writer of the shard died part way through a change */
+static void holder_died(void) {
+    fprintf(stderr, "database segment: a server died changing shard %d; "
+	    "restart every server attached to it\n", cur);
+    exit(1);
+}
+
+/* The shard locks are in the segment, so they serialize writers in every
+ * attached process.  Like stats_rdlock and stats_wrlock these count the time
+ * spent waiting.  A reader that waits long checks the writer mutex, which
+ * is robust, for a writer that died. */
+void db_read_lock() {
+    shard_t *s;
+    struct timespec when;
+    long start;
+    int r;
+
+    pthread_once(&seg_once, seg_private);
+    s = &seg->shard[cur];
+    if (pthread_rwlock_tryrdlock(&s->lock) == 0) {
+	stats_lock(LOCK_DB_READ, NULL, -1);
+	return;
+    }
+    start = stats_now();
+    for (;;) {
+	clock_gettime(CLOCK_REALTIME, &when);
+	when.tv_sec += HOLDER_CHECK_S;
+	if (pthread_rwlock_timedrdlock(&s->lock, &when) == 0) break;
+	if ((r = pthread_mutex_trylock(&s->writer)) == EOWNERDEAD)
+	    holder_died();
+	if (r == 0) pthread_mutex_unlock(&s->writer);
+    }
+    stats_lock(LOCK_DB_READ, NULL, stats_now() - start);
+}
+
+void db_read_unlock() { pthread_rwlock_unlock(&seg->shard[cur].lock); }
+
+void db_write_lock() {
+    shard_t *s;
+    long start = 0;
+    int r;
+
+    pthread_once(&seg_once, seg_private);
+    s = &seg->shard[cur];
+    if ((r = pthread_mutex_trylock(&s->writer)) == EBUSY) {
+	start = stats_now();
+	r = pthread_mutex_lock(&s->writer);
+    }
+    if (r == EOWNERDEAD) holder_died();
+    if (pthread_rwlock_trywrlock(&s->lock)) {
+	if (!start) start = stats_now();
+	pthread_rwlock_wrlock(&s->lock);
+    }
+    stats_lock(LOCK_DB_WRITE, NULL, start ? stats_now() - start : -1);
+}
+
+void db_write_unlock() {
+    pthread_rwlock_unlock(&seg->shard[cur].lock);
+    pthread_mutex_unlock(&seg->shard[cur].writer);
+}
+
+/* Every shard was made with the segment */
+void db_shards(int n) {
+    pthread_once(&seg_once, seg_private);
+    seg->shards = n;
+}
+
+void db_use(int shard) { cur = shard; }
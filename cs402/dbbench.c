@@ -0,0 +1,217 @@
+#define _WITH_GETLINE
+#include "loadgen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Benchmark driver for the server binaries.  For each server named on the
+ * command line (server_coarse, server_fine and server_rw by default) it
+ * starts the server with its console on a pipe, makes a pair of fifos per
+ * client in a temporary directory and types "E infifo outfifo" at the
+ * console, so every client is a nonwindowed client made by
+ * client_create_no_window.  Client threads here then push the workload
+ * described by the options (see loadgen.c) through the fifos, timing each
+ * command's round trip, and one row per server is printed so the locking
+ * strategies can be compared side by side.
+ *
+ * Usage: dbbench [workload options] [server ...]
+ */
+
+#define FNLEN 256
+
+/* Our end of one client */
+typedef struct Conn {
+	long id;
+	char in[FNLEN];		/* fifo the server reads commands from */
+	char out[FNLEN];	/* fifo the server writes responses to */
+	histogram_t hist;
+} conn_t;
+
+pthread_barrier_t barrier_start;
+
+/* Send one command and wait for its response.  A nonwindowed client echoes
+ * the command (">> command") and then prints the response, so there are two
+ * lines to read. */
+static void round_trip(FILE *to, FILE *from, char *command, char **line,
+	size_t *len) {
+    fputs(command, to);
+    fflush(to);
+    if (getline(line, len, from) == -1 || getline(line, len, from) == -1) {
+	fprintf(stderr, "dbbench: server closed the connection\n");
+	exit(1);
+    }
+}
+
+/* Body of one client thread */
+static void *client(void *arg) {
+    conn_t *conn = (conn_t *) arg;
+    unsigned long long seed = 0x9e3779b97f4a7c15ULL * (conn->id + 1);
+    char command[64];
+    char *line = NULL;
+    size_t len = 0;
+    FILE *to, *from;
+    double start;
+    int i;
+
+    /* Open in the same order as nowindow_create so neither side blocks the
+     * other: it opens the input for reading first. */
+    if (!(to = fopen(conn->in, "w")) || !(from = fopen(conn->out, "r"))) {
+	perror("dbbench: open fifo");
+	exit(1);
+    }
+
+    /* The first client fills every other key while the rest wait */
+    if (conn->id == 0)
+	for (i = 0; i < keys; i += 2) {
+	    snprintf(command, sizeof(command), "a k%d v%d\n", i, i);
+	    round_trip(to, from, command, &line, &len);
+	}
+    pthread_barrier_wait(&barrier_start);
+
+    for (i = 0; i < ops; i++) {
+	next_command(&seed, command, sizeof(command));
+	start = now();
+	round_trip(to, from, command, &line, &len);
+	hist_record(&conn->hist, (long)((now() - start) * 1e9));
+    }
+
+    /* End of input makes the server retire the client */
+    fclose(to);
+    fclose(from);
+    free(line);
+    return NULL;
+}
+
+/* Start server, with the shards and query cache asked for and with its
+ * standard input on a pipe and its output discarded.  Return its pid and put
+ * our end of the pipe in *console. */
+static pid_t start_server(char *server, int *console) {
+    int fds[2];
+    char nshards[16], ncache[16];
+    int devnull;
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+	perror("pipe");
+	exit(1);
+    }
+    if ((pid = fork()) == -1) {
+	perror("fork");
+	exit(1);
+    } else if (pid == 0) {
+	dup2(fds[0], 0);
+	close(fds[0]);
+	close(fds[1]);
+	if ((devnull = open("/dev/null", O_WRONLY)) != -1) {
+	    dup2(devnull, 1);
+	    dup2(devnull, 2);
+	}
+	snprintf(nshards, sizeof(nshards), "%d", shards);
+	snprintf(ncache, sizeof(ncache), "%d", cache);
+	execl(server, server, "-S", nshards, "-C", ncache, (char *) NULL);
+	_exit(127);
+    }
+    close(fds[0]);
+    *console = fds[1];
+    return pid;
+}
+
+/* Run the workload against one server binary and report on it */
+static void bench(char *server) {
+    char tmpdir[] = "/tmp/dbbenchXXXXXX";
+    char line[2 * FNLEN + 8];
+    pthread_t *threads;
+    conn_t *conns;
+    histogram_t total;
+    double start, elapsed;
+    int console;
+    pid_t pid;
+    int status;
+    long i;
+
+    if (access(server, X_OK) == -1) {
+	perror(server);
+	return;
+    }
+    if (!mkdtemp(tmpdir)) {
+	perror("mkdtemp");
+	exit(1);
+    }
+    threads = (pthread_t *) malloc(clients * sizeof(pthread_t));
+    conns = (conn_t *) calloc(clients, sizeof(conn_t));
+    if (!threads || !conns) {
+	perror("malloc");
+	exit(1);
+    }
+    for (i = 0; i < clients; i++) {
+	conns[i].id = i;
+	snprintf(conns[i].in, FNLEN, "%s/in%ld", tmpdir, i);
+	snprintf(conns[i].out, FNLEN, "%s/out%ld", tmpdir, i);
+	if (mkfifo(conns[i].in, 0600) == -1 || mkfifo(conns[i].out, 0600) == -1) {
+	    perror("mkfifo");
+	    exit(1);
+	}
+    }
+
+    pthread_barrier_init(&barrier_start, NULL, clients + 1);
+    pid = start_server(server, &console);
+    for (i = 0; i < clients; i++) {
+	if (pthread_create(&threads[i], NULL, client, &conns[i])) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+	snprintf(line, sizeof(line), "E %s %s\n", conns[i].in, conns[i].out);
+	if (write(console, line, strlen(line)) == -1) {
+	    perror("write to server");
+	    exit(1);
+	}
+    }
+
+    pthread_barrier_wait(&barrier_start);
+    start = now();
+    for (i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+    elapsed = now() - start;
+
+    /* End of console input: the server exits once its clients are gone */
+    close(console);
+    waitpid(pid, &status, 0);
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < clients; i++) {
+	hist_merge(&total, &conns[i].hist);
+	unlink(conns[i].in);
+	unlink(conns[i].out);
+    }
+    rmdir(tmpdir);
+    pthread_barrier_destroy(&barrier_start);
+    report(strrchr(server, '/') ? strrchr(server, '/') + 1 : server, elapsed,
+	    &total);
+    free(threads);
+    free(conns);
+}
+
+int main(int argc, char *argv[]) {
+    char *defaults[] = { "./server_coarse", "./server_fine", "./server_rw" };
+    int first;
+    int i;
+
+    first = load_options(argc, argv, "[server ...]");
+    load_init();
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-20s %4s %12s %9s %9s %9s\n", "server", "clients", "ops/s",
+	    "p50 us", "p99 us", "p999 us");
+    if (first == argc)
+	for (i = 0; i < 3; i++) bench(defaults[i]);
+    else
+	for (i = first; i < argc; i++) bench(argv[i]);
+    return 0;
+}
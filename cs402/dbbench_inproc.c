@@ -0,0 +1,90 @@
+#include "db.h"
+#include "loadgen.h"
+#include "shard.h"
+#include "qcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * In-process load generator.  It is linked against one database variant
+ * (see the dbbench_* targets in the Makefile) and drives interpret_command
+ * from a number of client threads, the way server.c's client threads do,
+ * without the fifos in the way.  Each client issues the workload described
+ * by the options (see loadgen.c) against a key space that starts half full,
+ * and one row of throughput and latency percentiles is printed.
+ *
+ * bench.sh runs every variant across a range of client counts; dbbench does
+ * the same job through real server processes.
+ */
+
+/* Per-client latencies, merged at the end */
+histogram_t *hists;
+
+/* Body of one client thread.  arg is the client's number, used as a seed. */
+static void *client(void *arg) {
+    long id = (long) arg;
+    unsigned long long seed = 0x9e3779b97f4a7c15ULL * (id + 1);
+    histogram_t *h = &hists[id];
+    char command[64];
+    char response[256];
+    double start;
+    int i;
+
+    for (i = 0; i < ops; i++) {
+	next_command(&seed, command, sizeof(command));
+	start = now();
+	interpret_command(command, response, sizeof(response));
+	hist_record(h, (long)((now() - start) * 1e9));
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    char command[64];
+    char response[256];
+    char *variant;
+    pthread_t *threads;
+    histogram_t total;
+    double start, elapsed;
+    long i;
+
+    if ((i = load_options(argc, argv, "")) != argc) {
+	fprintf(stderr, "%s: unexpected argument %s\n", argv[0], argv[i]);
+	exit(1);
+    }
+    load_init();
+    shards_init(shards);
+    qcache_init(cache);
+    threads = (pthread_t *) malloc(clients * sizeof(pthread_t));
+    hists = (histogram_t *) calloc(clients, sizeof(histogram_t));
+    if (!threads || !hists) {
+	perror("malloc");
+	exit(1);
+    }
+
+    /* Preload every other key */
+    for (i = 0; i < keys; i += 2) {
+	snprintf(command, sizeof(command), "a k%ld v%ld\n", i, i);
+	interpret_command(command, response, sizeof(response));
+    }
+
+    start = now();
+    for (i = 0; i < clients; i++)
+	if (pthread_create(&threads[i], NULL, client, (void *) i)) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    for (i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+    elapsed = now() - start;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < clients; i++) hist_merge(&total, &hists[i]);
+
+    /* dbbench_fine -> fine */
+    variant = strrchr(argv[0], '_') ? strrchr(argv[0], '_') + 1 : argv[0];
+    report(variant, elapsed, &total);
+    free(threads);
+    free(hists);
+    return 0;
+}
@@ -0,0 +1,324 @@
+#include "dbclient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Room made for each read of responses */
+#define DBCLIENT_READ 65536
+
+/* Connect to the server's socket at path, allowing window requests in flight
+ * and holding back up to batch bytes of them (0 for the defaults).  Returns
+ * NULL, with errno set, if it cannot. */
+dbclient_t *dbclient_connect(char *path, long window, size_t batch) {
+    struct sockaddr_un addr;
+    dbclient_t *client;
+
+    if (!(client = (dbclient_t *) calloc(1, sizeof(dbclient_t))))
+	return NULL;
+    client->window = window > 0 ? window : DBCLIENT_WINDOW;
+    client->batch = batch > 0 ? batch : DBCLIENT_BATCH;
+    client->cap = client->window;
+    if (!(client->req = (dbclient_request_t *)
+		malloc(client->cap * sizeof(dbclient_request_t)))) {
+	free(client);
+	return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if ((client->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    fcntl(client->fd, F_SETFL, O_NONBLOCK) == -1) {
+	int saved = errno;
+
+	if (client->fd != -1) close(client->fd);
+	free(client->req);
+	free(client);
+	errno = saved;
+	return NULL;
+    }
+    return client;
+}
+
+/* Take the oldest unanswered request off the ring */
+static dbclient_request_t pop(dbclient_t *client) {
+    dbclient_request_t r = client->req[client->head];
+
+    client->head = (client->head + 1) % client->cap;
+    client->pending--;
+    return r;
+}
+
+/* Add a request to the ring, which only outgrows the window if callbacks
+ * submit */
+static int push(dbclient_t *client, dbclient_callback_t callback, void *arg) {
+    dbclient_request_t *nreq;
+    long i;
+
+    if (client->pending == client->cap) {
+	if (!(nreq = (dbclient_request_t *)
+		    malloc(2 * client->cap * sizeof(dbclient_request_t))))
+	    return -1;
+	for (i = 0; i < client->pending; i++)
+	    nreq[i] = client->req[(client->head + i) % client->cap];
+	free(client->req);
+	client->req = nreq;
+	client->cap *= 2;
+	client->head = 0;
+    }
+    client->req[(client->head + client->pending) % client->cap].callback =
+	callback;
+    client->req[(client->head + client->pending) % client->cap].arg = arg;
+    client->pending++;
+    return 0;
+}
+
+/* Give up on the connection: every request still waiting gets NULL */
+static void fail(dbclient_t *client) {
+    dbclient_request_t r;
+
+    client->failed = 1;
+    client->olen = client->opos = 0;
+    client->dispatching++;
+    while (client->pending > 0) {
+	r = pop(client);
+	if (r.callback) r.callback(NULL, r.arg);
+    }
+    client->dispatching--;
+}
+
+/* Write as much of the queued frames as the socket takes without waiting */
+static int send_queued(dbclient_t *client) {
+    ssize_t n;
+
+    client->held = 0;
+    while (client->opos < client->olen) {
+	n = send(client->fd, client->obuf + client->opos,
+		client->olen - client->opos, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n == -1 && errno == EINTR) continue;
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+	if (n <= 0) {
+	    fail(client);
+	    return -1;
+	}
+	client->opos += n;
+    }
+    client->olen = client->opos = 0;
+    return 0;
+}
+
+/* Hand every complete response frame in the input buffer to its request.
+ * Return the number delivered. */
+static int dispatch(dbclient_t *client) {
+    dbclient_request_t r;
+    char *start;
+    uint32_t flen;
+    int n = 0;
+
+    while (client->ilen - client->ipos >= sizeof(flen)) {
+	start = client->ibuf + client->ipos;
+	memcpy(&flen, start, sizeof(flen));
+	flen = ntohl(flen);
+	if (client->ilen - client->ipos - sizeof(flen) < flen) break;
+	/* Slide the response over its length so there is room for a NUL */
+	memmove(start, start + sizeof(flen), flen);
+	start[flen] = '\0';
+	client->ipos += sizeof(flen) + flen;
+	/* A response nobody asked for means we have lost our place */
+	if (client->pending == 0) {
+	    fail(client);
+	    return n;
+	}
+	r = pop(client);
+	n++;
+	if (r.callback) {
+	    client->dispatching++;
+	    r.callback(start, r.arg);
+	    client->dispatching--;
+	}
+    }
+    return n;
+}
+
+/* Read and deliver the responses that have arrived, without waiting.
+ * Return the number delivered, or -1 if the connection failed. */
+static int receive(dbclient_t *client) {
+    size_t ncap;
+    char *nbuf;
+    ssize_t got;
+    int n = 0;
+
+    for (;;) {
+	/* Slide what is left of the last read to the front, and make room */
+	if (client->ipos > 0) {
+	    memmove(client->ibuf, client->ibuf + client->ipos,
+		    client->ilen - client->ipos);
+	    client->ilen -= client->ipos;
+	    client->ipos = 0;
+	}
+	if (client->icap - client->ilen < DBCLIENT_READ) {
+	    ncap = client->ilen + DBCLIENT_READ;
+	    if (ncap < 2 * client->icap) ncap = 2 * client->icap;
+	    if (!(nbuf = (char *) realloc(client->ibuf, ncap))) {
+		fail(client);
+		return -1;
+	    }
+	    client->ibuf = nbuf;
+	    client->icap = ncap;
+	}
+	got = recv(client->fd, client->ibuf + client->ilen,
+		client->icap - client->ilen, MSG_DONTWAIT);
+	if (got == -1 && errno == EINTR) continue;
+	if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return n;
+	if (got <= 0) {
+	    fail(client);
+	    return -1;
+	}
+	client->ilen += got;
+	n += dispatch(client);
+	if (client->failed) return -1;
+    }
+}
+
+/* Queue command, to be sent as part of a batch; callback gets its response
+ * with arg.  Only waits if the window is full.  Returns 0, or -1 if the
+ * connection has failed. */
+int dbclient_submit(dbclient_t *client, char *command,
+	dbclient_callback_t callback, void *arg) {
+    size_t len = strlen(command);
+    size_t need, ncap;
+    uint32_t flen;
+    char *nbuf;
+
+    if (client->failed) return -1;
+    while (!client->dispatching && client->pending >= client->window)
+	if (dbclient_poll(client, -1) == -1) return -1;
+
+    need = client->olen + sizeof(flen) + len;
+    if (need > client->ocap) {
+	ncap = client->ocap ? 2 * client->ocap : client->batch + 64;
+	while (ncap < need) ncap *= 2;
+	if (!(nbuf = (char *) realloc(client->obuf, ncap))) return -1;
+	client->obuf = nbuf;
+	client->ocap = ncap;
+    }
+    if (push(client, callback, arg) == -1) return -1;
+    flen = htonl(len);
+    memcpy(client->obuf + client->olen, &flen, sizeof(flen));
+    memcpy(client->obuf + client->olen + sizeof(flen), command, len);
+    client->olen = need;
+    client->held++;
+
+    /* Send now if nothing else is in flight or the batch is full; otherwise
+     * the request waits for the others, or for the next poll */
+    if (client->held == client->pending ||
+	    client->olen - client->opos >= client->batch)
+	return send_queued(client);
+    return 0;
+}
+
+static void future_done(char *response, void *arg) {
+    dbclient_future_t *future = (dbclient_future_t *) arg;
+
+    future->response = response ? strdup(response) : NULL;
+    future->done = 1;
+}
+
+/* Submit command and return a future for its response, or NULL if the
+ * connection has failed.  Release it with dbclient_future_free. */
+dbclient_future_t *dbclient_future(dbclient_t *client, char *command) {
+    dbclient_future_t *future;
+
+    if (!(future = (dbclient_future_t *) calloc(1, sizeof(dbclient_future_t))))
+	return NULL;
+    if (dbclient_submit(client, command, future_done, future) == -1) {
+	free(future);
+	return NULL;
+    }
+    return future;
+}
+
+/* Wait for future's response and return it, or NULL if the connection
+ * failed.  The response belongs to the future. */
+char *dbclient_get(dbclient_t *client, dbclient_future_t *future) {
+    while (!future->done)
+	if (dbclient_poll(client, -1) == -1) break;
+    return future->response;
+}
+
+void dbclient_future_free(dbclient_future_t *future) {
+    if (!future) return;
+    free(future->response);
+    free(future);
+}
+
+/* Send the requests held back, then deliver the responses that have arrived,
+ * waiting up to timeout milliseconds (-1 for ever, 0 not at all) for one if
+ * none has.  Return the number of responses delivered, or -1 if the
+ * connection has failed. */
+int dbclient_poll(dbclient_t *client, int timeout) {
+    struct pollfd pfd;
+    int n;
+
+    if (client->failed || client->dispatching) return client->failed ? -1 : 0;
+    if (client->olen > client->opos && send_queued(client) == -1) return -1;
+    if ((n = receive(client)) != 0 || timeout == 0 || client->pending == 0)
+	return n;
+
+    pfd.fd = client->fd;
+    pfd.events = dbclient_events(client);
+    if (poll(&pfd, 1, timeout) <= 0) return 0;
+    if (client->olen > client->opos && send_queued(client) == -1) return -1;
+    n = receive(client);
+    /* Callbacks may have submitted more */
+    if (n > 0 && client->olen > client->opos && send_queued(client) == -1)
+	return -1;
+    return n;
+}
+
+/* Wait until every request submitted has been answered */
+int dbclient_drain(dbclient_t *client) {
+    while (client->pending > 0)
+	if (dbclient_poll(client, -1) == -1) return -1;
+    return client->failed ? -1 : 0;
+}
+
+/* Requests submitted and not yet answered */
+long dbclient_pending(dbclient_t *client) {
+    return client->pending;
+}
+
+/* The socket, and the poll (2) events to watch it for */
+int dbclient_fd(dbclient_t *client) {
+    return client->fd;
+}
+
+short dbclient_events(dbclient_t *client) {
+    short events = 0;
+
+    if (client->pending > 0) events |= POLLIN;
+    if (client->olen > client->opos) events |= POLLOUT;
+    return events;
+}
+
+/* Close the connection.  Requests not yet answered get NULL; call
+ * dbclient_drain first to wait for them. */
+void dbclient_close(dbclient_t *client) {
+    if (!client) return;
+    fail(client);
+    close(client->fd);
+    free(client->req);
+    free(client->obuf);
+    free(client->ibuf);
+    free(client);
+}
@@ -0,0 +1,76 @@
+#ifndef DBCLIENT_H
+#define DBCLIENT_H
+#include <stddef.h>
+
+/*
+ * Client library for the server's socket (server -u socket).  Requests are
+ * pipelined: dbclient_submit queues a command and returns at once, and its
+ * response is delivered later, in order, to a callback or to a future.  Any
+ * number of requests, up to the connection's window, can be waiting for
+ * their responses at once, so a client is limited by the server's throughput
+ * rather than by a round trip per command.
+ *
+ * Requests are batched without the caller's help: a request submitted while
+ * the connection is idle is sent at once, and those submitted while earlier
+ * ones are unanswered are held back and sent together, with one write, when
+ * DBCLIENT_BATCH bytes of them have built up or the next time the
+ * connection is polled.  The server answers a batch with one write too.
+ *
+ * Nothing here waits for the server except dbclient_poll with a timeout,
+ * dbclient_get and dbclient_drain, and dbclient_submit when the window is
+ * full.  The socket can be watched alongside others with dbclient_fd and
+ * dbclient_events, and dbclient_poll(client, 0) then called when it is
+ * ready.  A connection must only be used by one thread at a time.
+ *
+ * If the connection fails, every request still waiting is completed with a
+ * NULL response and later calls return -1.
+ */
+
+/* Requests in flight and bytes held back per batch, unless asked otherwise */
+#define DBCLIENT_WINDOW 1024
+#define DBCLIENT_BATCH 16384
+
+/* Called with each response, NUL terminated and valid only during the call,
+ * or NULL if the connection failed first.  A callback may submit further
+ * requests (they are not held to the window) but must not wait on the
+ * connection. */
+typedef void (*dbclient_callback_t)(char *response, void *arg);
+
+/* A response to be collected later; see dbclient_future */
+typedef struct DbclientFuture {
+	int done;
+	char *response;		/* Once done: malloc'ed, or NULL on failure */
+} dbclient_future_t;
+
+typedef struct DbclientRequest {
+	dbclient_callback_t callback;
+	void *arg;
+} dbclient_request_t;
+
+typedef struct Dbclient {
+	int fd;
+	int failed;
+	long window;		/* Requests allowed in flight */
+	size_t batch;		/* Bytes of requests held back before sending */
+	dbclient_request_t *req;	/* Unanswered requests, a ring of window */
+	long cap, head, pending;
+	long held;		/* Requests queued since the last send */
+	int dispatching;	/* In a callback */
+	char *obuf;		/* Frames not yet written */
+	size_t ocap, olen, opos;
+	char *ibuf;		/* Responses read but not yet delivered */
+	size_t icap, ilen, ipos;
+} dbclient_t;
+
+dbclient_t *dbclient_connect(char *, long, size_t);
+int dbclient_submit(dbclient_t *, char *, dbclient_callback_t, void *);
+dbclient_future_t *dbclient_future(dbclient_t *, char *);
+char *dbclient_get(dbclient_t *, dbclient_future_t *);
+void dbclient_future_free(dbclient_future_t *);
+int dbclient_poll(dbclient_t *, int);
+int dbclient_drain(dbclient_t *);
+long dbclient_pending(dbclient_t *);
+int dbclient_fd(dbclient_t *);
+short dbclient_events(dbclient_t *);
+void dbclient_close(dbclient_t *);
+#endif
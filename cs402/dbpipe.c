@@ -0,0 +1,173 @@
+#define _WITH_GETLINE
+#include "dbclient.h"
+#include "loadgen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+/*
+ * Push a file of commands, one per line, at a server's socket (server -u) as
+ * fast as it will take them, through the pipelining client library
+ * (dbclient.h), and report the rate and latencies on standard error.  The
+ * lines are dealt out in turn to the connections asked for, each of which
+ * keeps up to its window of requests in flight, so the server rather than a
+ * round trip per command is what is measured.
+ *
+ * Each response is printed as a line, in the order of its connection's
+ * commands; with one connection that is the file's order, so the output can
+ * be compared with another run.
+ *
+ * Usage: dbpipe [-c connections] [-w window] [-b batch bytes] [-q] socket [file]
+ */
+
+/* One connection and the send times of its requests in flight */
+typedef struct Conn {
+	dbclient_t *client;
+	double *sent;		/* A ring of window entries */
+	long head, n;
+	histogram_t hist;
+} conn_t;
+
+static int quiet = 0;
+static long window = DBCLIENT_WINDOW;
+
+static void response(char *text, void *arg) {
+    conn_t *conn = (conn_t *) arg;
+
+    if (!text) return;
+    hist_record(&conn->hist,
+	    (long) ((now() - conn->sent[conn->head]) * 1e9));
+    conn->head = (conn->head + 1) % window;
+    conn->n--;
+    if (!quiet) {
+	fputs(text, stdout);
+	putchar('\n');
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t got;
+    FILE *in = stdin;
+    struct pollfd *pfds;
+    conn_t *conns;
+    histogram_t total;
+    size_t batch = 0;
+    long sent = 0;
+    double start, elapsed;
+    int nconns = 1;
+    int more = 1, busy;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "c:w:b:q")) != -1) {
+	switch (c) {
+	    case 'c': nconns = atoi(optarg); break;
+	    case 'w': window = atol(optarg); break;
+	    case 'b': batch = atol(optarg); break;
+	    case 'q': quiet = 1; break;
+	    default: goto usage;
+	}
+    }
+    if (nconns < 1 || window < 1 || optind >= argc || argc - optind > 2)
+	goto usage;
+    if (argc - optind == 2 && !(in = fopen(argv[optind + 1], "r"))) {
+	perror(argv[optind + 1]);
+	exit(1);
+    }
+
+    conns = (conn_t *) calloc(nconns, sizeof(conn_t));
+    pfds = (struct pollfd *) calloc(nconns, sizeof(struct pollfd));
+    if (!conns || !pfds) {
+	perror("malloc");
+	exit(1);
+    }
+    for (i = 0; i < nconns; i++) {
+	if (!(conns[i].client = dbclient_connect(argv[optind], window, batch))) {
+	    perror(argv[optind]);
+	    exit(1);
+	}
+	if (!(conns[i].sent = (double *) malloc(window * sizeof(double)))) {
+	    perror("malloc");
+	    exit(1);
+	}
+	pfds[i].fd = dbclient_fd(conns[i].client);
+    }
+
+    /* Fill every window that has room, then wait for any connection to
+     * have responses or room to write, until the input is used up and
+     * answered */
+    start = now();
+    i = 0;
+    do {
+	while (more && conns[i].n < window) {
+	    if ((got = getline(&line, &len, in)) == -1) {
+		more = 0;
+		break;
+	    }
+	    if (got > 0 && line[got - 1] == '\n') line[got - 1] = '\0';
+	    conns[i].sent[(conns[i].head + conns[i].n) % window] = now();
+	    conns[i].n++;
+	    if (dbclient_submit(conns[i].client, line, response, &conns[i]) == -1) {
+		fprintf(stderr, "dbpipe: server closed the connection\n");
+		exit(1);
+	    }
+	    sent++;
+	    i = (i + 1) % nconns;
+	}
+
+	busy = 0;
+	for (c = 0; c < nconns; c++) {
+	    pfds[c].events = dbclient_events(conns[c].client);
+	    busy |= pfds[c].events != 0;
+	}
+	/* Held back requests are sent by the poll of their connection */
+	if (busy && more) {
+	    for (c = 0; c < nconns; c++)
+		if (dbclient_poll(conns[c].client, 0) == -1) goto closed;
+	} else if (busy) {
+	    if (poll(pfds, nconns, -1) == -1 && errno != EINTR) {
+		perror("poll");
+		exit(1);
+	    }
+	    for (c = 0; c < nconns; c++)
+		if (pfds[c].revents && dbclient_poll(conns[c].client, 0) == -1)
+		    goto closed;
+	}
+	/* With every window full, wait for the first one to make room */
+	if (more && conns[i].n >= window &&
+		dbclient_poll(conns[i].client, -1) == -1)
+	    goto closed;
+    } while (more || busy);
+    elapsed = now() - start;
+    fflush(stdout);
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nconns; i++) {
+	hist_merge(&total, &conns[i].hist);
+	dbclient_close(conns[i].client);
+	free(conns[i].sent);
+    }
+    fprintf(stderr, "%ld commands in %.3fs over %d connection%s: %.0f ops/s, "
+	    "p50 %.1f us, p99 %.1f us, p999 %.1f us\n", sent, elapsed, nconns,
+	    nconns == 1 ? "" : "s", sent / elapsed,
+	    hist_percentile(&total, 0.50) / 1e3,
+	    hist_percentile(&total, 0.99) / 1e3,
+	    hist_percentile(&total, 0.999) / 1e3);
+    free(line);
+    free(conns);
+    free(pfds);
+    return 0;
+
+closed:
+    fprintf(stderr, "dbpipe: server closed the connection\n");
+    exit(1);
+
+usage:
+    fprintf(stderr, "Usage: %s [-c connections] [-w window] [-b batch bytes] "
+	    "[-q] socket [file]\n", argv[0]);
+    exit(1);
+}
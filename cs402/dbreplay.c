@@ -0,0 +1,396 @@
+#include "loadgen.h"
+#include "trace.h"
+#include "db.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Replay a command trace (see trace.h; the server's -t option or its trace
+ * console command writes one) against server binaries.  For each server named
+ * on the command line it starts the server listening on a socket in a
+ * temporary directory, connects once for every client in the trace and
+ * sends each client's commands in the order they were recorded, at the
+ * recorded pace scaled by the speed option (0 sends each command as soon as
+ * the last response is in).  Responses that differ from the recorded ones are
+ * counted as divergences and the first few are shown.  One row per server
+ * reports the replayed round trips, after a row with the recorded latencies
+ * (the time the server took to serve each command, so without the trip).
+ * Clients that ran concurrently when the trace was taken may interleave
+ * differently in the replay, so some divergence is expected from them.
+ *
+ * Usage: dbreplay [-s speed] [-S shards] [-C cache entries] trace [server ...]
+ */
+
+#define FNLEN 256
+/* Divergences shown per server */
+#define SHOW 5
+
+/* One recorded command */
+typedef struct Rec {
+	uint64_t ns;
+	long seq;		/* Position in the file, to keep sorting stable */
+	int conn;
+	uint32_t latency;
+	char *command;
+	char *response;
+} rec_t;
+
+/* One traced client and our connection standing in for it */
+typedef struct Conn {
+	rec_t **rec;		/* Its commands in order */
+	long n, cap;
+	int fd;
+	long diverged;
+	histogram_t hist;
+} conn_t;
+
+static rec_t *recs;
+static long nrecs;
+static conn_t *conns;
+static double speed = 1;
+static double start;
+static long shown;
+static pthread_barrier_t barrier_start;
+static pthread_mutex_t mutex_show = PTHREAD_MUTEX_INITIALIZER;
+
+/* Order records by start time, then by file position */
+static int by_time(const void *a, const void *b) {
+    const rec_t *x = (const rec_t *) a, *y = (const rec_t *) b;
+
+    if (x->ns != y->ns) return x->ns < y->ns ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* A NUL terminated copy of the n bytes at p */
+static char *copy(char *p, size_t n) {
+    char *s = (char *) malloc(n + 1);
+
+    if (!s) {
+	perror("malloc");
+	exit(1);
+    }
+    memcpy(s, p, n);
+    s[n] = '\0';
+    return s;
+}
+
+/* Read the trace at path into recs, sorted by time, and give each client in
+ * it a conn.  Return the number of clients. */
+static int load_trace(char *path) {
+    trace_header_t header;
+    trace_record_t tr;
+    char *buf = NULL;
+    size_t cap = 0;
+    int *ids = NULL;
+    int nids = 0, nconns = 0;
+    long reccap = 0, i;
+    conn_t *c;
+    FILE *f;
+
+    if (!(f = fopen(path, "r")) || fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) {
+	fprintf(stderr, "dbreplay: %s is not a trace\n", path);
+	exit(1);
+    }
+    while (fread(&tr, sizeof(tr), 1, f) == 1) {
+	if (cap < (size_t) tr.command_len + tr.response_len &&
+		!(buf = realloc(buf, cap = tr.command_len + tr.response_len))) {
+	    perror("malloc");
+	    exit(1);
+	}
+	if (fread(buf, 1, tr.command_len + tr.response_len, f) !=
+		(size_t) tr.command_len + tr.response_len) {
+	    fprintf(stderr, "dbreplay: %s is cut short\n", path);
+	    break;
+	}
+	if (nrecs == reccap &&
+		!(recs = realloc(recs, (reccap = reccap ? 2 * reccap : 1024) *
+			sizeof(rec_t)))) {
+	    perror("malloc");
+	    exit(1);
+	}
+	/* Client ids are small and dense: number the conns by them */
+	if ((int) tr.client >= nids) {
+	    if (!(ids = realloc(ids, (tr.client + 1) * sizeof(int)))) {
+		perror("malloc");
+		exit(1);
+	    }
+	    while (nids <= (int) tr.client) ids[nids++] = -1;
+	}
+	if (ids[tr.client] == -1) ids[tr.client] = nconns++;
+	recs[nrecs].ns = tr.ns;
+	recs[nrecs].seq = nrecs;
+	recs[nrecs].conn = ids[tr.client];
+	recs[nrecs].latency = tr.latency;
+	recs[nrecs].command = copy(buf, tr.command_len);
+	recs[nrecs].response = copy(buf + tr.command_len, tr.response_len);
+	nrecs++;
+    }
+    fclose(f);
+    free(buf);
+    free(ids);
+
+    qsort(recs, nrecs, sizeof(rec_t), by_time);
+    if (!(conns = (conn_t *) calloc(nconns, sizeof(conn_t)))) {
+	perror("malloc");
+	exit(1);
+    }
+    for (i = 0; i < nrecs; i++) {
+	c = &conns[recs[i].conn];
+	if (c->n == c->cap &&
+		!(c->rec = realloc(c->rec, (c->cap = c->cap ? 2 * c->cap : 64) *
+			sizeof(rec_t *)))) {
+	    perror("malloc");
+	    exit(1);
+	}
+	c->rec[c->n++] = &recs[i];
+    }
+    return nconns;
+}
+
+/* Write or read exactly n bytes.  Return false if the connection failed. */
+static int full_io(int fd, char *p, size_t n, int out) {
+    ssize_t done;
+
+    while (n > 0) {
+	done = out ? write(fd, p, n) : read(fd, p, n);
+	if (done == -1 && errno == EINTR) continue;
+	if (done <= 0) return 0;
+	p += done;
+	n -= done;
+    }
+    return 1;
+}
+
+/* Send command as a frame and read the response frame into *line */
+static void round_trip(int fd, char *command, char **line, size_t *len) {
+    uint32_t flen = htonl(strlen(command));
+
+    if (!full_io(fd, (char *) &flen, sizeof(flen), 1) ||
+	    !full_io(fd, command, strlen(command), 1) ||
+	    !full_io(fd, (char *) &flen, sizeof(flen), 0)) {
+	fprintf(stderr, "dbreplay: server closed the connection\n");
+	exit(1);
+    }
+    flen = ntohl(flen);
+    if (*len < flen + 1 && !(*line = realloc(*line, *len = flen + 1))) {
+	perror("malloc");
+	exit(1);
+    }
+    if (!full_io(fd, *line, flen, 0)) {
+	fprintf(stderr, "dbreplay: server closed the connection\n");
+	exit(1);
+    }
+    (*line)[flen] = '\0';
+}
+
+/* Sleep until the replay clock reaches the recorded time ns */
+static void wait_until(uint64_t ns) {
+    struct timespec ts;
+    double wait;
+
+    if (speed == 0) return;
+    if ((wait = start + ns / 1e9 / speed - now()) <= 0) return;
+    ts.tv_sec = (time_t) wait;
+    ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/* Body of one client thread */
+static void *client(void *arg) {
+    conn_t *conn = (conn_t *) arg;
+    char *line = NULL;
+    size_t len = 0;
+    double sent;
+    rec_t *r;
+    long i;
+
+    pthread_barrier_wait(&barrier_start);
+    for (i = 0; i < conn->n; i++) {
+	r = conn->rec[i];
+	wait_until(r->ns);
+	sent = now();
+	round_trip(conn->fd, r->command, &line, &len);
+	hist_record(&conn->hist, (long) ((now() - sent) * 1e9));
+	if (strcmp(line, r->response)) {
+	    conn->diverged++;
+	    pthread_mutex_lock(&mutex_show);
+	    if (shown++ < SHOW)
+		printf("  diverged: %s: recorded \"%s\", got \"%s\"\n",
+			r->command, r->response, line);
+	    pthread_mutex_unlock(&mutex_show);
+	}
+    }
+    /* End of input makes the server retire the client */
+    close(conn->fd);
+    free(line);
+    return NULL;
+}
+
+/* Connect to the server's socket at path, waiting for it to appear */
+static int connect_server(char *path) {
+    struct sockaddr_un addr;
+    int fd, tries;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    for (tries = 0; tries < 500; tries++) {
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) break;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+	    return fd;
+	close(fd);
+	usleep(10000);
+    }
+    perror(path);
+    exit(1);
+}
+
+/* Start server listening on sock, with the shards and query cache asked for
+ * and with its standard input on a pipe and its output discarded.  Return
+ * its pid and put our end of the pipe in *console. */
+static pid_t start_server(char *server, char *sock, int *console) {
+    int fds[2];
+    char nshards[16], ncache[16];
+    int devnull;
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+	perror("pipe");
+	exit(1);
+    }
+    if ((pid = fork()) == -1) {
+	perror("fork");
+	exit(1);
+    } else if (pid == 0) {
+	dup2(fds[0], 0);
+	close(fds[0]);
+	close(fds[1]);
+	if ((devnull = open("/dev/null", O_WRONLY)) != -1) {
+	    dup2(devnull, 1);
+	    dup2(devnull, 2);
+	}
+	snprintf(nshards, sizeof(nshards), "%d", shards);
+	snprintf(ncache, sizeof(ncache), "%d", cache);
+	execl(server, server, "-u", sock, "-S", nshards, "-C", ncache,
+		(char *) NULL);
+	_exit(127);
+    }
+    close(fds[0]);
+    *console = fds[1];
+    return pid;
+}
+
+/* Replay the trace against one server binary and report on it */
+static void replay(char *server) {
+    char tmpdir[] = "/tmp/dbreplayXXXXXX";
+    char sock[FNLEN];
+    pthread_t *threads;
+    histogram_t total;
+    double elapsed;
+    long diverged = 0;
+    int console;
+    pid_t pid;
+    int status;
+    int i;
+
+    if (access(server, X_OK) == -1) {
+	perror(server);
+	return;
+    }
+    if (!mkdtemp(tmpdir)) {
+	perror("mkdtemp");
+	exit(1);
+    }
+    if (!(threads = (pthread_t *) malloc(clients * sizeof(pthread_t)))) {
+	perror("malloc");
+	exit(1);
+    }
+    snprintf(sock, sizeof(sock), "%s/sock", tmpdir);
+    pid = start_server(server, sock, &console);
+    shown = 0;
+    pthread_barrier_init(&barrier_start, NULL, clients + 1);
+    for (i = 0; i < clients; i++) {
+	conns[i].fd = connect_server(sock);
+	conns[i].diverged = 0;
+	memset(&conns[i].hist, 0, sizeof(histogram_t));
+	if (pthread_create(&threads[i], NULL, client, &conns[i])) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+
+    start = now();
+    pthread_barrier_wait(&barrier_start);
+    for (i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+    elapsed = now() - start;
+
+    /* End of console input: the server exits once its clients are gone */
+    close(console);
+    waitpid(pid, &status, 0);
+    rmdir(tmpdir);
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < clients; i++) {
+	hist_merge(&total, &conns[i].hist);
+	diverged += conns[i].diverged;
+    }
+    pthread_barrier_destroy(&barrier_start);
+    report(strrchr(server, '/') ? strrchr(server, '/') + 1 : server, elapsed,
+	    &total);
+    if (diverged)
+	printf("  %ld of %ld responses diverged\n", diverged, nrecs);
+    free(threads);
+}
+
+int main(int argc, char *argv[]) {
+    char *defaults[] = { "./server_coarse", "./server_fine", "./server_rw" };
+    histogram_t recorded;
+    long i;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:S:C:")) != -1) {
+	switch (c) {
+	    case 's': speed = atof(optarg); break;
+	    case 'S': shards = atoi(optarg); break;
+	    case 'C': cache = atoi(optarg); break;
+	    default: goto usage;
+	}
+    }
+    if (optind == argc || speed < 0 || shards < 1 || shards > MAX_SHARDS ||
+	    cache < 0) {
+usage:
+	fprintf(stderr, "Usage: %s [-s speed, 1 as recorded, 0 as fast as possible]\n"
+		"\t[-S database shards] [-C query cache entries per thread]\n"
+		"\ttrace [server ...]\n", argv[0]);
+	exit(1);
+    }
+    clients = load_trace(argv[optind++]);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-20s %4s %12s %9s %9s %9s\n", "server", "clients", "ops/s",
+	    "p50 us", "p99 us", "p999 us");
+    if (nrecs == 0) return 0;
+    memset(&recorded, 0, sizeof(recorded));
+    for (i = 0; i < nrecs; i++) hist_record(&recorded, recs[i].latency);
+    report("recorded", recs[nrecs - 1].ns > 0 ? recs[nrecs - 1].ns / 1e9 : 1,
+	    &recorded);
+    if (optind == argc)
+	for (i = 0; i < 3; i++) replay(defaults[i]);
+    else
+	for (i = optind; i < argc; i++) replay(argv[i]);
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "epoch.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * The global epoch only advances when every thread inside a critical section
+ * has seen the current value.  An object retired in epoch e was unlinked
+ * before the epoch moved past e, so once the global epoch reaches e + 2 no
+ * thread can still hold a pointer to it.
+ *
+ * Each thread owns a record, found through a thread-local pointer, and only
+ * writes its own record, so readers never write a shared cache line.  Records
+ * are never freed; a record whose thread exited is reused by the next new
+ * thread, along with any objects still waiting in its limbo list.
+ */
+
+/* Retire this many objects before trying to advance the epoch and free */
+#define EPOCH_BATCH 64
+
+/* An object waiting to be freed */
+typedef struct Retired {
+	struct Retired *next;
+	void *ptr;
+	void (*destroy)(void *);
+	unsigned long epoch;	/* Global epoch when it was retired */
+} retired_t;
+
+/* Per-thread state, padded to its own cache line */
+typedef struct EpochRecord {
+	unsigned long epoch;	/* Global epoch seen by epoch_enter */
+	int active;		/* Depth of nested critical sections */
+	int in_use;		/* Owned by a live thread */
+	retired_t *limbo;	/* Retired objects, newest first */
+	int nlimbo;
+	struct EpochRecord *next;
+} __attribute__((aligned(64))) epoch_record_t;
+
+unsigned long global_epoch = 0;
+/* All records ever created.  Only ever pushed onto, so it can be walked
+ * without a lock. */
+epoch_record_t *records = NULL;
+
+static __thread epoch_record_t *self = NULL;
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: hand the record back for reuse */
+static void record_release(void *arg) {
+    epoch_record_t *rec = (epoch_record_t *) arg;
+
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void record_key_create() {
+    pthread_key_create(&record_key, record_release);
+}
+
+/* Return the calling thread's record, claiming a free one or creating one on
+ * first use. */
+static epoch_record_t *self_record() {
+    epoch_record_t *rec;
+
+    if (self) return self;
+    pthread_once(&record_once, record_key_create);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+	int free_rec = 0;
+
+	if (__atomic_compare_exchange_n(&rec->in_use, &free_rec, 1, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	    break;
+    }
+    if (!rec) {
+	if (posix_memalign((void **) &rec, 64, sizeof(epoch_record_t))) {
+	    fprintf(stderr, "epoch record allocation failed, exiting\n");
+	    exit(1);
+	}
+	rec->epoch = 0;
+	rec->active = 0;
+	rec->in_use = 1;
+	rec->limbo = NULL;
+	rec->nlimbo = 0;
+	rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 0,
+		    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+    pthread_setspecific(record_key, rec);
+    return self = rec;
+}
+
+/* Enter a read-side critical section.  Pointers loaded before the matching
+ * epoch_exit stay valid until then.  Sections nest (a snapshot load holds
+ * the write hooks of every shard at once); only the outermost announces. */
+void epoch_enter() {
+    epoch_record_t *rec = self_record();
+
+    if (rec->active) {
+	__atomic_store_n(&rec->active, rec->active + 1, __ATOMIC_RELAXED);
+	return;
+    }
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&global_epoch,
+		__ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->active, 1, __ATOMIC_RELEASE);
+    /* The announcement must be visible before we read any shared pointer */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Leave the critical section */
+void epoch_exit() {
+    __atomic_store_n(&self->active, self->active - 1, __ATOMIC_RELEASE);
+}
+
+/* Advance the global epoch if every active thread has seen it */
+static void try_advance() {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    epoch_record_t *rec;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec; rec = rec->next)
+	if (__atomic_load_n(&rec->active, __ATOMIC_ACQUIRE) &&
+		__atomic_load_n(&rec->epoch, __ATOMIC_RELAXED) != e)
+	    return;
+    __atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/* Free everything in rec's limbo list that was retired two epochs ago */
+static void collect(epoch_record_t *rec) {
+    unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    retired_t **pr = &rec->limbo;
+    retired_t *r;
+
+    while ((r = *pr)) {
+	if (r->epoch + 2 <= e) {
+	    *pr = r->next;
+	    r->destroy(r->ptr);
+	    free(r);
+	    rec->nlimbo--;
+	} else {
+	    pr = &r->next;
+	}
+    }
+}
+
+/* Free ptr with destroy once no reader can reach it.  The caller must already
+ * have made ptr unreachable from the shared structure. */
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+    epoch_record_t *rec = self_record();
+    retired_t *r = (retired_t *) malloc(sizeof(retired_t));
+
+    if (!r) {
+	fprintf(stderr, "epoch retire allocation failed, exiting\n");
+	exit(1);
+    }
+    r->ptr = ptr;
+    r->destroy = destroy;
+    r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    r->next = rec->limbo;
+    rec->limbo = r;
+
+    if (++rec->nlimbo >= EPOCH_BATCH) {
+	try_advance();
+	collect(rec);
+    }
+}
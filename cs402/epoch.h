@@ -0,0 +1,13 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+/*
+ * Epoch-based reclamation.  Readers bracket every traversal of a lock-free
+ * structure with epoch_enter/epoch_exit.  A writer that unlinks an object
+ * hands it to epoch_retire instead of freeing it, and it is freed only once
+ * every thread that might still be looking at it has left its critical
+ * section.
+ */
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *, void (*)(void *));
+#endif
@@ -0,0 +1,54 @@
+#ifndef KEY_H
+#define KEY_H
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Inline key prefixes.  Every index node keeps the first KEY_PREFIX bytes of
+ * its key, big endian and zero padded, as two integers, and the key's
+ * length, next to its links.  Comparing prefixes as unsigned integers orders
+ * keys as strcmp does, so a search step decides on the node it is already
+ * looking at and only goes to the key string, a pointer away, when the
+ * prefixes tie.
+ */
+#define KEY_PREFIX 16
+
+/* A key being searched for, with its prefix worked out once */
+typedef struct SearchKey {
+	uint64_t prefix[2];
+	int len;
+	char *name;
+} search_key_t;
+
+/* Fill in prefix from name */
+static inline void key_prefix(char *name, uint64_t *prefix) {
+    unsigned char *p = (unsigned char *) name;
+    int i;
+
+    prefix[0] = prefix[1] = 0;
+    for (i = 0; i < KEY_PREFIX && p[i]; i++)
+	prefix[i / 8] |= (uint64_t) p[i] << (56 - 8 * (i % 8));
+}
+
+static inline void key_make(search_key_t *k, char *name) {
+    key_prefix(name, k->prefix);
+    k->len = strlen(name);
+    k->name = name;
+}
+
+/* Compare the key with the given prefix, length and name against k, as
+ * strcmp would.  Equal prefixes mean the first KEY_PREFIX bytes are equal;
+ * if k is shorter than that so is the other key, and they are the same. */
+static inline int key_cmp(uint64_t *prefix, int len, char *name,
+	search_key_t *k) {
+    if (prefix[0] != k->prefix[0]) return prefix[0] < k->prefix[0] ? -1 : 1;
+    if (prefix[1] != k->prefix[1]) return prefix[1] < k->prefix[1] ? -1 : 1;
+    if (k->len < KEY_PREFIX) return 0;
+    /* Both are at least KEY_PREFIX long; the shorter one's NUL decides */
+    return memcmp(name + KEY_PREFIX, k->name + KEY_PREFIX,
+	    (len < k->len ? len : k->len) - KEY_PREFIX + 1);
+}
+
+/* key_cmp of a node's key */
+#define NODE_CMP(node, k) key_cmp((node)->prefix, (node)->len, (node)->name, (k))
+#endif
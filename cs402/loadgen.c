@@ -0,0 +1,162 @@
+#include "loadgen.h"
+#include "db.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+int clients = 1;
+int ops = 100000;
+int keys = 10000;
+int mix[3] = { 90, 5, 5 };
+double theta = 0.0;
+int shards = 1;
+int cache = 0;
+
+/* Cumulative Zipf probabilities by key rank, built by load_init if theta is
+ * not 0.  Rank 0 is the hottest key. */
+static double *zipf_cdf = NULL;
+
+/* Parse the workload options common to all drivers and return the index of
+ * the first argument that is not an option.  usage is printed, after the
+ * common options, if they are wrong. */
+int load_options(int argc, char *argv[], char *usage) {
+    int c;
+
+    while ((c = getopt(argc, argv, "c:n:k:m:z:S:C:")) != -1) {
+	switch (c) {
+	    case 'c': clients = atoi(optarg); break;
+	    case 'n': ops = atoi(optarg); break;
+	    case 'k': keys = atoi(optarg); break;
+	    case 'm':
+		if (sscanf(optarg, "%d:%d:%d", &mix[0], &mix[1], &mix[2]) != 3)
+		    mix[0] = -1;
+		break;
+	    case 'z': theta = atof(optarg); break;
+	    case 'S': shards = atoi(optarg); break;
+	    case 'C': cache = atoi(optarg); break;
+	    default: goto usage;
+	}
+    }
+    if (clients < 1 || ops < 1 || keys < 1 || theta < 0 || mix[0] < 0 ||
+	    mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] != 100 || shards < 1 ||
+	    shards > MAX_SHARDS || cache < 0)
+	goto usage;
+    return optind;
+
+usage:
+    fprintf(stderr, "Usage: %s [-c clients] [-n ops per client] [-k keys]\n"
+	    "\t[-m query%%:add%%:delete%%] [-z zipf theta, 0 = uniform]\n"
+	    "\t[-S database shards] [-C query cache entries per thread] %s\n",
+	    argv[0], usage);
+    exit(1);
+}
+
+/* Build the Zipf table, if one is needed */
+void load_init() {
+    double sum = 0;
+    int i;
+
+    if (theta == 0) return;
+    if (!(zipf_cdf = (double *) malloc(keys * sizeof(double)))) {
+	perror("malloc");
+	exit(1);
+    }
+    for (i = 0; i < keys; i++) sum += zipf_cdf[i] = 1.0 / pow(i + 1, theta);
+    for (i = 1; i < keys; i++) zipf_cdf[i] += zipf_cdf[i - 1];
+    for (i = 0; i < keys; i++) zipf_cdf[i] /= sum;
+}
+
+/* xorshift64*: fast per-client random numbers.  *seed must not be 0. */
+static unsigned long long next_random(unsigned long long *seed) {
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 2685821657736338717ULL;
+}
+
+/* Pick a key: uniform, or by binary search of the Zipf table */
+static int next_key(unsigned long long *seed) {
+    double u;
+    int lo = 0, hi = keys - 1, mid;
+
+    if (!zipf_cdf) return next_random(seed) % keys;
+    u = (next_random(seed) >> 11) * (1.0 / 9007199254740992.0);
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (zipf_cdf[mid] < u) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo;
+}
+
+/* Write the next command of a client's workload, newline terminated, into
+ * command, which holds len characters.  seed is the client's random state. */
+void next_command(unsigned long long *seed, char *command, int len) {
+    int k = next_key(seed);
+    int op = next_random(seed) % 100;
+
+    if (op < mix[0])
+	snprintf(command, len, "q k%d\n", k);
+    else if (op < mix[0] + mix[1])
+	snprintf(command, len, "a k%d v%d\n", k, k);
+    else
+	snprintf(command, len, "d k%d\n", k);
+}
+
+/* Seconds since some fixed point, as a double */
+double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Count one operation that took ns nanoseconds */
+void hist_record(histogram_t *h, long ns) {
+    int msb, b;
+
+    if (ns < HIST_SUB) {
+	b = ns < 0 ? 0 : ns;
+    } else {
+	msb = 63 - __builtin_clzl(ns);
+	b = (msb - 3) * HIST_SUB + ((ns >> (msb - 4)) & (HIST_SUB - 1));
+    }
+    h->count[b]++;
+    h->total++;
+}
+
+/* Add the counts in from to into */
+void hist_merge(histogram_t *into, histogram_t *from) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) into->count[i] += from->count[i];
+    into->total += from->total;
+}
+
+/* The latency, in nanoseconds, below which fraction p of operations fell:
+ * the lower edge of the bucket holding that operation. */
+double hist_percentile(histogram_t *h, double p) {
+    long want = (long) ceil(p * h->total);
+    long seen = 0;
+    int b, msb;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+	if ((seen += h->count[b]) >= want && seen > 0) break;
+    if (b < HIST_SUB) return b;
+    msb = b / HIST_SUB + 3;
+    return (double)(1L << msb) + (double)(b % HIST_SUB) * (1L << (msb - 4));
+}
+
+/* Print one result row.  The header is
+ *
+ *	name clients ops/s p50 p99 p999 (microseconds)
+ */
+void report(char *name, double elapsed, histogram_t *h) {
+    printf("%-20s %4d %12.0f %9.1f %9.1f %9.1f\n", name, clients,
+	    h->total / elapsed, hist_percentile(h, 0.50) / 1e3,
+	    hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3);
+    fflush(stdout);
+}
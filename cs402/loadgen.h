@@ -0,0 +1,37 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+/*
+ * Workload generation and latency accounting shared by the benchmark drivers:
+ * dbbench (fifo clients of real server binaries) and dbbench_<variant>
+ * (in-process clients of one linked database variant).
+ */
+
+/* Latency histogram: 16 linear sub-buckets per power of two of nanoseconds,
+ * so any percentile is within 1/16 of the true value. */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct Histogram {
+	long count[HIST_BUCKETS];
+	long total;
+} histogram_t;
+
+/* Workload settings, filled in by load_options */
+extern int clients;	/* Concurrent clients */
+extern int ops;		/* Operations per client */
+extern int keys;	/* Size of the key space */
+extern int mix[3];	/* Percent of queries, adds and deletes */
+extern double theta;	/* Zipf skew of key choice; 0 is uniform */
+extern int shards;	/* Shards the database under test is split into */
+extern int cache;	/* Its query cache entries per thread; 0 is none */
+
+int load_options(int, char **, char *);
+void load_init(void);
+void next_command(unsigned long long *, char *, int);
+double now(void);
+
+void hist_record(histogram_t *, long);
+void hist_merge(histogram_t *, histogram_t *);
+double hist_percentile(histogram_t *, double);
+void report(char *, double, histogram_t *);
+#endif
@@ -0,0 +1,452 @@
+#include "db.h"
+#include "wal.h"
+#include "shard.h"
+#include "pin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* Most pins at once, how many of them only the server itself (backups,
+ * replicas) may use, and the number of locks keys are hashed onto */
+#define PIN_MAX 16
+#define PIN_RESERVED 1
+#define KEY_STRIPES 256
+
+/* A key's state when the pin was made, in a skip list ordered by key.  value
+ * is NULL if the key was not in the database.  Nothing is unlinked until the
+ * pin is freed, so a saved_t stays valid as long as the pin does. */
+typedef struct Saved {
+	char *name;
+	char *value;
+	int level;
+	struct Saved *next[];
+} saved_t;
+
+typedef struct Pin {
+	int id;
+	int owner;		/* Client that made it, or 0 for the server */
+	int refs;		/* The pin itself and scans of it; mutex_pins */
+	pthread_mutex_t mutex;	/* Guards the saved list */
+	saved_t *head;		/* Sentinel with MAX_LEVEL levels */
+} pin_t;
+
+/* A thread's count of the changes it has begun and ended: odd while it is
+ * inside pin_change_begin .. pin_change_end. */
+typedef struct Changer {
+	unsigned long seq;
+	int in_use;		/* Owned by a live thread */
+	struct Changer *next;
+} __attribute__((aligned(64))) changer_t;
+
+static pin_t *pins[PIN_MAX];
+static int npins = 0;
+static int last_id = 0;
+static int disabled = 0;	/* Other processes change the database too */
+static __thread int owner = 0;	/* Client this thread is serving */
+static pthread_mutex_t mutex_pins = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t stripes[KEY_STRIPES] = {
+	[0 ... KEY_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Every changer ever created.  Only ever pushed onto; records of threads
+ * that exit are reused. */
+static changer_t *changers = NULL;
+static __thread changer_t *self = NULL;
+static pthread_key_t changer_key;
+static pthread_once_t changer_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: hand the changer back for reuse */
+static void changer_release(void *arg) {
+    __atomic_store_n(&((changer_t *) arg)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void changer_key_create() {
+    pthread_key_create(&changer_key, changer_release);
+}
+
+/* Return the calling thread's changer, claiming a free one or creating one */
+static changer_t *self_changer() {
+    changer_t *c;
+    int free_c;
+
+    if (self) return self;
+    pthread_once(&changer_once, changer_key_create);
+    for (c = __atomic_load_n(&changers, __ATOMIC_ACQUIRE); c; c = c->next) {
+	free_c = 0;
+	if (__atomic_compare_exchange_n(&c->in_use, &free_c, 1, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	    break;
+    }
+    if (!c) {
+	if (posix_memalign((void **) &c, 64, sizeof(changer_t))) {
+	    fprintf(stderr, "pin changer allocation failed, exiting\n");
+	    exit(1);
+	}
+	c->seq = 0;
+	c->in_use = 1;
+	c->next = __atomic_load_n(&changers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&changers, &c->next, c, 0,
+		    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+    pthread_setspecific(changer_key, c);
+    return self = c;
+}
+
+/* Wait until every change that was under way has ended.  A change begun
+ * after a pin was added or removed sees that. */
+static void wait_for_changes() {
+    changer_t *c;
+    unsigned long seq;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (c = __atomic_load_n(&changers, __ATOMIC_ACQUIRE); c; c = c->next)
+	if ((seq = __atomic_load_n(&c->seq, __ATOMIC_SEQ_CST)) & 1)
+	    while (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) == seq)
+		sched_yield();
+}
+
+static int stripe_index(char *name) {
+    unsigned int h = 2166136261u;
+
+    while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h % KEY_STRIPES;
+}
+
+static pthread_mutex_t *stripe(char *name) {
+    return &stripes[stripe_index(name)];
+}
+
+/* Fill set with the distinct stripes of the n keys in names, in increasing
+ * order, and return how many there are */
+static int stripe_set(char **names, int n, int *set) {
+    int i, j, k, m = 0;
+
+    for (i = 0; i < n; i++) {
+	k = stripe_index(names[i]);
+	for (j = m; j > 0 && set[j - 1] > k; j--) ;
+	if (j > 0 && set[j - 1] == k) continue;
+	memmove(&set[j + 1], &set[j], (m - j) * sizeof(int));
+	set[j] = k;
+	m++;
+    }
+    return m;
+}
+
+/* The first saved key not smaller than name, with its predecessor on each
+ * level in preds if that is not NULL.  Caller holds p->mutex. */
+static saved_t *saved_search(pin_t *p, char *name, saved_t **preds) {
+    saved_t *pred = p->head;
+    int i;
+
+    for (i = p->head->level - 1; i >= 0; i--) {
+	while (pred->next[i] && strcmp(pred->next[i]->name, name) < 0)
+	    pred = pred->next[i];
+	if (preds) preds[i] = pred;
+    }
+    return pred->next[0];
+}
+
+/* Save name's state in p unless it already has it.  Caller holds p->mutex. */
+static void saved_add(pin_t *p, char *name, char *value) {
+    saved_t *preds[MAX_LEVEL];
+    saved_t *s;
+    size_t nlen = strlen(name) + 1, vlen = value ? strlen(value) + 1 : 0;
+    int level, i;
+
+    if ((s = saved_search(p, name, preds)) && !strcmp(s->name, name)) return;
+    level = random_level();
+    if (!(s = (saved_t *) malloc(sizeof(saved_t) + level * sizeof(saved_t *) +
+	    nlen + vlen))) {
+	fprintf(stderr, "pin: out of memory saving %s, exiting\n", name);
+	exit(1);
+    }
+    s->name = (char *) &s->next[level];
+    memcpy(s->name, name, nlen);
+    s->value = value ? s->name + nlen : NULL;
+    if (value) memcpy(s->value, value, vlen);
+    s->level = level;
+    for (i = p->head->level; i < level; i++) preds[i] = p->head;
+    if (level > p->head->level) p->head->level = level;
+    for (i = 0; i < level; i++) {
+	s->next[i] = preds[i]->next[i];
+	preds[i]->next[i] = s;
+    }
+}
+
+/* Save name's current state in every pin that does not have it yet.  The
+ * caller holds name's stripe and the write lock hooks for its shard. */
+static void save(char *name) {
+    char value[256];
+    int have = 0;
+    saved_t *s;
+    pin_t *p;
+    int i;
+
+    for (i = 0; i < PIN_MAX; i++) {
+	if (!(p = __atomic_load_n(&pins[i], __ATOMIC_ACQUIRE))) continue;
+	pthread_mutex_lock(&p->mutex);
+	if (!(s = saved_search(p, name, NULL)) || strcmp(s->name, name)) {
+	    if (!have) {
+		memset(value, 0, sizeof(value));
+		query(name, value, sizeof(value));
+		have = 1;
+	    }
+	    saved_add(p, name, strcmp(value, "not found") ? value : NULL);
+	}
+	pthread_mutex_unlock(&p->mutex);
+    }
+}
+
+/* Begin a change to name: lock it if there is a pin or a log, and save its
+ * state for the pins.  Return whether it was locked, for pin_change_end.
+ * The caller holds the write lock hooks for name's shard.
+ *
+ * A change that saw no pin when it began is waited for by pin_create, so it
+ * is part of what the new pin sees. */
+int pin_change_begin(char *name) {
+    changer_t *c = self_changer();
+
+    __atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_SEQ_CST);
+    if (!wal_enabled && !__atomic_load_n(&npins, __ATOMIC_SEQ_CST)) return 0;
+    pthread_mutex_lock(stripe(name));
+    if (__atomic_load_n(&npins, __ATOMIC_ACQUIRE)) save(name);
+    return 1;
+}
+
+void pin_change_end(char *name, int locked) {
+    if (locked) pthread_mutex_unlock(stripe(name));
+    __atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Begin one change to the n distinct keys in names, as pin_change_begin does
+ * for one key.  The stripes are taken in increasing order and each only once,
+ * so changes to several keys cannot deadlock with one another.  The caller
+ * holds the write lock hooks for every shard involved; each key is saved
+ * from its own shard, so the shard the caller is using is changed. */
+int pin_changes_begin(char **names, int n) {
+    changer_t *c = self_changer();
+    int set[KEY_STRIPES];
+    int i, m;
+
+    __atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_SEQ_CST);
+    if (!wal_enabled && !__atomic_load_n(&npins, __ATOMIC_SEQ_CST)) return 0;
+    m = stripe_set(names, n, set);
+    for (i = 0; i < m; i++) pthread_mutex_lock(&stripes[set[i]]);
+    if (__atomic_load_n(&npins, __ATOMIC_ACQUIRE))
+	for (i = 0; i < n; i++) {
+	    db_use(shard_of(names[i]));
+	    save(names[i]);
+	}
+    return 1;
+}
+
+void pin_changes_end(char **names, int n, int locked) {
+    int set[KEY_STRIPES];
+    int i, m;
+
+    if (locked) {
+	m = stripe_set(names, n, set);
+	for (i = m - 1; i >= 0; i--) pthread_mutex_unlock(&stripes[set[i]]);
+    }
+    __atomic_store_n(&self->seq, self->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Refuse every pin from now on.  Keys are saved for a pin by the changes
+ * this process makes, so when other servers share the database (server -m)
+ * a pin would not be a point-in-time view. */
+void pin_disable() {
+    disabled = 1;
+}
+
+/* Pins this thread makes from now on belong to client (0: to the server),
+ * and go when pin_release_client is called for it */
+void pin_owner(int client) {
+    owner = client;
+}
+
+/* Pin the database as it is now.  Return the pin's number, -1 if there are
+ * PIN_MAX pins already (PIN_MAX - PIN_RESERVED for a client's pin), or -2 if
+ * pins have been disabled. */
+int pin_create() {
+    pin_t *p;
+    int i, id, used;
+
+    if (disabled) return -2;
+    if (!(p = (pin_t *) calloc(1, sizeof(pin_t))) ||
+	    !(p->head = (saved_t *) calloc(1, sizeof(saved_t) +
+		MAX_LEVEL * sizeof(saved_t *)))) {
+	free(p);
+	return -1;
+    }
+    p->head->name = "";
+    p->head->level = 1;
+    p->owner = owner;
+    p->refs = 1;
+    pthread_mutex_init(&p->mutex, NULL);
+
+    pthread_mutex_lock(&mutex_pins);
+    for (i = used = 0; i < PIN_MAX; i++)
+	if (pins[i]) used++;
+    for (i = 0; i < PIN_MAX && pins[i]; i++)
+	;
+    if (i == PIN_MAX || (owner && used >= PIN_MAX - PIN_RESERVED)) {
+	pthread_mutex_unlock(&mutex_pins);
+	free(p->head);
+	free(p);
+	return -1;
+    }
+    id = p->id = ++last_id;
+    __atomic_store_n(&pins[i], p, __ATOMIC_RELEASE);
+    __atomic_store_n(&npins, npins + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&mutex_pins);
+
+    /* The pin is as of the end of the changes already under way */
+    wait_for_changes();
+    return id;
+}
+
+/* Find pin id and hold a reference to it, or return NULL */
+static pin_t *pin_get(int id) {
+    pin_t *p = NULL;
+    int i;
+
+    pthread_mutex_lock(&mutex_pins);
+    for (i = 0; i < PIN_MAX; i++)
+	if (pins[i] && pins[i]->id == id) {
+	    p = pins[i];
+	    p->refs++;
+	    break;
+	}
+    pthread_mutex_unlock(&mutex_pins);
+    return p;
+}
+
+/* Drop a reference to p, freeing it and everything it saved with the last */
+static void pin_put(pin_t *p) {
+    saved_t *s, *next;
+    int refs;
+
+    pthread_mutex_lock(&mutex_pins);
+    refs = --p->refs;
+    pthread_mutex_unlock(&mutex_pins);
+    if (refs > 0) return;
+    for (s = p->head; s; s = next) {
+	next = s->next[0];
+	free(s);
+    }
+    pthread_mutex_destroy(&p->mutex);
+    free(p);
+}
+
+/* Release pin id.  Its saved states go once changes that might still be
+ * saving into it, and scans of it, are done.  Return false if there is no
+ * such pin. */
+int pin_release(int id) {
+    pin_t *p = NULL;
+    int i;
+
+    pthread_mutex_lock(&mutex_pins);
+    for (i = 0; i < PIN_MAX; i++)
+	if (pins[i] && pins[i]->id == id) {
+	    p = pins[i];
+	    __atomic_store_n(&pins[i], NULL, __ATOMIC_RELEASE);
+	    __atomic_store_n(&npins, npins - 1, __ATOMIC_SEQ_CST);
+	    break;
+	}
+    pthread_mutex_unlock(&mutex_pins);
+    if (!p) return 0;
+    wait_for_changes();
+    pin_put(p);
+    return 1;
+}
+
+/* Release every pin client made, as when it goes away without U */
+void pin_release_client(int client) {
+    int ids[PIN_MAX];
+    int i, n = 0;
+
+    pthread_mutex_lock(&mutex_pins);
+    for (i = 0; i < PIN_MAX; i++)
+	if (pins[i] && pins[i]->owner == client) ids[n++] = pins[i]->id;
+    pthread_mutex_unlock(&mutex_pins);
+    for (i = 0; i < n; i++)
+	pin_release(ids[i]);
+}
+
+/* A scan of a pin in progress */
+typedef struct PinScan {
+	pin_t *pin;
+	char *from;
+	char *last;		/* Last key passed, or NULL before the first */
+	int (*fn)(char *, char *, void *);
+	void *arg;
+	int stopped;
+} pin_scan_t;
+
+/* Note key as passed */
+static void pass(pin_scan_t *ps, char *key) {
+    free(ps->last);
+    ps->last = strdup(key);
+}
+
+/* Hand fn the saved keys that were in the database when the pin was made,
+ * from the last key passed up to but not including upto (NULL for no limit).
+ * Saved keys that a change removed are not in the live database. */
+static void saved_before(pin_scan_t *ps, char *upto) {
+    saved_t *s;
+
+    while (!ps->stopped) {
+	pthread_mutex_lock(&ps->pin->mutex);
+	s = saved_search(ps->pin, ps->last ? ps->last : ps->from, NULL);
+	if (s && ps->last && !strcmp(s->name, ps->last)) s = s->next[0];
+	pthread_mutex_unlock(&ps->pin->mutex);
+	if (!s || (upto && strcmp(s->name, upto) >= 0)) return;
+	if (s->value && !ps->fn(s->name, s->value, ps->arg)) ps->stopped = 1;
+	pass(ps, s->name);
+    }
+}
+
+/* scan_all callback: a live key, as of the pin if a change has saved it */
+static int pin_merge(char *name, char *value, void *arg) {
+    pin_scan_t *ps = (pin_scan_t *) arg;
+    saved_t *s;
+
+    saved_before(ps, name);
+    if (ps->stopped) return 0;
+    pthread_mutex_lock(&ps->pin->mutex);
+    if ((s = saved_search(ps->pin, name, NULL)) && strcmp(s->name, name)) s = NULL;
+    pthread_mutex_unlock(&ps->pin->mutex);
+    if (s) value = s->value;
+    if (value && !ps->fn(name, value, ps->arg)) ps->stopped = 1;
+    pass(ps, name);
+    return !ps->stopped;
+}
+
+/*
+ * Call fn on every key not smaller than from, in order, with the value it had
+ * when pin id was made, until fn returns false.  The live keys come from
+ * scan_all; any key a change has saved since the pin is taken from the pin
+ * instead, and saved keys that are gone from the live database are merged
+ * in.  A change saves a key before making it, so a live key not saved yet
+ * when it is looked at has not changed since the pin.  Return 1, 0 if there
+ * is no such pin, or -1 if scan_all ran out of memory and keys were missed.
+ */
+int pin_scan(int id, char *from, int (*fn)(char *, char *, void *), void *arg) {
+    pin_scan_t ps;
+
+    if (!(ps.pin = pin_get(id))) return 0;
+    ps.from = from;
+    ps.last = NULL;
+    ps.fn = fn;
+    ps.arg = arg;
+    ps.stopped = 0;
+    if (!scan_all(from, pin_merge, &ps)) ps.stopped = -1;
+    else saved_before(&ps, NULL);
+    free(ps.last);
+    pin_put(ps.pin);
+    return ps.stopped < 0 ? -1 : 1;
+}
@@ -0,0 +1,29 @@
+#ifndef PIN_H
+#define PIN_H
+/*
+ * Pinned, point-in-time views of the database.  Pinning costs nothing up
+ * front: from then on the first change to each key saves the key's old state
+ * (its value, or that it was absent) with the pin, copy-on-write, and a scan
+ * of the pin merges the live database with the saved states.  Clients keep
+ * running throughout.  Releasing the pin frees what it saved.  A pin made
+ * for a client (pin_owner) is released when the client goes, if it has not
+ * released it itself, and clients cannot take the last slots, so backups
+ * and replicas can always pin.
+ *
+ * Every add and delete is bracketed by pin_change_begin and pin_change_end.
+ * While there is a pin or a log (wal.c) the bracket holds a lock for the key,
+ * striped over all keys, so a change, its saving and its log record are
+ * ordered with every other change to the key.  A change to several keys at
+ * once is bracketed by pin_changes_begin and pin_changes_end instead.
+ */
+void pin_disable(void);
+void pin_owner(int);
+int pin_create(void);
+int pin_release(int);
+void pin_release_client(int);
+int pin_scan(int, char *, int (*)(char *, char *, void *), void *);
+int pin_change_begin(char *);
+void pin_change_end(char *, int);
+int pin_changes_begin(char **, int);
+void pin_changes_end(char **, int, int);
+#endif
@@ -0,0 +1,116 @@
+#include "qcache.h"
+#include "db.h"
+#include "shard.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Entries per thread, a power of two; 0 is no cache */
+int qcache_size = 0;
+
+/* One shard's change counts, on a cache line of its own.  No change to the
+ * shard is in progress while they are equal. */
+typedef struct Changes {
+	unsigned long begun;
+	unsigned long ended;
+} __attribute__((aligned(64))) changes_t;
+
+static changes_t changes[MAX_SHARDS];
+
+/* A cached answer to q name, good while the shard's begun count is still
+ * version */
+typedef struct Entry {
+	int used;
+	int shard;
+	unsigned long version;
+	char name[256];
+	char value[256];
+} entry_t;
+
+/* This thread's cache, direct mapped by key hash; allocated on first use */
+static __thread entry_t *cache = NULL;
+
+/* Cache size entries per thread (rounded up to a power of two), or none */
+void qcache_init(int size) {
+    qcache_size = 0;
+    if (size <= 0) return;
+    for (qcache_size = 1; qcache_size < size; qcache_size <<= 1)
+	;
+}
+
+/* This thread's entry for name, or NULL if there is no cache */
+static entry_t *slot(char *name) {
+    if (!cache && !(cache = (entry_t *) calloc(qcache_size, sizeof(entry_t))))
+	return NULL;
+    return &cache[key_hash(name) & (qcache_size - 1)];
+}
+
+/*
+ * Answer q name, for name in shard, from the cache if it can be.  Return
+ * true, with the answer in result, on a hit.  No lock is taken: a hit means
+ * that no change to the shard had begun since the answer was read, and none
+ * was in progress when it was.
+ */
+int qcache_lookup(char *name, int shard, char *result, int len) {
+    changes_t *c = &changes[shard];
+    unsigned long begun;
+    entry_t *e;
+
+    if (!qcache_size || !(e = slot(name))) return 0;
+    begun = __atomic_load_n(&c->begun, __ATOMIC_ACQUIRE);
+    if (e->used && e->shard == shard && e->version == begun &&
+	    __atomic_load_n(&c->ended, __ATOMIC_ACQUIRE) == begun &&
+	    !strcmp(e->name, name)) {
+	snprintf(result, len, "%s", e->value);
+	stats_cache(1);
+	return 1;
+    }
+    stats_cache(0);
+    return 0;
+}
+
+/*
+ * query, caching the answer if no change to the shard was in progress or
+ * began while it was read.  The caller holds the shard's read lock, as for
+ * query, but in the variants whose readers take no lock (rcu, optimistic) a
+ * change can run alongside; the counts catch it.
+ */
+void qcache_query(char *name, int shard, char *result, int len) {
+    changes_t *c = &changes[shard];
+    unsigned long begun;
+    int quiet;
+    entry_t *e;
+
+    if (!qcache_size) {
+	query(name, result, len);
+	return;
+    }
+    begun = __atomic_load_n(&c->begun, __ATOMIC_ACQUIRE);
+    quiet = __atomic_load_n(&c->ended, __ATOMIC_ACQUIRE) == begun;
+    query(name, result, len);
+    /* Order the reads of the index before the second look at the count, so
+     * a change seen by query is seen there too */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!quiet || __atomic_load_n(&c->begun, __ATOMIC_RELAXED) != begun ||
+	    !result[0] || !(e = slot(name)))
+	return;
+    e->used = 1;
+    e->shard = shard;
+    e->version = begun;
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    snprintf(e->value, sizeof(e->value), "%s", result);
+}
+
+/* A change to shard is about to be made.  The increment is a full barrier,
+ * so no reader can see the change without seeing it begun. */
+void qcache_change_begin(int shard) {
+    if (qcache_size)
+	__atomic_fetch_add(&changes[shard].begun, 1, __ATOMIC_SEQ_CST);
+}
+
+/* The change to shard is complete */
+void qcache_change_end(int shard) {
+    if (qcache_size)
+	__atomic_fetch_add(&changes[shard].ended, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,22 @@
+#ifndef QCACHE_H
+#define QCACHE_H
+/*
+ * A small per-thread cache of query answers, for workloads that read a few
+ * hot keys over and over.  Every shard counts the changes made to it: begun
+ * when a change starts and ended when it is over.  An answer is cached with
+ * the count it was read at, and is good for as long as no change to its
+ * shard has begun since, so a hit costs two loads of a shared counter and no
+ * lock or traversal.  Any change to a shard invalidates every cached answer
+ * from it, so the cache pays off for hot keys in read-mostly shards.
+ *
+ * Off unless qcache_init is given a size; then every add and delete must be
+ * bracketed by qcache_change_begin and qcache_change_end.
+ */
+extern int qcache_size;
+
+void qcache_init(int);
+int qcache_lookup(char *, int, char *, int);
+void qcache_query(char *, int, char *, int);
+void qcache_change_begin(int);
+void qcache_change_end(int);
+#endif
@@ -0,0 +1,550 @@
+#include "db.h"
+#include "repl.h"
+#include "wal.h"
+#include "pin.h"
+#include "shard.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Bytes of stream a replica may have waiting before it is cut off */
+#define REPL_BACKLOG (64 * 1024 * 1024)
+/* A sender with nothing to send heartbeats this often */
+#define REPL_HEARTBEAT_MS 100
+/* A replica acknowledges at least every this many records */
+#define REPL_ACK_EVERY 256
+
+typedef struct Buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+} buffer_t;
+
+/* A connected replica, as its primary sees it */
+typedef struct Replica {
+	int fd;
+	int id;
+	unsigned long start;	/* Its snapshot is as of this record */
+	unsigned long sent;	/* Last record written to it */
+	unsigned long acked;	/* Last record it has applied */
+	int streaming;		/* Its snapshot has been sent */
+	int dropped;		/* Too far behind, or gone */
+	buffer_t queue;		/* Stream waiting to be sent */
+	char ack[32];		/* Partial acknowledgement read so far */
+	int nack;
+	pthread_cond_t cond;	/* Signalled when queue grows */
+	struct Replica *next;
+} replica_t;
+
+/* The primary's side.  Everything here is under mutex_repl, which
+ * repl_publish takes inside the log's lock. */
+int repl_publishing = 0;
+static unsigned long repl_seq = 0;	/* Records published */
+static replica_t *replicas = NULL;
+static int nreplicas = 0;
+static int last_id = 0;
+static int serve_fd = -1;
+static pthread_mutex_t mutex_repl = PTHREAD_MUTEX_INITIALIZER;
+
+/* The replica's side: written by the follower thread, read by repl_print */
+enum { FOLLOW_CONNECTING, FOLLOW_SNAPSHOT, FOLLOW_STREAMING };
+static char *follow_path = NULL;
+static int follow_state = FOLLOW_CONNECTING;
+static unsigned long follow_applied = 0;	/* Last record applied */
+static unsigned long follow_primary = 0;	/* Last record heard of */
+static long follow_lag_ns = 0;	/* From publishing to applying, latest record */
+static long follow_keys = 0;	/* Snapshot keys loaded */
+static int follow_syncs = 0;	/* Snapshots loaded */
+/* Odd while the database is being emptied and reloaded, so it is not yet a
+ * whole snapshot; a read that sees the same even value before and after it
+ * ran saw a whole one.  It starts odd: there is no snapshot yet. */
+static unsigned long follow_gen = 1;
+
+/* Make room for need more bytes in b.  Return false if there is none. */
+static int buffer_reserve(buffer_t *b, size_t need) {
+    size_t ncap;
+    char *ndata;
+
+    if (b->len + need <= b->cap) return 1;
+    for (ncap = b->cap ? 2 * b->cap : 65536; ncap < b->len + need; ncap *= 2)
+	;
+    if (!(ndata = (char *) realloc(b->data, ncap))) return 0;
+    b->data = ndata;
+    b->cap = ncap;
+    return 1;
+}
+
+/* Write all of data to fd.  Return false if the other end is gone. */
+static int send_all(int fd, char *data, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = send(fd, data, len, MSG_NOSIGNAL)) == -1) {
+	    if (errno == EINTR) continue;
+	    return 0;
+	}
+	data += n;
+	len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Hand a change record (a line of the log, with its newline) to every
+ * replica.  Called under the log's lock, so records go out in the order they
+ * are logged, which orders every key's changes.  Nothing here waits for a
+ * replica: the record is queued, and a replica whose queue is full is
+ * dropped instead.
+ */
+void repl_publish(char *record, int len) {
+    replica_t *r;
+    char head[64];
+    int n;
+
+    pthread_mutex_lock(&mutex_repl);
+    n = snprintf(head, sizeof(head), "r %lu %ld ", ++repl_seq, stats_now());
+    for (r = replicas; r; r = r->next) {
+	if (r->dropped) continue;
+	if (r->queue.len + n + len > REPL_BACKLOG ||
+		!buffer_reserve(&r->queue, n + len)) {
+	    r->dropped = 1;
+	} else {
+	    memcpy(r->queue.data + r->queue.len, head, n);
+	    memcpy(r->queue.data + r->queue.len + n, record, len);
+	    r->queue.len += n + len;
+	}
+	pthread_cond_signal(&r->cond);
+    }
+    pthread_mutex_unlock(&mutex_repl);
+}
+
+/* Take in whatever acknowledgements r has sent, without waiting.  Return
+ * false if it has hung up. */
+static int read_acks(replica_t *r) {
+    char buf[256];
+    ssize_t n;
+    int i;
+
+    while ((n = recv(r->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	for (i = 0; i < n; i++) {
+	    if (buf[i] != '\n') {
+		if (r->nack < (int) sizeof(r->ack) - 1) r->ack[r->nack++] = buf[i];
+		continue;
+	    }
+	    r->ack[r->nack] = '\0';
+	    pthread_mutex_lock(&mutex_repl);
+	    r->acked = strtoul(r->ack, NULL, 10);
+	    pthread_mutex_unlock(&mutex_repl);
+	    r->nack = 0;
+	}
+    return n != 0;
+}
+
+/* A snapshot being sent, a buffer at a time */
+typedef struct Snapshot {
+	int fd;
+	buffer_t out;
+	int failed;
+} snapshot_t;
+
+/* pin_scan callback: send one key of the snapshot */
+static int send_key(char *name, char *value, void *arg) {
+    snapshot_t *snap = (snapshot_t *) arg;
+    buffer_t *out = &snap->out;
+    size_t need = strlen(name) + strlen(value) + 4;
+
+    if (out->len + need > out->cap) {
+	if (!send_all(snap->fd, out->data, out->len)) {
+	    snap->failed = 1;
+	    return 0;
+	}
+	out->len = 0;
+	if (!buffer_reserve(out, need)) {
+	    snap->failed = 1;
+	    return 0;
+	}
+    }
+    out->len += sprintf(out->data + out->len, "k %s %s\n", name, value);
+    return 1;
+}
+
+/* Send r the pinned view of the database it starts from.  Return false if it
+ * cannot be. */
+static int send_snapshot(replica_t *r) {
+    snapshot_t snap;
+    char line[64];
+    int pin;
+    int ok;
+
+    if ((pin = pin_create()) < 0) {
+	fprintf(stderr, "replica %d: too many pins\n", r->id);
+	return 0;
+    }
+    memset(&snap, 0, sizeof(snap));
+    snap.fd = r->fd;
+    snprintf(line, sizeof(line), "s %lu\n", r->start);
+    ok = buffer_reserve(&snap.out, 65536) && send_all(r->fd, line, strlen(line)) &&
+	    pin_scan(pin, "", send_key, &snap) > 0 && !snap.failed &&
+	    send_all(r->fd, snap.out.data, snap.out.len) && send_all(r->fd, "e\n", 2);
+    pin_release(pin);
+    free(snap.out.data);
+    return ok;
+}
+
+/* Body of a replica's sender thread: its snapshot, then the stream as it
+ * comes, or a heartbeat when nothing comes for REPL_HEARTBEAT_MS */
+static void *replica_run(void *arg) {
+    replica_t *r = (replica_t *) arg;
+    replica_t **p;
+    buffer_t out = { NULL, 0, 0 }, swap;
+    struct timespec when;
+    unsigned long seq;
+    char line[64];
+    int ok;
+
+    ok = send_snapshot(r);
+    pthread_mutex_lock(&mutex_repl);
+    if (!ok) r->dropped = 1;
+    r->sent = r->start;
+    r->streaming = 1;
+    while (!r->dropped) {
+	clock_gettime(CLOCK_REALTIME, &when);
+	when.tv_nsec += REPL_HEARTBEAT_MS * 1000000L;
+	if (when.tv_nsec >= 1000000000L) {
+	    when.tv_sec++;
+	    when.tv_nsec -= 1000000000L;
+	}
+	while (!r->dropped && r->queue.len == 0 &&
+		pthread_cond_timedwait(&r->cond, &mutex_repl, &when) != ETIMEDOUT)
+	    ;
+	if (r->dropped) break;
+	/* The queue holds everything up to repl_seq */
+	swap = r->queue;
+	r->queue = out;
+	r->queue.len = 0;
+	out = swap;
+	seq = repl_seq;
+	pthread_mutex_unlock(&mutex_repl);
+
+	if (out.len == 0) {
+	    snprintf(line, sizeof(line), "h %lu %ld\n", seq, stats_now());
+	    ok = send_all(r->fd, line, strlen(line));
+	} else {
+	    ok = send_all(r->fd, out.data, out.len);
+	}
+	ok = read_acks(r) && ok;
+
+	pthread_mutex_lock(&mutex_repl);
+	if (!ok) r->dropped = 1;
+	r->sent = seq;
+    }
+
+    for (p = &replicas; *p != r; p = &(*p)->next)
+	;
+    *p = r->next;
+    nreplicas--;
+    pthread_mutex_unlock(&mutex_repl);
+    fprintf(stderr, "replica %d disconnected\n", r->id);
+    close(r->fd);
+    pthread_cond_destroy(&r->cond);
+    free(r->queue.data);
+    free(out.data);
+    free(r);
+    return NULL;
+}
+
+/* Body of the thread that accepts replicas.  A replica's snapshot is as of
+ * the record published last before it is registered: every later record is
+ * queued for it, and its pin is only made after. */
+static void *serve_run(void *arg) {
+    replica_t *r;
+    pthread_t thread;
+    int fd, id;
+
+    for (;;) {
+	if ((fd = accept(serve_fd, NULL, NULL)) == -1) {
+	    if (errno != EINTR) perror("replica accept");
+	    continue;
+	}
+	if (!(r = (replica_t *) calloc(1, sizeof(replica_t)))) {
+	    close(fd);
+	    continue;
+	}
+	r->fd = fd;
+	pthread_cond_init(&r->cond, NULL);
+	pthread_mutex_lock(&mutex_repl);
+	r->id = id = ++last_id;
+	r->start = r->sent = r->acked = repl_seq;
+	r->next = replicas;
+	replicas = r;
+	nreplicas++;
+	pthread_mutex_unlock(&mutex_repl);
+	/* Once started, replica_run may free r at any time */
+	if (pthread_create(&thread, NULL, replica_run, r) == 0) {
+	    pthread_detach(thread);
+	    fprintf(stderr, "replica %d connected\n", id);
+	} else {
+	    /* replica_run would have unlinked it */
+	    pthread_mutex_lock(&mutex_repl);
+	    replicas = r->next;
+	    nreplicas--;
+	    pthread_mutex_unlock(&mutex_repl);
+	    close(fd);
+	    free(r);
+	}
+    }
+    return NULL;
+}
+
+/* Put a Unix domain socket address for path in addr.  False if too long. */
+static int socket_address(char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+	fprintf(stderr, "%s: socket path too long\n", path);
+	return 0;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+/* Publish changes to replicas that connect at path.  Call before any client
+ * runs.  Return false if the socket cannot be made. */
+int repl_serve(char *path) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (!socket_address(path, &addr)) return 0;
+    unlink(path);
+    if ((serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+	    bind(serve_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(serve_fd, 16) == -1) {
+	perror(path);
+	return 0;
+    }
+    /* Every change is recorded from now on, under its key's lock */
+    repl_publishing = 1;
+    wal_enabled = 1;
+    if (pthread_create(&thread, NULL, serve_run, NULL)) {
+	perror("replication");
+	return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+/* Keys of the database being emptied, a chunk at a time */
+#define CLEAR_CHUNK 1024
+
+typedef struct Clearing {
+	char *names[CLEAR_CHUNK];
+	int n;
+} clearing_t;
+
+/* scan_all callback: collect a chunk of keys to delete */
+static int collect_key(char *name, char *value, void *arg) {
+    clearing_t *c = (clearing_t *) arg;
+
+    if (c->n == CLEAR_CHUNK || !(c->names[c->n] = strdup(name))) return 0;
+    c->n++;
+    return 1;
+}
+
+/* Empty the database, for a new snapshot.  A scan that runs out of memory
+ * may have missed keys, so the database is gone over until one finds none. */
+static void clear_database() {
+    clearing_t c;
+    char command[300];
+    char response[256];
+    int complete;
+    int i;
+
+    do {
+	c.n = 0;
+	if (!(complete = scan_all("", collect_key, &c)) && c.n == 0) sleep(1);
+	for (i = 0; i < c.n; i++) {
+	    snprintf(command, sizeof(command), "d %s", c.names[i]);
+	    interpret_command(command, response, sizeof(response));
+	    free(c.names[i]);
+	}
+    } while (c.n > 0 || !complete);
+}
+
+/* Tell the primary how far we are */
+static void send_ack(int fd) {
+    char line[32];
+
+    snprintf(line, sizeof(line), "%lu\n", follow_applied);
+    send_all(fd, line, strlen(line));
+}
+
+/* Apply one line of the stream */
+static void follow_line(int fd, char *line) {
+    char response[256];
+    unsigned long seq;
+    long ns;
+    int n = 0;
+
+    switch (line[0]) {
+    case 's':
+	/* Whatever an earlier stream left is replaced, and reads are refused
+	 * until it has been */
+	__atomic_store_n(&follow_state, FOLLOW_SNAPSHOT, __ATOMIC_RELAXED);
+	if (!(follow_gen & 1))
+	    __atomic_add_fetch(&follow_gen, 1, __ATOMIC_SEQ_CST);
+	clear_database();
+	__atomic_store_n(&follow_keys, 0, __ATOMIC_RELAXED);
+	seq = strtoul(&line[1], NULL, 10);
+	__atomic_store_n(&follow_applied, seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&follow_primary, seq, __ATOMIC_RELAXED);
+	return;
+    case 'k':
+	/* A key of the snapshot is added like any other */
+	line[0] = 'a';
+	interpret_command(line, response, sizeof(response));
+	__atomic_add_fetch(&follow_keys, 1, __ATOMIC_RELAXED);
+	return;
+    case 'e':
+	__atomic_add_fetch(&follow_gen, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&follow_syncs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&follow_state, FOLLOW_STREAMING, __ATOMIC_RELAXED);
+	send_ack(fd);
+	return;
+    case 'r':
+	if (sscanf(&line[1], "%lu %ld %n", &seq, &ns, &n) < 2 || n == 0) return;
+	interpret_command(&line[1 + n], response, sizeof(response));
+	__atomic_store_n(&follow_applied, seq, __ATOMIC_RELAXED);
+	if (seq > follow_primary)
+	    __atomic_store_n(&follow_primary, seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&follow_lag_ns, stats_now() - ns, __ATOMIC_RELAXED);
+	if (seq % REPL_ACK_EVERY == 0) send_ack(fd);
+	return;
+    case 'h':
+	if (sscanf(&line[1], "%lu %ld", &seq, &ns) < 2) return;
+	__atomic_store_n(&follow_primary, seq, __ATOMIC_RELAXED);
+	if (follow_applied == seq)
+	    __atomic_store_n(&follow_lag_ns, 0, __ATOMIC_RELAXED);
+	send_ack(fd);
+	return;
+    }
+}
+
+/* Body of a replica's follower thread: connect to the primary, load its
+ * snapshot and apply its stream, and do it all again if the stream ends */
+static void *follow_run(void *arg) {
+    struct sockaddr_un addr;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    FILE *in;
+    int fd;
+
+    socket_address(follow_path, &addr);
+    for (;;) {
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+		connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+		!(in = fdopen(fd, "r"))) {
+	    if (fd != -1) close(fd);
+	    sleep(1);
+	    continue;
+	}
+	while ((n = getline(&line, &cap, in)) > 0 && line[n - 1] == '\n') {
+	    line[n - 1] = '\0';
+	    follow_line(fd, line);
+	}
+	fclose(in);
+	__atomic_store_n(&follow_state, FOLLOW_CONNECTING, __ATOMIC_RELAXED);
+	fprintf(stderr, "replica: lost %s, catching up again\n", follow_path);
+	sleep(1);
+    }
+    free(line);
+    return NULL;
+}
+
+/* Follow the primary serving replicas at path.  Call before any client
+ * runs.  Return false if the follower cannot be started. */
+int repl_follow(char *path) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (!socket_address(path, &addr)) return 0;
+    follow_path = path;
+    if (pthread_create(&thread, NULL, follow_run, NULL)) {
+	perror("replica");
+	return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+/* True if this is a replica and command could change its database, which
+ * only its primary's stream may.  A batch is checked command by command. */
+int repl_read_only(char *command) {
+    char *c = command[0] == 'b' ? command + 1 : command;
+
+    if (!follow_path) return 0;
+    for (;;) {
+	while (*c == ' ' || *c == '\t') c++;
+	if (*c && strchr(c == command ? "aducfF" : "aducfFb", *c)) return 1;
+	if (c[0] == 'm' && (c[1] == 'a' || c[1] == 'd')) return 1;
+	if (command[0] != 'b' || !(c = strchr(c, ';'))) return 0;
+	c++;
+    }
+}
+
+/* Begin a client's command.  Return false if this is a replica that has no
+ * whole snapshot to answer from, as while it reloads one after falling
+ * behind; otherwise fill in *gen for repl_read_end. */
+int repl_read_begin(unsigned long *gen) {
+    *gen = follow_path ? __atomic_load_n(&follow_gen, __ATOMIC_SEQ_CST) : 0;
+    return !(*gen & 1);
+}
+
+/* End a command begun with repl_read_begin.  Return false if a reload began
+ * meanwhile, so its response may be wrong. */
+int repl_read_end(unsigned long gen) {
+    if (!follow_path) return 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&follow_gen, __ATOMIC_SEQ_CST) == gen;
+}
+
+/* The replication console command: the replicas a primary has and how far
+ * behind each is, and a replica's progress */
+void repl_print(FILE *out) {
+    replica_t *r;
+    static char *states[] = { "connecting", "loading snapshot", "streaming" };
+    unsigned long applied, primary;
+
+    if (repl_publishing) {
+	pthread_mutex_lock(&mutex_repl);
+	fprintf(out, "primary: %lu records published, %d replicas\n", repl_seq,
+		nreplicas);
+	for (r = replicas; r; r = r->next)
+	    fprintf(out, "  replica %d: %s, sent %lu, applied %lu, %lu records "
+		    "behind, %zu bytes queued\n", r->id,
+		    r->dropped ? "dropped" : r->streaming ? "streaming" :
+		    "sending snapshot", r->sent, r->acked, repl_seq - r->acked,
+		    r->queue.len);
+	pthread_mutex_unlock(&mutex_repl);
+    }
+    if (follow_path) {
+	applied = __atomic_load_n(&follow_applied, __ATOMIC_RELAXED);
+	primary = __atomic_load_n(&follow_primary, __ATOMIC_RELAXED);
+	fprintf(out, "replica of %s: %s, %ld snapshot keys, %d snapshots\n"
+		"  applied %lu of %lu, %lu records and %.1f ms behind\n",
+		follow_path, states[__atomic_load_n(&follow_state, __ATOMIC_RELAXED)],
+		__atomic_load_n(&follow_keys, __ATOMIC_RELAXED),
+		__atomic_load_n(&follow_syncs, __ATOMIC_RELAXED), applied, primary,
+		primary > applied ? primary - applied : 0,
+		__atomic_load_n(&follow_lag_ns, __ATOMIC_RELAXED) / 1e6);
+    }
+    if (!repl_publishing && !follow_path)
+	fprintf(out, "replication: off\n");
+}
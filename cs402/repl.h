@@ -0,0 +1,43 @@
+#ifndef REPL_H
+#define REPL_H
+#include <stdio.h>
+
+/*
+ * Read replicas.  A primary (server -R socket) publishes every change it
+ * makes, in the order its log would have it (wal.c hands each record over
+ * under the log's own lock), to the replica processes connected to a Unix
+ * domain socket.  A replica (server -F socket) applies the stream to its own
+ * database and serves reads from it; changes from its clients are refused.
+ *
+ * A replica that connects is first sent a snapshot: the keys of a pinned view
+ * (pin.c) of the primary, then the changes made since the view, some of
+ * which it may hold already, which is harmless because the stream's records
+ * only succeed in the state they were made in.  A replica that falls more
+ * than REPL_BACKLOG bytes behind is cut off; it reconnects, starts over from
+ * an empty database and catches up from a new snapshot.  Until a snapshot is
+ * whole its clients are answered "replica loading snapshot" rather than from
+ * a partial database (repl_read_begin, repl_read_end).
+ *
+ * The stream is text, a line per message:
+ *
+ *	s seq			a snapshot as of record seq follows
+ *	k name value		a key of the snapshot
+ *	e			the snapshot is over
+ *	r seq ns command	record seq, published at stats_now() ns
+ *	h seq ns		heartbeat: the primary is at record seq
+ *
+ * and the replica answers with the last record it applied, "seq\n", so both
+ * ends can report how far behind it is.  stats_now is CLOCK_MONOTONIC, which
+ * every process on the box shares, so lag in time is only meaningful for
+ * local replicas.
+ */
+extern int repl_publishing;
+
+int repl_serve(char *);
+void repl_publish(char *, int);
+int repl_follow(char *);
+int repl_read_only(char *);
+int repl_read_begin(unsigned long *);
+int repl_read_end(unsigned long);
+void repl_print(FILE *);
+#endif
@@ -1,3 +1,5 @@
+/* accept4 */
+#define _GNU_SOURCE
 #include <assert.h>
 /* FreeBSD */
 #define _WITH_GETLINE
@@ -12,18 +14,37 @@
 #include "window.h"
 #include "db.h"
 #include "words.h"
+#include "wal.h"
+#include "stats.h"
+#include "shard.h"
+#include "pin.h"
+#include "snapshot.h"
+#include "qcache.h"
+#include "trace.h"
+#include "repl.h"
 #include <pthread.h>
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-/* the encapsulation of a client thread, i.e., the thread that handles
- * commands from clients */
+/* the encapsulation of a client, i.e., a source of commands.  Clients have no
+ * thread of their own: a pool of worker threads waits for input on any of
+ * them (see worker_run) and serves whatever has arrived. */
 typedef struct Client {
-	pthread_t thread;
 	window_t *win;
-	bool delete; //Flag to tell server to delete, only gets written by client while locked out of server reading it, or during intilization
+	bool pollable;		/* Input is a fifo epoll can watch, not a plain file */
+	struct Client *next_ready; /* Link in the ready list, for plain files */
+	int unsent;		/* Bytes of responses its output has not taken yet */
+	bool out_watched;	/* A fifo's output is registered with epfd too */
+	bool eof;		/* Input has ended; retire once unsent is 0 */
+	int id;			/* Names the client in traces */
+	char response[4096];	/* Result of the command being served */
 } client_t;
 
 typedef enum INPUT_STATE { //enum for different states of the server
@@ -31,18 +52,28 @@ typedef enum INPUT_STATE { //enum for different states of the server
 	WAITING_FOR_TERMINATIONS,
 	TERMINATED
 	} INPUT_STATE;
-	
-typedef struct NodeLinked { //Linkedlist for keeping track of clients
-	struct NodeLinked *next;
-	client_t* self;
-} node_l;
 
-/* initilize linked list */
-node_l* ll_head = NULL;
+/* Workers wait on epfd for any client with input.  Plain files cannot be
+ * watched by epoll (they are always readable), so those clients wait their
+ * turn on a ready list instead and each entry on it is counted by evfd, which
+ * epfd watches too. */
+int epfd = -1;
+int evfd = -1;
+client_t *ready_head = NULL;
+client_t *ready_tail = NULL;
+pthread_mutex_t mutex_ready = PTHREAD_MUTEX_INITIALIZER;
+
+/* The Unix domain socket machine clients connect to, if any.  Its epoll
+ * entry carries &listener, which is neither NULL nor a client. */
+int listen_fd = -1;
+char *socket_path = NULL;
+static char listener;
 
-/*variable and mutex for knowing how many items to delete from linked list*/
-int to_delete = 0; // Global variable that is always write locked
-pthread_mutex_t mutex_to_delete = PTHREAD_MUTEX_INITIALIZER;
+/* Number of clients not yet torn down, and a condition the console waits on
+ * until it is 0 */
+int nclients = 0;
+pthread_mutex_t mutex_clients = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond_no_clients = PTHREAD_COND_INITIALIZER;
 
 /*Mutex and condition for pausing all and going*/
 pthread_mutex_t mutex_waiting = PTHREAD_MUTEX_INITIALIZER;
@@ -50,21 +81,83 @@ pthread_cond_t cond_all_wait = PTHREAD_COND_INITIALIZER;
 bool wait_all = false;
 
 int started = 0;	  /* Number of clients started, just for naming purposes */
+int next_id = 0;	/* Last client id handed out, for traces */
 
-/* Interface with a client: get requests, carry them out and report results */
-void *client_run(void *);
+/* Serve the input a client has waiting */
+void client_run(client_t *);
 /* Interface to the db routines.  Pass a command, get a result */
 int handle_command(char *, char *, int len);
 
-/* 
- * add an item to a linked list
- */
-void push(client_t* self) {
-node_l *this = (node_l *) malloc(sizeof(node_l));
-this->self = self;
-this->next = ll_head;
-ll_head = this;
- }
+/* Put a plain file client at the end of the ready list and wake a worker */
+static void ready_push(client_t *client) {
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&mutex_ready);
+	client->next_ready = NULL;
+	if (ready_tail) ready_tail->next_ready = client;
+	else ready_head = client;
+	ready_tail = client;
+	pthread_mutex_unlock(&mutex_ready);
+	if (write(evfd, &one, sizeof(one)) == -1)
+		perror("eventfd write");
+}
+
+/* Take the first client off the ready list, or NULL if it is empty */
+static client_t *ready_pop() {
+	client_t *client;
+
+	pthread_mutex_lock(&mutex_ready);
+	if ((client = ready_head) && !(ready_head = client->next_ready))
+		ready_tail = NULL;
+	pthread_mutex_unlock(&mutex_ready);
+	return client;
+}
+
+/* Ask for the client to be served again when it has more input, or, if it
+ * has responses waiting, when its output can take them.  A window's fifo
+ * output is a descriptor of its own, registered the first time it is
+ * needed, even for a plain file client.  Only one worker at a time ever has
+ * a client: epoll reports it once (EPOLLONESHOT) per arming, only one of its
+ * descriptors is armed at once, and the ready list holds it at most once. */
+static void client_arm(client_t *client, int op) {
+	struct epoll_event ev;
+	int fd = window_fd(client->win);
+
+	if (client->unsent && window_out_fd(client->win) != fd) {
+		fd = window_out_fd(client->win);
+		op = client->out_watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		client->out_watched = true;
+	} else if (!client->pollable) {
+		ready_push(client);
+		return;
+	}
+	ev.events = (client->unsent ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	ev.data.ptr = client;
+	if (epoll_ctl(epfd, op, fd, &ev) == -1) {
+		if (op == EPOLL_CTL_ADD && errno == EPERM) {
+			/* A plain file */
+			client->pollable = false;
+			ready_push(client);
+		}
+		else
+			perror("epoll_ctl");
+	}
+}
+
+/* Count a new client and hand it to the workers */
+static client_t *client_start(client_t *client) {
+	pthread_mutex_lock(&mutex_clients);
+	nclients++;
+	pthread_mutex_unlock(&mutex_clients);
+	client->pollable = true;
+	client->unsent = 0;
+	client->out_watched = false;
+	client->eof = false;
+	client->response[0] = '\0';
+	client->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	client_arm(client, EPOLL_CTL_ADD);
+	return client;
+}
 
 /*
  * Create an interactive client - one with its own window.  This routine
@@ -80,27 +173,13 @@ client_t *client_create(int ID) {
     if (!new_Client) return NULL;
 
     sprintf(title, "Client %d", ID);
-	new_Client->delete = false;
-	
-
 
     /* Creates a window and set up a communication channel with it */
     if (!(new_Client->win = window_create(title))) { //If I don't get anything
 		free(new_Client);
 		return NULL;
     }
-	
-	/*Create thread*/
-	pthread_t thread;
-	new_Client->thread = thread;
-	if (!pthread_create(&thread, NULL, client_run, new_Client)) {
-		pthread_detach(thread);
-		return new_Client;
-	}
-	else { //there were errors
-		free(new_Client);
-		return NULL;
-    }
+	return client_start(new_Client);
 }
 
 /*
@@ -114,25 +193,31 @@ client_t *client_create_no_window(char *in, char *out) {
     client_t *new_Client = (client_t *) malloc(sizeof(client_t));
     if (!new_Client) return NULL;
 
-	new_Client->delete = false;
-	
 	/* Creates a window and set up a communication channel with it */
     if (!(new_Client->win = nowindow_create(in, outf))) { //If I don't get anything
 		free(new_Client);
 		return NULL;
     }
-	
-	/*Create thread*/
-	pthread_t thread;
-	new_Client->thread = thread;
-	if (!pthread_create(&thread, NULL, client_run, new_Client)) {
-		pthread_detach(thread);
-		return new_Client;
-	}
-	else { //there were errors
+	return client_start(new_Client);
+}
+
+/*
+ * Create a client for a connection accepted on the server's socket.  It
+ * speaks the binary framed protocol (see socket_window_create).  On error a
+ * NULL pointer is returned and fd is closed.
+ */
+client_t *client_create_socket(int fd) {
+    client_t *new_Client = (client_t *) malloc(sizeof(client_t));
+    if (!new_Client) {
+		close(fd);
+		return NULL;
+    }
+
+    if (!(new_Client->win = socket_window_create(fd))) {
 		free(new_Client);
 		return NULL;
     }
+	return client_start(new_Client);
 }
 
 /*
@@ -147,42 +232,220 @@ void client_destroy(client_t *client) {
 	free(client);
 }
 
-/* Code executed by the client */
-void *client_run(void *arg)
+/* A client's input has ended: tear it down and, if it was the last one, wake
+ * the console if it is waiting for that */
+static void client_retire(client_t *client) {
+	if (client->pollable)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, window_fd(client->win), NULL);
+	if (client->out_watched)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, window_out_fd(client->win), NULL);
+	/* Pins it never released would otherwise hold their slots for good */
+	pin_release_client(client->id);
+	client_destroy(client);
+	pthread_mutex_lock(&mutex_clients);
+	if (--nclients == 0)
+		pthread_cond_broadcast(&cond_no_clients);
+	pthread_mutex_unlock(&mutex_clients);
+}
+
+/* Code executed for a client when it has input: read what is there, carry out
+ * every complete command in it and send back all the results at once. */
+void client_run(client_t *client)
 {
-	client_t *client = (client_t *) arg;
-	
-	/* main loop of the client: fetch commands from window, interpret
-	 * and handle them, return results to window. */
-	char *command = 0;
-	size_t clen = 0;
-	/* response must be empty for the first call to serve */
-	char response[256] = { 0 };
+	char *command;
+	long start = 0;
+	int n;
+	bool eof;
+
+	/* Responses the socket would not take last time go first, and no more
+	 * input is read until they are gone, so a client that does not read
+	 * cannot tie up a worker or make the server buffer without limit. */
+	if (client->unsent && (client->unsent = window_flush(client->win))) {
+		client_arm(client, EPOLL_CTL_MOD);
+		return;
+	}
+	if (client->eof) {
+		client_retire(client);
+		return;
+	}
+
+	if ((n = window_read(client->win)) == -1 &&
+			(errno == EAGAIN || errno == EINTR)) {
+		/* Nothing there after all */
+		client_arm(client, EPOLL_CTL_MOD);
+		return;
+	}
+	eof = n <= 0;
 
-	/* Serve until the other side closes the pipe */
-	while (serve(client->win, response, &command, &clen) != -1) {
-	pthread_mutex_lock(&mutex_waiting);
-		if (wait_all) {
-			pthread_cond_wait(&cond_all_wait, &mutex_waiting);
+	pin_owner(client->id);
+	while ((command = window_next_command(client->win, eof))) {
+		/* Hold commands while the console has the clients stopped */
+		if (__atomic_load_n(&wait_all, __ATOMIC_ACQUIRE)) {
+			window_flush(client->win);
+			pthread_mutex_lock(&mutex_waiting);
+			while (wait_all)
+				pthread_cond_wait(&cond_all_wait, &mutex_waiting);
+			pthread_mutex_unlock(&mutex_waiting);
 		}
-		pthread_mutex_unlock(&mutex_waiting);
-	    handle_command(command, response, sizeof(response));
+		if (trace_on()) start = stats_now();
+	    handle_command(command, client->response, sizeof(client->response));
+		if (trace_on())
+			trace_command(client->id, start, command, client->response);
+		window_respond(client->win, command, client->response);
 	}
-	//Code to tell server to delete me
-	pthread_mutex_lock(&mutex_to_delete);
-	client->delete = true;
-	to_delete++;
-	pthread_mutex_unlock(&mutex_to_delete);
-	puts("Press enter to close any extra windows & threads");
-	return 0;
+	/* A client that sends an oversized frame is out of step or hostile:
+	 * answer what came before it, then drop the connection */
+	if (client->win->bad)
+		eof = true;
+	pin_owner(0);
+	client->unsent = window_flush(client->win);
+	client->eof = eof;
+
+	if (eof && !client->unsent)
+		client_retire(client);
+	else
+		client_arm(client, EPOLL_CTL_MOD);
+}
+
+/* The listening socket is readable: accept every connection waiting, then
+ * ask for the next ones */
+static void accept_clients() {
+	struct epoll_event ev;
+	int fd;
+
+	while ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1 ||
+			errno == EINTR)
+		if (fd != -1)
+			client_create_socket(fd);
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept");
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = &listener;
+	/* Fails harmlessly once the console has stopped listening */
+	epoll_ctl(epfd, EPOLL_CTL_MOD, listen_fd, &ev);
+}
+
+/* Listen for machine clients on a Unix domain socket at path.  Return false
+ * if that cannot be done. */
+static bool listen_start(char *path) {
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+			bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+			listen(listen_fd, 128) == -1) {
+		perror(path);
+		return false;
+	}
+	socket_path = path;
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = &listener;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return false;
+	}
+	return true;
+}
+
+/* Accept no more connections and remove the socket */
+static void listen_stop() {
+	if (listen_fd == -1) return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+	unlink(socket_path);
+}
+
+/* Body of a worker thread: wait for a client with input and serve it.  A
+ * worker only ever blocks in epoll_wait or on the console's stop. */
+void *worker_run(void *arg)
+{
+	struct epoll_event ev;
+	uint64_t count;
+	client_t *client;
+
+	for (;;) {
+		if (epoll_wait(epfd, &ev, 1, -1) != 1)
+			continue;
+		if (ev.data.ptr == &listener) {
+			accept_clients();
+			continue;
+		}
+		if ((client = (client_t *) ev.data.ptr)) {
+			client_run(client);
+			continue;
+		}
+		/* evfd: take one ready list entry, if another worker did not */
+		if (read(evfd, &count, sizeof(count)) == sizeof(count) &&
+				(client = ready_pop()))
+			client_run(client);
+	}
+	return NULL;
+}
+
+/* Start one worker per processor.  Return false if none could be started. */
+static bool workers_start() {
+	struct epoll_event ev;
+	pthread_t thread;
+	long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	long i, started_workers = 0;
+
+	if ((epfd = epoll_create1(0)) == -1 ||
+			(evfd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK)) == -1) {
+		perror("epoll/eventfd");
+		return false;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev) == -1) {
+		perror("epoll_ctl");
+		return false;
+	}
+	if (nworkers < 1) nworkers = 1;
+	for (i = 0; i < nworkers; i++)
+		if (!pthread_create(&thread, NULL, worker_run, NULL)) {
+			pthread_detach(thread);
+			started_workers++;
+		}
+	return started_workers > 0;
+}
+
+/* Block until every client has been torn down */
+static void wait_for_clients() {
+	pthread_mutex_lock(&mutex_clients);
+	while (nclients > 0)
+		pthread_cond_wait(&cond_no_clients, &mutex_clients);
+	pthread_mutex_unlock(&mutex_clients);
 }
 
 int handle_command(char *command, char *response, int len) {
+    unsigned long gen;
+    long start;
+
     if (command[0] == EOF) {
 	strncpy(response, "all done", len - 1);
 	return 0;
     }
+    if (repl_read_only(command)) {
+	strncpy(response, "read-only replica", len - 1);
+	return 1;
+    }
+    if (!repl_read_begin(&gen)) {
+	strncpy(response, "replica loading snapshot", len - 1);
+	return 1;
+    }
+    start = stats_now();
     interpret_command(command, response, len);
+    stats_command(command, stats_now() - start);
+    if (!repl_read_end(gen)) {
+	strncpy(response, "replica loading snapshot", len - 1);
+    }
     return 1;
 }
 
@@ -211,7 +474,6 @@ INPUT_STATE handle_input() {
 				if ((c = client_create(started++)))
 				{
 					printf("Just created a windowed client\n");
-					push(c);
 				}
 			}
 			else if (!strcmp(words[i],"E")) {
@@ -219,7 +481,6 @@ INPUT_STATE handle_input() {
 				if ((c = client_create_no_window(words[i+1], words[i+2])))
 				{
 					printf("Just created a nonwindowed client\n");
-					push(c);
 				}
 				if (words[i+1] != NULL&&words[i+2] != NULL)
 					i+=2;
@@ -239,6 +500,47 @@ INPUT_STATE handle_input() {
 				}
 				pthread_mutex_unlock(&mutex_waiting);
 			}
+			else if (!strcmp(words[i], "backup") && words[i + 1]) {
+				/* An exact snapshot file of the database as of
+				 * now, written while clients carry on */
+				int pin = pin_create();
+
+				if (pin == -2)
+					printf("backup: not on a shared database\n");
+				else if (pin < 0)
+					printf("backup: too many pins\n");
+				else {
+					printf("backup %s %s\n", words[i + 1],
+						snapshot_write(words[i + 1], 0, pin) ?
+						"written" : "failed");
+					pin_release(pin);
+				}
+				i++;
+			}
+			else if (!strcmp(words[i], "trace") && words[i + 1]) {
+				/* trace file starts logging every client
+				 * command for dbreplay; trace off ends it */
+				long n;
+
+				if (strcmp(words[i + 1], "off"))
+					printf(trace_start(words[i + 1]) ?
+						"tracing to %s\n" :
+						"trace: cannot trace to %s\n",
+						words[i + 1]);
+				else if ((n = trace_stop()) < 0)
+					printf("trace: not tracing\n");
+				else
+					printf("trace written, %ld commands\n", n);
+				i++;
+			}
+			else if (!strcmp(words[i], "stats")) {
+				/* Counters merged from every thread */
+				stats_print(stdout);
+			}
+			else if (!strcmp(words[i], "repl")) {
+				/* Replicas and how far behind they are */
+				repl_print(stdout);
+			}
 			else if (!strcmp(words[i], "w")) {
 				pthread_mutex_lock(&mutex_waiting);
 				if (wait_all) {
@@ -260,67 +562,110 @@ INPUT_STATE handle_input() {
 int main(int argc, char *argv[]) {
     //client_t *c = NULL;	    /* A client to serve */
 	INPUT_STATE my_state = RUNNING;
+	char *datadir = NULL;	/* Where the database is made durable, if anywhere */
+	int interval = 60;	/* Seconds between snapshots */
+	int shards = 1;		/* Independent parts of the keyspace */
+	int cache = 0;		/* Query cache entries per thread */
+	char *trace = NULL;	/* Trace every command to this file */
+	char *segment = NULL;	/* Shared memory database, with other servers */
+	char *replicas = NULL;	/* Publish changes to replicas here */
+	char *primary = NULL;	/* Be a replica of the primary here */
+	int want;
+	int opt;
 
-    if (argc != 1) {
-	fprintf(stderr, "Usage: server\n");
+	while ((opt = getopt(argc, argv, "d:s:u:S:C:t:m:R:F:")) != -1) {
+		switch (opt) {
+			case 'd': datadir = optarg; break;
+			case 'u': socket_path = optarg; break;
+			case 's': interval = atoi(optarg); break;
+			case 'S': shards = atoi(optarg); break;
+			case 'C': cache = atoi(optarg); break;
+			case 't': trace = optarg; break;
+			case 'm': segment = optarg; break;
+			case 'R': replicas = optarg; break;
+			case 'F': primary = optarg; break;
+			default: goto usage;
+		}
+	}
+	/* A shared database has no one process that sees every change, as its
+	 * log, its query cache, its replicas and its pins (disabled below)
+	 * would need to.  A replica's database is its primary's, changed only
+	 * by the primary's stream, so it keeps no log and shares no segment */
+    if (optind != argc || shards < 1 || shards > MAX_SHARDS || cache < 0 ||
+	    (segment && (datadir || cache || replicas)) ||
+	    (primary && (datadir || segment))) {
+usage:
+	fprintf(stderr, "Usage: server [-d datadir [-s snapshot seconds]] [-u socket]\n"
+		"\t[-S shards, at most %d] [-C query cache entries per thread]\n"
+		"\t[-t trace file] [-m shared database file, without -d, -C and -R;\n"
+		"\tno pins or backups; if a server dies holding one of its locks the\n"
+		"\tothers exit or wait, so restart them all]\n"
+		"\t[-R socket to serve replicas on] [-F primary's replica socket,\n"
+		"\twithout -d and -m]\n",
+		MAX_SHARDS);
 	exit(1);
     }
 
-	/*This inifnite for loop is a scheduler, each else if statement represents a state
-	* that the software can be in, if there is nothing to handle then it sleeps to 
-	* give up context and tries again. This ensures the highest priority items happen first
-	*/
-	for (;;) { //Scheduler
-		if (to_delete) // If there is a thread to cleanup
-		{ //Iterate though a linked list looking for items to delete if their delete == true
-			node_l** prev_ref = &ll_head;
-			node_l* current = ll_head;
-			pthread_mutex_lock(&mutex_to_delete);
-			while (to_delete>0 && current)
-			{
-				if (current->self->delete)
-				{
-					*prev_ref = current->next;
-					//No need to join here, since this deletes the thread and its memory
-					client_destroy(current->self);
-					to_delete--;
-					current = *prev_ref;
-				}
-				else 
-				{
-					prev_ref = &current->next;
-					current = current->next;
-				}
-			}
-			//This is an error state
-			if (current == NULL && to_delete>0) {
-				to_delete = 0;
-				puts("Error! to_delete was not 0 when trying to delete objects, indicates race condition");
-			}
-			pthread_mutex_unlock(&mutex_to_delete);
-		}
-		else if (my_state==WAITING_FOR_TERMINATIONS) //If The state is to not accept new input till everything termiantes
-		{
-			if (!ll_head) // If all threads are terminated
-				my_state = RUNNING;
-		}
-		else if (my_state==RUNNING) //If state is running then handle input
-		{
-			my_state = handle_input();
-		}
-		else if (my_state==TERMINATED&&!ll_head) // If there are no running threads
-		{
-			break;
-		}
-		else
-			sleep (0); //Give up context
+	/* A client that goes away while its responses are written is dropped
+	 * (window_flush), not the end of the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Servers sharing a segment must agree on the shards; it keeps the
+	 * number it was made with */
+	if (segment) {
+		pin_disable();
+		want = shards;
+		if ((shards = db_attach(segment, shards)) < 0)
+			exit(1);
+		if (shards != want)
+			fprintf(stderr, "server: %s has %d shards\n", segment, shards);
+	}
+	shards_init(shards);
+	qcache_init(cache);
+
+	/* Rebuild the database from its snapshot and log before any client
+	 * can see it */
+	if (datadir && !wal_start(datadir, interval))
+		exit(1);
+
+	/* Replicas get the recovered database as their snapshot; a replica
+	 * loads its primary's in the background, refusing reads meanwhile */
+	if (replicas && !repl_serve(replicas))
+		exit(1);
+	if (primary && !repl_follow(primary))
+		exit(1);
+
+	if (trace && !trace_start(trace)) {
+		fprintf(stderr, "server: cannot trace to %s\n", trace);
+		exit(1);
 	}
-		
+
+	if (!workers_start()) {
+	fprintf(stderr, "server: cannot start workers\n");
+	exit(1);
+	}
+	/* Machine clients connect here; windows and files still use fifos */
+	if (socket_path && !listen_start(socket_path))
+		exit(1);
+
+	/* The console thread only reads console commands.  When it has to wait
+	 * for the clients to finish it sleeps on a condition the last one to go
+	 * signals; nothing here polls. */
+	while (my_state != TERMINATED) {
+		my_state = handle_input();
+		if (my_state == TERMINATED)
+			listen_stop();
+		if (my_state != RUNNING)
+			wait_for_clients();
+	}
+
     fprintf(stderr, "Terminating.");
+	trace_stop();
+	/* Leave a snapshot so the next start has no log to replay */
+	wal_stop();
     /* Clean up the window data */
     window_cleanup();
 	/* Clean up pthread stuff */
-	pthread_mutex_destroy(&mutex_to_delete);
 	pthread_mutex_destroy(&mutex_waiting);
 	pthread_cond_destroy(&cond_all_wait);
     return 0;
@@ -0,0 +1,187 @@
+#include "db.h"
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Keys a merging scan copies out of a shard per hold of its read lock, to
+ * start with and at most.  A range query that wants a few keys should not
+ * copy thousands out of every shard, so the chunk starts small and doubles
+ * each time the shard turns out to be needed again. */
+#define CHUNK_FIRST 8
+#define SHARD_CHUNK 4096
+
+int nshards = 1;
+
+/* One shard's position in a merging scan: the keys copied out of it by the
+ * last refill, as "name\0value\0" strings, and the next one to hand out. */
+typedef struct Cursor {
+	int shard;
+	char **entry;
+	int n, pos;
+	int chunk;		/* Keys to copy per refill */
+	int more;		/* Shard may have keys after entry[n - 1] */
+	int failed;		/* Out of memory */
+	char *last;		/* Last key handed out by the previous refill */
+} cursor_t;
+
+/* Use n shards.  Called once, before the database is used; the variant's
+ * db_shards is called even for one, as its start up hook. */
+void shards_init(int n) {
+    if (n < 1) n = 1;
+    if (n > MAX_SHARDS) n = MAX_SHARDS;
+    nshards = n;
+    db_shards(n);
+}
+
+/* FNV-1a of key */
+unsigned int key_hash(char *key) {
+    unsigned int h = 2166136261u;
+
+    while (*key) h = (h ^ (unsigned char) *key++) * 16777619u;
+    return h;
+}
+
+/* The shard key lives in */
+int shard_of(char *key) {
+    if (nshards == 1) return 0;
+    return key_hash(key) % nshards;
+}
+
+/* scan callback: copy one key into the cursor.  The scan resumes at the last
+ * key of the previous refill, which was already handed out. */
+static int collect(char *name, char *value, void *arg) {
+    cursor_t *c = (cursor_t *) arg;
+    size_t nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+    char *e;
+
+    if (c->last && strcmp(name, c->last) <= 0) return 1;
+    if (!(e = (char *) malloc(nlen + vlen))) {
+	c->failed = 1;
+	return 0;
+    }
+    memcpy(e, name, nlen);
+    memcpy(e + nlen, value, vlen);
+    c->entry[c->n++] = e;
+    return c->n < c->chunk;
+}
+
+/* Copy the next chunk of keys from c's shard, starting from from if this is
+ * the first.  Return the number copied. */
+static int refill(cursor_t *c, char *from) {
+    char **nentry;
+    int i;
+
+    /* Keep the last key as the place to resume from */
+    if (c->n > 0) {
+	free(c->last);
+	c->last = c->entry[c->n - 1];
+	for (i = 0; i < c->n - 1; i++) free(c->entry[i]);
+	if (c->chunk < SHARD_CHUNK) c->chunk *= 2;
+    }
+    c->n = c->pos = 0;
+    if (!(nentry = (char **) realloc(c->entry, c->chunk * sizeof(char *)))) {
+	c->failed = 1;
+	return 0;
+    }
+    c->entry = nentry;
+
+    db_use(c->shard);
+    db_read_lock();
+    scan(c->last ? c->last : from, collect, c);
+    db_read_unlock();
+    c->more = c->n == c->chunk;
+    return c->n;
+}
+
+/* The key under cursor c */
+#define KEY(c) ((c)->entry[(c)->pos])
+
+/* Restore the heap order of cursors below position i */
+static void sift_down(cursor_t **heap, int n, int i) {
+    cursor_t *c = heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < n) {
+	if (child + 1 < n && strcmp(KEY(heap[child + 1]), KEY(heap[child])) < 0)
+	    child++;
+	if (strcmp(KEY(heap[child]), KEY(c)) >= 0) break;
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = c;
+}
+
+/*
+ * Call fn on every key not smaller than from, over all shards, in key order,
+ * until it returns false: a k-way merge of the shards with a heap of
+ * cursors.  Unlike scan, the caller holds no lock.  Keys are copied out of
+ * each shard a chunk at a time under its read lock and fn is called with no
+ * lock held, so a long scan neither holds up writers nor sees a single
+ * moment: each key is as of the time its chunk was copied.  Return false if
+ * memory ran out, so keys may have been missed; true if every key was seen
+ * or fn stopped the scan.
+ */
+int scan_all(char *from, int (*fn)(char *, char *, void *), void *arg) {
+    cursor_t *cursors, **heap;
+    cursor_t *c;
+    int ok = 0;
+    int n = 0;
+    int i;
+
+    cursors = (cursor_t *) calloc(nshards, sizeof(cursor_t));
+    heap = (cursor_t **) malloc(nshards * sizeof(cursor_t *));
+    if (!cursors || !heap) goto done;
+
+    for (i = 0; i < nshards; i++) {
+	c = &cursors[i];
+	c->shard = i;
+	c->chunk = CHUNK_FIRST;
+	if (refill(c, from)) heap[n++] = c;
+	else if (c->failed) goto done;
+    }
+    ok = 1;
+    for (i = n / 2 - 1; i >= 0; i--) sift_down(heap, n, i);
+
+    while (n > 0) {
+	c = heap[0];
+	if (!fn(KEY(c), KEY(c) + strlen(KEY(c)) + 1, arg)) break;
+	if (++c->pos == c->n && !(c->more && refill(c, from))) {
+	    if (c->failed) {
+		ok = 0;
+		break;
+	    }
+	    heap[0] = heap[--n];
+	}
+	if (n > 0) sift_down(heap, n, 0);
+    }
+
+done:
+    if (cursors)
+	for (i = 0; i < nshards; i++) {
+	    c = &cursors[i];
+	    while (c->n > 0) free(c->entry[--c->n]);
+	    free(c->entry);
+	    free(c->last);
+	}
+    free(cursors);
+    free(heap);
+    return ok;
+}
+
+/* shape over all shards, taking each shard's read lock in turn */
+long shape_all(long *per_level) {
+    long shard_level[MAX_LEVEL];
+    long nodes = 0;
+    int s, i;
+
+    for (i = 0; i < MAX_LEVEL; i++) per_level[i] = 0;
+    for (s = 0; s < nshards; s++) {
+	db_use(s);
+	db_read_lock();
+	nodes += shape(shard_level);
+	db_read_unlock();
+	for (i = 0; i < MAX_LEVEL; i++) per_level[i] += shard_level[i];
+    }
+    return nodes;
+}
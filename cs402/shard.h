@@ -0,0 +1,17 @@
+#ifndef SHARD_H
+#define SHARD_H
+/*
+ * Hash sharding of the keyspace.  Each key lives in shard shard_of(key), an
+ * independent index with its own database lock (see db_shards in db.h), so
+ * writers to different shards never meet.  Operations on one key just
+ * db_use its shard.  Anything that needs every key in order merges the
+ * shards: scan_all.
+ */
+extern int nshards;
+
+void shards_init(int);
+unsigned int key_hash(char *);
+int shard_of(char *);
+int scan_all(char *, int (*)(char *, char *, void *), void *);
+long shape_all(long *);
+#endif
@@ -0,0 +1,276 @@
+#include "skiplist.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "slab.h"
+
+/*
+ * The unsynchronized skip list behind server_coarse and server_rw.  Callers
+ * (interpret_command in db_coarse.c and db_rw.c) hold the database lock around
+ * every call.
+ */
+
+node_t head = { { 0, 0 }, 0, 1, "", "", { [MAX_LEVEL - 1] = NULL } };
+
+/* Head sentinels of the shards (head is shard 0's) and the calling thread's */
+static node_t *heads[MAX_SHARDS] = { &head };
+static __thread node_t *root = &head;
+
+
+/*
+ * Allocate a new node with the given key and value and room for level forward
+ * pointers.  The pointers are left NULL for the caller to link.
+ */
+node_t *node_create(char *arg_name, char *arg_value, int level) {
+    node_t *new_node;
+    char *new_node_name, *new_node_value;
+    int i;
+
+    /* One slab block holds the node and, if they are short, its strings */
+    new_node = (node_t *) node_alloc(sizeof(node_t) + level * sizeof(node_t *),
+	    arg_name, arg_value, &new_node_name, &new_node_value);
+    if (!new_node) return NULL;
+    new_node->name = new_node_name;
+    new_node->value = new_node_value;
+    key_prefix(new_node_name, new_node->prefix);
+    new_node->len = strlen(new_node_name);
+
+    new_node->level = level;
+    for (i = 0; i < level; i++) new_node->next[i] = NULL;
+
+    return new_node;
+}
+
+/* Free the data structures in node and the node itself.  Inline strings go
+ * back to the slab with the node. */
+void node_destroy(node_t * node) {
+    node_free(node, sizeof(node_t) + node->level * sizeof(node_t *), node->name,
+	    node->value);
+}
+
+/* Find the node with key name and return a result or error string in result.
+ * Result must have space for len characters. */
+void query(char *name, char *result, int len) {
+    node_t *target;
+
+    target = search(name, root, NULL);
+
+    if (!target) {
+	strncpy(result, "not found", len - 1);
+	return;
+    } else {
+	strncpy(result, target->value, len - 1);
+	return;
+    }
+}
+
+/* Insert a node with name and value into the list rooted at head.  Return
+ * false if the key is already there. */
+int add(char *name, char *value) {
+	node_t *preds[MAX_LEVEL];   /* The new node follows these on each level */
+	node_t *newnode;	    /* The new node to add */
+	int level;		    /* Height of the new node */
+	int i;
+
+	if (search(name, root, preds)) {
+	    /* There is already a node with this key in the list */
+	    return 0;
+	}
+
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+
+	/* Levels the list did not use yet start at the head */
+	for (i = root->level; i < level; i++) preds[i] = root;
+	if (level > root->level) root->level = level;
+
+	/* Splice the new node in after its predecessor on each of its levels */
+	for (i = 0; i < level; i++) {
+	    newnode->next[i] = preds[i]->next[i];
+	    preds[i]->next[i] = newnode;
+	}
+	return 1;
+}
+
+/* Remove the node with key name from the list if it is there.  Return true if
+ * something was deleted. */
+int xremove(char *name) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of dnode on each level */
+	node_t *dnode;		    /* Node to delete */
+	int i;
+
+	/* first, find the node to be removed */
+	if (!(dnode = search(name, root, preds))) {
+	    /* it's not there */
+	    return 0;
+	}
+
+	/* Unlink it from every level it is on.  Unlike a binary tree there is
+	 * no two-children case: each level is a plain linked list. */
+	for (i = 0; i < dnode->level; i++)
+	    preds[i]->next[i] = dnode->next[i];
+
+	/* Drop levels that are now empty */
+	while (root->level > 1 && root->next[root->level - 1] == NULL)
+	    root->level--;
+
+	node_destroy(dnode);
+	return 1;
+}
+
+/* Replace name's value by swapping in a node of the same height that takes
+ * the old node's place on every level */
+int update(char *name, char *value, char *expect) {
+	node_t *preds[MAX_LEVEL];   /* Predecessors of the node on each level */
+	node_t *old, *newnode;
+	int i;
+
+	if (!(old = search(name, root, preds))) return 0;
+	if (expect && strcmp(old->value, expect)) return -1;
+	if (!(newnode = node_create(name, value, old->level))) return 0;
+	for (i = 0; i < old->level; i++) {
+	    newnode->next[i] = old->next[i];
+	    preds[i]->next[i] = newnode;
+	}
+	node_destroy(old);
+	return 1;
+}
+
+/* The callers hold the database lock of every shard in ops, so the
+ * operations are simply carried out one after another. */
+void multi(multi_t *ops, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+	skiplist_use(ops[i].shard);
+	switch (ops[i].code) {
+	case 'q':
+	    query(ops[i].name, ops[i].value, ops[i].len);
+	    break;
+	case 'a':
+	    ops[i].done = add(ops[i].name, ops[i].value);
+	    break;
+	case 'd':
+	    ops[i].done = xremove(ops[i].name);
+	    break;
+	}
+    }
+}
+
+/* Call fn on every key not smaller than from, in order, until it returns
+ * false */
+void scan(char *from, int (*fn)(char *, char *, void *), void *arg) {
+    node_t *preds[MAX_LEVEL];
+    node_t *n;
+
+    search(from, root, preds);
+    for (n = preds[0]->next[0]; n && fn(n->name, n->value, arg); n = n->next[0])
+	;
+}
+
+/* Count the nodes on each level, from the heights of the nodes on level 0 */
+long shape(long *per_level) {
+    node_t *n;
+    long nodes = 0;
+    int i;
+
+    for (i = 0; i < MAX_LEVEL; i++) per_level[i] = 0;
+    for (n = root->next[0]; n; n = n->next[0]) {
+	nodes++;
+	for (i = 0; i < n->level; i++) per_level[i]++;
+    }
+    return nodes;
+}
+
+/* Start a bulk load: find the last node on every level */
+void bulk_start(bulk_t *bulk) {
+    node_t *pred = root;
+    int i;
+
+    for (i = MAX_LEVEL - 1; i >= 0; i--) {
+	while (pred->next[i]) pred = pred->next[i];
+	bulk->last[i] = pred;
+    }
+}
+
+/* Append name, which must sort after every key in the list, by linking a new
+ * node after the last node on each of its levels.  Return false if it could
+ * not be added. */
+int bulk_append(bulk_t *bulk, char *name, char *value) {
+	node_t **last = (node_t **) bulk->last;
+	node_t *newnode;
+	int level;
+	int done;
+	int i;
+
+	if (last[0] != root && strcmp(last[0]->name, name) >= 0) {
+	    /* Out of order.  The new node may land after some last[i]. */
+	    done = add(name, value);
+	    for (i = 0; i < MAX_LEVEL; i++)
+		while (last[i]->next[i]) last[i] = last[i]->next[i];
+	    return done;
+	}
+
+	level = random_level();
+	if (!(newnode = node_create(name, value, level))) return 0;
+	for (i = 0; i < level; i++) {
+	    last[i]->next[i] = newnode;
+	    last[i] = newnode;
+	}
+	if (level > root->level) root->level = level;
+	return 1;
+}
+
+/* Search the list that starts at the sentinel start for a node containing name
+ * (the "target node").  Return a pointer to the node, if found, otherwise
+ * return 0.  If preds is not 0 it must have room for MAX_LEVEL entries, and
+ * preds[i] is set to the last node on level i whose key is smaller than name
+ * for every level in use.  Those are the nodes whose next pointers change if
+ * name is inserted or removed.
+ *
+ * Assumptions:
+ * start is a sentinel whose name sorts before every key */
+node_t *search(char *name, node_t * start, node_t ** preds) {
+    node_t *pred = start;
+    node_t *next = NULL;
+    search_key_t key;
+    int i;
+    int cmp = 1;
+
+    key_make(&key, name);
+    for (i = start->level - 1; i >= 0; i--) {
+	/* Move right while the next key is smaller, then drop a level */
+	while ((next = pred->next[i]) && (cmp = NODE_CMP(next, &key)) < 0)
+	    pred = next;
+	if (preds) preds[i] = pred;
+	else if (next && cmp == 0) return next;
+    }
+
+    /* next is the first node on level 0 not smaller than name */
+    return (next && cmp == 0) ? next : NULL;
+}
+
+/* Make the head sentinels of shards 1 .. n-1 */
+void skiplist_shards(int n) {
+    int i;
+
+    for (i = 1; i < n; i++) {
+	if (!(heads[i] = (node_t *) calloc(1, sizeof(node_t) +
+		MAX_LEVEL * sizeof(node_t *)))) {
+	    perror("db_shards");
+	    exit(1);
+	}
+	heads[i]->name = heads[i]->value = "";
+	heads[i]->level = 1;
+    }
+}
+
+void skiplist_use(int shard) { root = heads[shard]; }
+
+/* The database lives in this process's heap and cannot be shared */
+int db_attach(char *path, int shards) {
+    fprintf(stderr, "%s: this server cannot share its database\n", path);
+    return -1;
+}
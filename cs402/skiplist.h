@@ -0,0 +1,27 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+#include "db.h"
+#include "key.h"
+
+/* A skip list node.  next has level entries; next[i] is the following node on
+ * level i.  The head sentinel has room for MAX_LEVEL entries and its level is
+ * the number of levels currently in use.  A search step reads prefix and one
+ * of next, so they come first and together. */
+typedef struct Node {
+	uint64_t prefix[2];	/* Of name; see key.h */
+	int len;		/* strlen(name) */
+	int level;
+	char *name;
+	char *value;
+	struct Node *next[];
+} node_t;
+
+extern node_t head;
+
+node_t *node_create(char *, char *, int);
+void node_destroy(node_t *);
+node_t *search(char *, node_t *, node_t **);
+/* Shard sentinels for the variants built on skiplist.c, which add their locks */
+void skiplist_shards(int);
+void skiplist_use(int);
+#endif
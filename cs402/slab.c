@@ -0,0 +1,184 @@
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Each thread grabs arena memory from malloc this many bytes at a time */
+#define SLAB_CHUNK (64 * 1024)
+/* A thread keeps at most this many free blocks of one class before giving
+ * a batch of SLAB_BATCH back to the shared depot */
+#define SLAB_KEEP 256
+#define SLAB_BATCH 64
+#define SLAB_CLASSES (SLAB_MAX / SLAB_ALIGN)
+
+/* A free block; the link lives in the block itself */
+typedef struct Block {
+	struct Block *next;
+} block_t;
+
+/* Per-thread allocator state */
+typedef struct SlabCache {
+	block_t *free[SLAB_CLASSES];	/* Recycled blocks by class */
+	int nfree[SLAB_CLASSES];
+	char *arena;			/* Unused part of the current chunk */
+	size_t left;			/* Bytes left in it */
+} slab_cache_t;
+
+/* Free blocks handed back by threads with too many, or that exited.  Blocks
+ * freed by one thread (say a remove) are thereby reused by others. */
+block_t *depot[SLAB_CLASSES];
+int ndepot[SLAB_CLASSES];
+pthread_mutex_t mutex_depot = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread slab_cache_t *self = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/* Size class of a request of size bytes */
+static inline int size_class(size_t size) {
+    return (size + SLAB_ALIGN - 1) / SLAB_ALIGN - 1;
+}
+
+/* Move up to n blocks from the list *from (with *count entries) onto *to.
+ * The counts are updated atomically because slab_alloc peeks at the depot
+ * counts without the lock. */
+static void move_blocks(block_t **from, int *count, block_t **to, int *tcount,
+	int n) {
+    block_t *b;
+
+    while (n-- > 0 && (b = *from)) {
+	*from = b->next;
+	b->next = *to;
+	*to = b;
+	__atomic_store_n(count, *count - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(tcount, *tcount + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Thread exit: give every cached block to the depot.  What is left of the
+ * arena chunk is abandoned. */
+static void cache_release(void *arg) {
+    slab_cache_t *cache = (slab_cache_t *) arg;
+    int c;
+
+    pthread_mutex_lock(&mutex_depot);
+    for (c = 0; c < SLAB_CLASSES; c++)
+	move_blocks(&cache->free[c], &cache->nfree[c], &depot[c], &ndepot[c],
+		cache->nfree[c]);
+    pthread_mutex_unlock(&mutex_depot);
+    free(cache);
+}
+
+static void cache_key_create() {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+/* The calling thread's cache, created on first use */
+static slab_cache_t *self_cache() {
+    if (self) return self;
+    pthread_once(&cache_once, cache_key_create);
+    if (!(self = (slab_cache_t *) calloc(1, sizeof(slab_cache_t)))) return NULL;
+    pthread_setspecific(cache_key, self);
+    return self;
+}
+
+/* Return a block of at least size bytes.  Sizes over SLAB_MAX go to malloc. */
+void *slab_alloc(size_t size) {
+    slab_cache_t *cache;
+    block_t *b;
+    int c;
+
+    if (size > SLAB_MAX) return malloc(size);
+    if (!(cache = self_cache())) return NULL;
+    c = size_class(size);
+
+    /* Refill an empty list from the depot before touching fresh memory */
+    if (!cache->free[c] && __atomic_load_n(&ndepot[c], __ATOMIC_RELAXED)) {
+	pthread_mutex_lock(&mutex_depot);
+	move_blocks(&depot[c], &ndepot[c], &cache->free[c], &cache->nfree[c],
+		SLAB_BATCH);
+	pthread_mutex_unlock(&mutex_depot);
+    }
+    if ((b = cache->free[c])) {
+	cache->free[c] = b->next;
+	cache->nfree[c]--;
+	return b;
+    }
+
+    /* Carve a new block out of the arena */
+    size = (c + 1) * SLAB_ALIGN;
+    if (cache->left < size) {
+	if (!(cache->arena = (char *) malloc(SLAB_CHUNK))) {
+	    cache->left = 0;
+	    return NULL;
+	}
+	cache->left = SLAB_CHUNK;
+    }
+    b = (block_t *) cache->arena;
+    cache->arena += size;
+    cache->left -= size;
+    return b;
+}
+
+/* Release a block from slab_alloc(size) onto this thread's free list */
+void slab_free(void *ptr, size_t size) {
+    slab_cache_t *cache;
+    block_t *b = (block_t *) ptr;
+    int c;
+
+    if (!ptr) return;
+    if (size > SLAB_MAX) {
+	free(ptr);
+	return;
+    }
+    if (!(cache = self_cache())) return;	/* Leak rather than crash */
+    c = size_class(size);
+    b->next = cache->free[c];
+    cache->free[c] = b;
+
+    if (++cache->nfree[c] > SLAB_KEEP) {
+	pthread_mutex_lock(&mutex_depot);
+	move_blocks(&cache->free[c], &cache->nfree[c], &depot[c], &ndepot[c],
+		SLAB_BATCH);
+	pthread_mutex_unlock(&mutex_depot);
+    }
+}
+
+void *node_alloc(size_t base, char *name, char *value, char **namep,
+	char **valuep) {
+    size_t nlen = strlen(name) + 1;
+    size_t vlen = strlen(value) + 1;
+    char *node;
+
+    if (base + nlen + vlen <= SLAB_MAX) {
+	/* Everything in one block: name and value follow the fixed part */
+	if (!(node = (char *) slab_alloc(base + nlen + vlen))) return NULL;
+	*namep = node + base;
+	*valuep = node + base + nlen;
+    } else {
+	/* Long strings live out of line */
+	if (!(node = (char *) slab_alloc(base))) return NULL;
+	if (!(*namep = (char *) malloc(nlen))) {
+	    slab_free(node, base);
+	    return NULL;
+	}
+	if (!(*valuep = (char *) malloc(vlen))) {
+	    free(*namep);
+	    slab_free(node, base);
+	    return NULL;
+	}
+    }
+    memcpy(*namep, name, nlen);
+    memcpy(*valuep, value, vlen);
+    return node;
+}
+
+void node_free(void *node, size_t base, char *name, char *value) {
+    if (name == (char *) node + base) {
+	slab_free(node, base + strlen(name) + 1 + strlen(value) + 1);
+    } else {
+	free(name);
+	free(value);
+	slab_free(node, base);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stddef.h>
+
+/*
+ * Small-block allocator for database nodes.  Blocks come in size classes of
+ * SLAB_ALIGN bytes up to SLAB_MAX.  Each thread carves blocks out of its own
+ * arena chunks and recycles freed blocks through per-thread free lists, so the
+ * common case takes no lock and a delete/add churn reuses the same memory.
+ */
+#define SLAB_ALIGN 16
+#define SLAB_MAX 256
+
+void *slab_alloc(size_t);
+void slab_free(void *, size_t);
+
+/* Allocate a node whose fixed part (header and next pointers) is base bytes
+ * and store copies of name and value in it.  If they fit in the block with
+ * the node they are stored inline, right after the fixed part, so a lookup
+ * touches one allocation; otherwise they are allocated separately.  The
+ * string pointers are returned through namep and valuep.  NULL on failure. */
+void *node_alloc(size_t, char *, char *, char **, char **);
+/* Release a node from node_alloc; name and value are its string pointers */
+void node_free(void *, size_t, char *, char *);
+#endif
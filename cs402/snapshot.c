@@ -0,0 +1,169 @@
+#include "db.h"
+#include "snapshot.h"
+#include "shard.h"
+#include "pin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* State of a snapshot being written */
+typedef struct Writer {
+	FILE *f;
+	uint64_t pos;		/* File offset of the next record */
+	uint64_t *index;	/* Offsets of the records so far */
+	uint64_t count;
+	uint64_t cap;		/* Room in index */
+	int failed;		/* Out of memory: the snapshot is incomplete */
+} writer_t;
+
+/* scan callback: append one record */
+static int write_record(char *name, char *value, void *arg) {
+    writer_t *w = (writer_t *) arg;
+    uint64_t *nindex;
+    size_t nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+
+    if (w->count == w->cap) {
+	if (!(nindex = (uint64_t *) realloc(w->index,
+		(w->cap ? 2 * w->cap : 1024) * sizeof(uint64_t)))) {
+	    w->failed = 1;
+	    return 0;
+	}
+	w->index = nindex;
+	w->cap = w->cap ? 2 * w->cap : 1024;
+    }
+    w->index[w->count++] = w->pos;
+    fwrite(name, 1, nlen, w->f);
+    fwrite(value, 1, vlen, w->f);
+    w->pos += nlen + vlen;
+    return 1;
+}
+
+/*
+ * Write a snapshot of the database to path.  segment is stored in the header:
+ * the first log segment a restart must replay on top of this snapshot.
+ *
+ * The keys come from scan_all, which merges the shards into one key order
+ * and only holds a shard's read lock while copying a chunk of it.  Clients
+ * keep running while the snapshot is written, so it is fuzzy: each key is as
+ * of some moment during the write.  Replaying the log from segment
+ * (which was started before the write began) repairs that, because adds and
+ * deletes of a key alternate and each one only succeeds in the state it was
+ * made in.  Given a pin that is not 0 (pin.c), the snapshot is of the pinned
+ * view instead and is exact, with no log needed.  Return true if the
+ * snapshot is safely on disk.
+ */
+int snapshot_write(char *path, unsigned long segment, int pin) {
+    writer_t w;
+    snap_header_t header;
+    static const char pad[8] = { 0 };
+    int ok;
+
+    memset(&w, 0, sizeof(w));
+    if (!(w.f = fopen(path, "w"))) {
+	perror(path);
+	return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, w.f);
+    w.pos = sizeof(header);
+
+    /* A scan cut short by lack of memory is as bad as a failed write */
+    if (pin ? pin_scan(pin, "", write_record, &w) < 0 :
+	    !scan_all("", write_record, &w))
+	w.failed = 1;
+
+    /* The index, then the header that says where it is */
+    fwrite(pad, 1, (8 - w.pos % 8) % 8, w.f);
+    memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+    header.count = w.count;
+    header.segment = segment;
+    header.index = (w.pos + 7) & ~(uint64_t) 7;
+    fwrite(w.index, sizeof(uint64_t), w.count, w.f);
+    fseek(w.f, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, w.f);
+
+    ok = fflush(w.f) == 0 && !ferror(w.f) && fsync(fileno(w.f)) == 0;
+    if (!ok) perror(path);
+    /* A snapshot missing keys must not replace a good one */
+    if (w.failed) {
+	fprintf(stderr, "%s: out of memory, snapshot incomplete\n", path);
+	ok = 0;
+    }
+    fclose(w.f);
+    free(w.index);
+    return ok;
+}
+
+/*
+ * Load the snapshot in path into the database, which should be empty, and
+ * return the log segment to replay from in *segment and the number of keys in
+ * *count.  Return 1 on success, 0 if there is no snapshot and -1 if it is
+ * unreadable or damaged.  Each key is appended to its shard, which sees its
+ * keys in order, so the load is linear however many shards there are.
+ */
+int snapshot_load(char *path, unsigned long *segment, unsigned long *count) {
+    snap_header_t *header;
+    uint64_t *index;
+    struct stat st;
+    bulk_t *bulk;
+    char *map, *name, *value, *end;
+    uint64_t i;
+    int s;
+    int fd;
+    int rc = -1;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+	return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(snap_header_t)) {
+	close(fd);
+	return -1;
+    }
+    map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    header = (snap_header_t *) map;
+    end = map + st.st_size;
+    if (memcmp(header->magic, SNAP_MAGIC, sizeof(header->magic)) ||
+	    header->index % 8 || header->index > (uint64_t) st.st_size ||
+	    header->count > (st.st_size - header->index) / sizeof(uint64_t))
+	goto done;
+    index = (uint64_t *)(map + header->index);
+
+    if (!(bulk = (bulk_t *) malloc(nshards * sizeof(bulk_t)))) goto done;
+    for (s = 0; s < nshards; s++) {
+	db_use(s);
+	db_write_lock();
+	bulk_start(&bulk[s]);
+    }
+    for (i = 0; i < header->count; i++) {
+	if (index[i] < sizeof(snap_header_t) || index[i] >= header->index)
+	    break;
+	name = map + index[i];
+	if (!(value = memchr(name, '\0', end - name)) || ++value >= end ||
+		!memchr(value, '\0', end - value))
+	    break;
+	db_use(s = shard_of(name));
+	bulk_append(&bulk[s], name, value);
+    }
+    for (s = 0; s < nshards; s++) {
+	db_use(s);
+	db_write_unlock();
+    }
+    free(bulk);
+    if (i == header->count) {
+	*segment = header->segment;
+	*count = header->count;
+	rc = 1;
+    }
+
+done:
+    munmap(map, st.st_size);
+    return rc;
+}
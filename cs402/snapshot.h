@@ -0,0 +1,28 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+
+/*
+ * Compact database snapshots.  A snapshot file is laid out so it can be
+ * mapped and used in place:
+ *
+ *	header		magic, record count, log segment, index offset
+ *	records		name\0value\0 for every key, in key order
+ *	index		count 64-bit file offsets, one per record, 8-aligned
+ *
+ * Record i is found in O(1) through the index, so the mapping can be binary
+ * searched directly, and loading walks the records in order and bulk appends
+ * them (see bulk_append in db.h) in O(n) instead of n searches.
+ */
+#define SNAP_MAGIC "DBSNAP01"
+
+typedef struct SnapHeader {
+	char magic[8];
+	uint64_t count;		/* Number of records */
+	uint64_t segment;	/* First log segment to replay after loading */
+	uint64_t index;		/* File offset of the record index */
+} snap_header_t;
+
+int snapshot_write(char *, unsigned long, int);
+int snapshot_load(char *, unsigned long *, unsigned long *);
+#endif
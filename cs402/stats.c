@@ -0,0 +1,319 @@
+#include "stats.h"
+#include "db.h"
+#include "shard.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Latency buckets: bucket b counts operations under 2^b nanoseconds */
+#define STAT_BUCKETS 40
+/* Entries in each thread's hot key and hot node sketches */
+#define SKETCH_SIZE 32
+/* Characters of a key kept in a sketch */
+#define SKETCH_KEY 32
+/* Keys are sampled into the hot key sketch one operation in this many */
+#define KEY_SAMPLE 4
+/* Lines of hot keys and nodes printed */
+#define TOP_K 10
+
+/* Space-Saving sketch: the SKETCH_SIZE heaviest keys seen, approximately.  A
+ * key that is not there replaces the lightest one and inherits its weight,
+ * so a count is never low and over by at most the lightest weight. */
+typedef struct SketchEntry {
+	char key[SKETCH_KEY];
+	long weight;
+} sketch_entry_t;
+
+typedef struct Sketch {
+	sketch_entry_t entry[SKETCH_SIZE];
+	int used;
+} sketch_t;
+
+typedef struct LockStats {
+	long acquired;
+	long contended;		/* Acquisitions that had to wait */
+	long wait_ns;
+} lock_stats_t;
+
+/* One thread's counters.  Only the owning thread writes the plain counters
+ * (stats_print reads them with atomic loads); the sketches are copied by
+ * stats_print, so they are updated under the record's own mutex, which
+ * nobody else wants except while printing. */
+typedef struct StatsRecord {
+	long count[STAT_TYPES];
+	long hist[STAT_TYPES][STAT_BUCKETS];
+	long total_ns[STAT_TYPES];
+	lock_stats_t lock[LOCK_KINDS];
+	long cache_hits;	/* Queries answered from the cache (qcache.c) */
+	long cache_misses;
+	long sampled;		/* Lock acquisitions at the last stats_lock_sample */
+	unsigned int sample;
+	pthread_mutex_t mutex_sketch;
+	sketch_t keys;		/* Weight is sampled operations */
+	sketch_t nodes;		/* Weight is nanoseconds waited for the node */
+	struct StatsRecord *next;
+} __attribute__((aligned(64))) stats_record_t;
+
+/* Records of every thread that ever counted.  Only ever pushed onto. */
+static stats_record_t *records = NULL;
+static __thread stats_record_t *self = NULL;
+
+/* Add n to a counter only this thread writes */
+#define BUMP(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+/* Return the calling thread's record, creating it on first use */
+static stats_record_t *self_record() {
+    stats_record_t *rec;
+
+    if (self) return self;
+    if (posix_memalign((void **) &rec, 64, sizeof(stats_record_t))) {
+	fprintf(stderr, "stats record allocation failed, exiting\n");
+	exit(1);
+    }
+    memset(rec, 0, sizeof(stats_record_t));
+    pthread_mutex_init(&rec->mutex_sketch, NULL);
+    rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+    return self = rec;
+}
+
+/* Nanoseconds since some fixed point */
+long stats_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Add weight to key in sketch s */
+static void sketch_add(sketch_t *s, char *key, long weight) {
+    sketch_entry_t *e, *min = NULL;
+    int i;
+
+    for (i = 0; i < s->used; i++) {
+	e = &s->entry[i];
+	if (!strncmp(e->key, key, SKETCH_KEY - 1)) {
+	    e->weight += weight;
+	    return;
+	}
+	if (!min || e->weight < min->weight) min = e;
+    }
+    if (s->used < SKETCH_SIZE) {
+	e = &s->entry[s->used++];
+	e->weight = weight;
+    } else {
+	e = min;
+	e->weight += weight;
+    }
+    snprintf(e->key, SKETCH_KEY, "%s", key);
+}
+
+/* Count a command that took ns nanoseconds */
+void stats_command(char *command, long ns) {
+    stats_record_t *rec = self_record();
+    int type, b;
+
+    switch (command[0]) {
+	case 'q': type = STAT_QUERY; break;
+	case 'a': type = STAT_ADD; break;
+	case 'd': type = STAT_DELETE; break;
+	case 'r': case 'p': case 'R': type = STAT_SCAN; break;
+	case 'b': type = STAT_BATCH; break;
+	case 'f':
+	case 'F': type = STAT_FILE; break;
+	default: type = STAT_OTHER; break;
+    }
+    for (b = 0; b < STAT_BUCKETS - 1 && ns >= (1L << b); b++)
+	;
+    BUMP(rec->count[type], 1);
+    BUMP(rec->hist[type][b], 1);
+    BUMP(rec->total_ns[type], ns);
+}
+
+/* Count a look in the query cache */
+void stats_cache(int hit) {
+    stats_record_t *rec = self_record();
+
+    if (hit) BUMP(rec->cache_hits, 1);
+    else BUMP(rec->cache_misses, 1);
+}
+
+/* Note an operation on key, for the hot key sketch */
+void stats_key(char *key) {
+    stats_record_t *rec = self_record();
+
+    if (++rec->sample % KEY_SAMPLE) return;
+    pthread_mutex_lock(&rec->mutex_sketch);
+    sketch_add(&rec->keys, key, 1);
+    pthread_mutex_unlock(&rec->mutex_sketch);
+}
+
+/* Count a lock acquisition of the given kind that waited wait_ns (-1 if it
+ * did not wait at all).  key names the node locked, if it is a node lock. */
+void stats_lock(int kind, char *key, long wait_ns) {
+    stats_record_t *rec = self_record();
+    lock_stats_t *l = &rec->lock[kind];
+
+    BUMP(l->acquired, 1);
+    if (wait_ns < 0) return;
+    BUMP(l->contended, 1);
+    BUMP(l->wait_ns, wait_ns);
+    if (key) {
+	pthread_mutex_lock(&rec->mutex_sketch);
+	sketch_add(&rec->nodes, key, wait_ns);
+	pthread_mutex_unlock(&rec->mutex_sketch);
+    }
+}
+
+/* Fill acquired and contended, for each kind of lock, with the totals over
+ * every thread.  Return the number of threads that acquired any lock since
+ * the last call.  For a single caller, such as a thread that polls the
+ * counters to tune locking (adaptive.c). */
+int stats_lock_sample(long *acquired, long *contended) {
+    stats_record_t *rec;
+    long total;
+    int active = 0;
+    int i;
+
+    for (i = 0; i < LOCK_KINDS; i++) acquired[i] = contended[i] = 0;
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+	for (i = 0, total = 0; i < LOCK_KINDS; i++) {
+	    total += __atomic_load_n(&rec->lock[i].acquired, __ATOMIC_RELAXED);
+	    acquired[i] += __atomic_load_n(&rec->lock[i].acquired, __ATOMIC_RELAXED);
+	    contended[i] += __atomic_load_n(&rec->lock[i].contended, __ATOMIC_RELAXED);
+	}
+	if (total != rec->sampled) active++;
+	rec->sampled = total;
+    }
+    return active;
+}
+
+/* Set by a variant with something of its own to report */
+void (*stats_variant)(FILE *) = NULL;
+
+/* The latency below which fraction p of the counts in hist fall: the upper
+ * edge of that bucket, in microseconds */
+static double percentile(long *hist, long total, double p) {
+    long seen = 0;
+    int b;
+
+    for (b = 0; b < STAT_BUCKETS - 1; b++)
+	if ((seen += hist[b]) >= p * total) break;
+    return (1L << b) / 1e3;
+}
+
+static int by_weight(const void *a, const void *b) {
+    long wa = ((sketch_entry_t *) a)->weight, wb = ((sketch_entry_t *) b)->weight;
+
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+/* Merge sketch s into the n entries of all, which has room for them */
+static int sketch_merge(sketch_entry_t *all, int n, sketch_t *s) {
+    int i, j;
+
+    for (i = 0; i < s->used; i++) {
+	for (j = 0; j < n && strcmp(all[j].key, s->entry[i].key); j++)
+	    ;
+	if (j == n) all[n++] = s->entry[i];
+	else all[j].weight += s->entry[i].weight;
+    }
+    return n;
+}
+
+/* Print the merged counters, the shape of the index and the hottest keys */
+void stats_print(FILE *out) {
+    static char *types[] = { "query", "add", "delete", "scan", "batch", "file",
+	"other" };
+    static char *kinds[] = { "db read", "db write", "node read", "node write" };
+    long count[STAT_TYPES] = { 0 }, total_ns[STAT_TYPES] = { 0 };
+    long hist[STAT_TYPES][STAT_BUCKETS];
+    lock_stats_t lock[LOCK_KINDS];
+    long per_level[MAX_LEVEL];
+    long nodes, hits = 0, misses = 0;
+    sketch_entry_t *keys, *hot;
+    int nkeys = 0, nhot = 0, nrecords = 0;
+    stats_record_t *first, *rec;
+    int i, b;
+
+    memset(hist, 0, sizeof(hist));
+    memset(lock, 0, sizeof(lock));
+    /* Records pushed after this are not counted this time */
+    first = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (rec = first; rec; rec = rec->next)
+	nrecords++;
+    keys = (sketch_entry_t *) malloc((nrecords + 1) * SKETCH_SIZE * sizeof(sketch_entry_t));
+    hot = (sketch_entry_t *) malloc((nrecords + 1) * SKETCH_SIZE * sizeof(sketch_entry_t));
+    if (!keys || !hot) {
+	free(keys);
+	free(hot);
+	return;
+    }
+
+    for (rec = first; rec; rec = rec->next) {
+	for (i = 0; i < STAT_TYPES; i++) {
+	    count[i] += __atomic_load_n(&rec->count[i], __ATOMIC_RELAXED);
+	    total_ns[i] += __atomic_load_n(&rec->total_ns[i], __ATOMIC_RELAXED);
+	    for (b = 0; b < STAT_BUCKETS; b++)
+		hist[i][b] += __atomic_load_n(&rec->hist[i][b], __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < LOCK_KINDS; i++) {
+	    lock[i].acquired += __atomic_load_n(&rec->lock[i].acquired, __ATOMIC_RELAXED);
+	    lock[i].contended += __atomic_load_n(&rec->lock[i].contended, __ATOMIC_RELAXED);
+	    lock[i].wait_ns += __atomic_load_n(&rec->lock[i].wait_ns, __ATOMIC_RELAXED);
+	}
+	hits += __atomic_load_n(&rec->cache_hits, __ATOMIC_RELAXED);
+	misses += __atomic_load_n(&rec->cache_misses, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&rec->mutex_sketch);
+	nkeys = sketch_merge(keys, nkeys, &rec->keys);
+	nhot = sketch_merge(hot, nhot, &rec->nodes);
+	pthread_mutex_unlock(&rec->mutex_sketch);
+    }
+
+    fprintf(out, "%-8s %10s %10s %9s %9s %9s\n", "command", "count", "avg us",
+	    "p50 us", "p99 us", "p999 us");
+    for (i = 0; i < STAT_TYPES; i++)
+	if (count[i])
+	    fprintf(out, "%-8s %10ld %10.1f %9.1f %9.1f %9.1f\n", types[i],
+		    count[i], total_ns[i] / 1e3 / count[i],
+		    percentile(hist[i], count[i], 0.5),
+		    percentile(hist[i], count[i], 0.99),
+		    percentile(hist[i], count[i], 0.999));
+
+    fprintf(out, "%-10s %12s %10s %12s\n", "lock", "acquired", "contended",
+	    "wait ms");
+    for (i = 0; i < LOCK_KINDS; i++)
+	if (lock[i].acquired)
+	    fprintf(out, "%-10s %12ld %10ld %12.2f\n", kinds[i], lock[i].acquired,
+		    lock[i].contended, lock[i].wait_ns / 1e6);
+
+    if (hits + misses)
+	fprintf(out, "query cache: %ld hits, %ld misses (%.1f%% hits)\n", hits,
+		misses, 100.0 * hits / (hits + misses));
+
+    if (stats_variant) stats_variant(out);
+
+    nodes = shape_all(per_level);
+    fprintf(out, "nodes %ld, per level:", nodes);
+    for (i = 0; i < MAX_LEVEL && per_level[i]; i++)
+	fprintf(out, " %ld", per_level[i]);
+    fprintf(out, "\n");
+
+    qsort(keys, nkeys, sizeof(sketch_entry_t), by_weight);
+    if (nkeys) fprintf(out, "hot keys (approximate operations):");
+    for (i = 0; i < nkeys && i < TOP_K; i++)
+	fprintf(out, " %s %ld", keys[i].key, keys[i].weight * KEY_SAMPLE);
+    if (nkeys) fprintf(out, "\n");
+
+    qsort(hot, nhot, sizeof(sketch_entry_t), by_weight);
+    if (nhot) fprintf(out, "contended nodes (ms waited):");
+    for (i = 0; i < nhot && i < TOP_K; i++)
+	fprintf(out, " %s %.2f", hot[i].key[0] ? hot[i].key : "(head)",
+		hot[i].weight / 1e6);
+    if (nhot) fprintf(out, "\n");
+    fflush(out);
+    free(keys);
+    free(hot);
+}
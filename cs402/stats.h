@@ -0,0 +1,74 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Performance counters for the server console's stats command: commands by
+ * type with latency histograms, lock acquisitions and the time spent waiting
+ * for contended ones, the hottest keys and the most contended nodes.
+ *
+ * Every thread counts into a record of its own, so counting never shares a
+ * cache line or takes a lock that anyone else wants; stats_print merges the
+ * records when asked.  A lock is first tried without waiting, and only a
+ * failed try reads the clock.
+ */
+
+/* Command types, by first letter */
+enum { STAT_QUERY, STAT_ADD, STAT_DELETE, STAT_SCAN, STAT_BATCH, STAT_FILE,
+	STAT_OTHER, STAT_TYPES };
+
+/* Kinds of lock acquisition */
+enum { LOCK_DB_READ, LOCK_DB_WRITE, LOCK_NODE_READ, LOCK_NODE_WRITE,
+	LOCK_KINDS };
+
+long stats_now(void);
+void stats_command(char *, long);
+void stats_key(char *);
+void stats_lock(int, char *, long);
+void stats_cache(int);
+void stats_print(FILE *);
+int stats_lock_sample(long *, long *);
+/* Called by stats_print, if set, to print the variant's own state */
+extern void (*stats_variant)(FILE *);
+
+/* Lock m, counting the acquisition as kind */
+static inline void stats_mutex_lock(pthread_mutex_t *m, int kind) {
+    long start;
+
+    if (pthread_mutex_trylock(m) == 0) {
+	stats_lock(kind, NULL, -1);
+	return;
+    }
+    start = stats_now();
+    pthread_mutex_lock(m);
+    stats_lock(kind, NULL, stats_now() - start);
+}
+
+/* Read lock l, counting the acquisition as kind and, if it had to wait,
+ * charging the wait to key (NULL for a database-wide lock) */
+static inline void stats_rdlock(pthread_rwlock_t *l, int kind, char *key) {
+    long start;
+
+    if (pthread_rwlock_tryrdlock(l) == 0) {
+	stats_lock(kind, key, -1);
+	return;
+    }
+    start = stats_now();
+    pthread_rwlock_rdlock(l);
+    stats_lock(kind, key, stats_now() - start);
+}
+
+/* Write lock l, as stats_rdlock */
+static inline void stats_wrlock(pthread_rwlock_t *l, int kind, char *key) {
+    long start;
+
+    if (pthread_rwlock_trywrlock(l) == 0) {
+	stats_lock(kind, key, -1);
+	return;
+    }
+    start = stats_now();
+    pthread_rwlock_wrlock(l);
+    stats_lock(kind, key, stats_now() - start);
+}
+#endif
@@ -0,0 +1,136 @@
+#include "trace.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Bytes a thread collects before writing them out */
+#define TRACE_BUFFER (64 * 1024)
+
+/* One thread's records not yet written.  Only the owner appends, but
+ * trace_stop empties every buffer, so appending is under the buffer's own
+ * mutex, which nobody else wants except then. */
+typedef struct TraceBuffer {
+	pthread_mutex_t mutex_buffer;
+	size_t used;
+	long count;		/* Commands recorded in this trace */
+	char data[TRACE_BUFFER];
+	struct TraceBuffer *next;
+} trace_buffer_t;
+
+int tracing = 0;
+
+/* The trace file, and when it started by stats_now.  Writes to it are
+ * serialized by mutex_file; starting and stopping by mutex_trace. */
+static FILE *file = NULL;
+static long start_ns;
+static pthread_mutex_t mutex_file = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mutex_trace = PTHREAD_MUTEX_INITIALIZER;
+
+/* Buffers of every thread that ever traced.  Only ever pushed onto. */
+static trace_buffer_t *buffers = NULL;
+static __thread trace_buffer_t *self = NULL;
+
+/* Return the calling thread's buffer, creating it on first use */
+static trace_buffer_t *self_buffer() {
+    trace_buffer_t *b;
+
+    if (self) return self;
+    if (!(b = (trace_buffer_t *) malloc(sizeof(trace_buffer_t)))) return NULL;
+    pthread_mutex_init(&b->mutex_buffer, NULL);
+    b->used = 0;
+    b->count = 0;
+    b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+    return self = b;
+}
+
+/* Write out b's records.  The caller holds b's mutex. */
+static void buffer_flush(trace_buffer_t *b) {
+    pthread_mutex_lock(&mutex_file);
+    if (file && b->used) fwrite(b->data, 1, b->used, file);
+    pthread_mutex_unlock(&mutex_file);
+    b->used = 0;
+}
+
+/* Start tracing to path.  Return false if it cannot be created or a trace
+ * is already on. */
+int trace_start(char *path) {
+    trace_header_t header;
+    int ok = 0;
+
+    pthread_mutex_lock(&mutex_trace);
+    if (!tracing && (file = fopen(path, "w"))) {
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.start = time(NULL);
+	fwrite(&header, sizeof(header), 1, file);
+	start_ns = stats_now();
+	__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+	ok = 1;
+    }
+    pthread_mutex_unlock(&mutex_trace);
+    return ok;
+}
+
+/* Stop tracing and close the file.  Return the number of commands traced, or
+ * -1 if there was no trace on. */
+long trace_stop() {
+    trace_buffer_t *b;
+    long n = -1;
+
+    pthread_mutex_lock(&mutex_trace);
+    if (tracing) {
+	/* A command being recorded now finishes before its buffer is
+	 * flushed here; any after see tracing off */
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+	n = 0;
+	for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b; b = b->next) {
+	    pthread_mutex_lock(&b->mutex_buffer);
+	    buffer_flush(b);
+	    n += b->count;
+	    b->count = 0;
+	    pthread_mutex_unlock(&b->mutex_buffer);
+	}
+	fclose(file);
+	file = NULL;
+    }
+    pthread_mutex_unlock(&mutex_trace);
+    return n;
+}
+
+/* Record that client sent command, which started at start (by stats_now) and
+ * got response.  A command that started before the trace did is left out.
+ * Very long commands and responses are cut short so a record always fits in
+ * a buffer. */
+void trace_command(int client, long start, char *command, char *response) {
+    trace_buffer_t *b;
+    trace_record_t rec;
+    size_t clen = strlen(command), rlen = strlen(response);
+    long end = stats_now();
+
+    if (!(b = self_buffer())) return;
+    if (clen > TRACE_BUFFER / 2) clen = TRACE_BUFFER / 2;
+    if (rlen > TRACE_BUFFER / 4) rlen = TRACE_BUFFER / 4;
+    pthread_mutex_lock(&b->mutex_buffer);
+    if (!__atomic_load_n(&tracing, __ATOMIC_ACQUIRE) || start < start_ns) {
+	pthread_mutex_unlock(&b->mutex_buffer);
+	return;
+    }
+    rec.ns = start - start_ns;
+    rec.client = client;
+    rec.latency = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+    rec.command_len = clen;
+    rec.response_len = rlen;
+    if (b->used + sizeof(rec) + clen + rlen > TRACE_BUFFER) buffer_flush(b);
+    memcpy(b->data + b->used, &rec, sizeof(rec));
+    memcpy(b->data + b->used + sizeof(rec), command, clen);
+    memcpy(b->data + b->used + sizeof(rec) + clen, response, rlen);
+    b->used += sizeof(rec) + clen + rlen;
+    b->count++;
+    pthread_mutex_unlock(&b->mutex_buffer);
+}
@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+
+/*
+ * Command traces.  While a trace is on, client_run logs every command it
+ * serves, with the client it came from, when it started and how long it
+ * took, and the response, to a compact binary file.  dbreplay plays a trace
+ * back against a server binary.
+ *
+ * Each worker thread collects records in a buffer of its own and writes the
+ * buffer out when it fills, so tracing takes no shared lock per command and
+ * the file is in order only within each buffer; readers sort by time.
+ *
+ * The file is a trace_header_t and then records: a trace_record_t followed
+ * by command_len bytes of command and response_len bytes of response, with
+ * no NULs.
+ */
+#define TRACE_MAGIC "DBTRACE1"
+
+typedef struct TraceHeader {
+	char magic[8];
+	uint64_t start;		/* Wall clock seconds when the trace started */
+} trace_header_t;
+
+typedef struct TraceRecord {
+	uint64_t ns;		/* Start of the command, since the trace started */
+	uint32_t client;	/* Client it came from, numbered from 1 */
+	uint32_t latency;	/* Nanoseconds it took to serve */
+	uint16_t command_len;
+	uint16_t response_len;
+} __attribute__((packed)) trace_record_t;
+
+/* True while a trace is being written */
+extern int tracing;
+
+/* tracing, for checking on every command without holding anything */
+static inline int trace_on(void) {
+    return __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+}
+
+int trace_start(char *);
+long trace_stop(void);
+void trace_command(int, long, char *, char *);
+#endif
@@ -0,0 +1,337 @@
+#include "db.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "repl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define FNLEN 1024
+
+/* Log records waiting to be written */
+typedef struct Buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+} buffer_t;
+
+int wal_enabled = 0;
+
+static char *wal_dir = NULL;
+
+/* The log is a series of segment files, wal.<n>.  A snapshot is taken after
+ * starting a new segment and records its number; once the snapshot is on disk
+ * the segments before it are deleted. */
+static unsigned long wal_first = 0;	/* Oldest segment still on disk */
+static unsigned long wal_segment = 0;	/* Segment being appended to */
+static int wal_fd = -1;
+
+/* Group commit state.  Appenders fill one buffer while at most one thread,
+ * the flusher, writes and syncs the other; whoever needs a record on disk
+ * and finds no flush under way becomes the flusher. */
+static pthread_mutex_t mutex_wal = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_wal = PTHREAD_COND_INITIALIZER;
+static buffer_t buffers[2];
+static buffer_t *wal_fill = &buffers[0];
+static unsigned long wal_appended = 0;	/* Records appended */
+static unsigned long wal_durable = 0;	/* Records known to be on disk */
+static int wal_flushing = 0;
+
+/* Periodic snapshots */
+static pthread_t snapshot_thread;
+static int snapshot_interval = 0;
+static int snapshot_stop = 0;
+static pthread_mutex_t mutex_snapshot = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_snapshot = PTHREAD_COND_INITIALIZER;
+
+/* Put the name of segment seg in path, which holds FNLEN characters */
+static void segment_name(char *path, unsigned long seg) {
+    snprintf(path, FNLEN, "%s/wal.%08lu", wal_dir, seg);
+}
+
+/* Make renames and new files in the data directory durable */
+static void sync_dir() {
+    int fd;
+
+    if ((fd = open(wal_dir, O_RDONLY)) != -1) {
+	fsync(fd);
+	close(fd);
+    }
+}
+
+/* Open segment seg for appending.  Exits if it cannot: a server that cannot
+ * log cannot promise anything. */
+static int segment_open(unsigned long seg) {
+    char path[FNLEN];
+    int fd;
+
+    segment_name(path, seg);
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) == -1) {
+	perror(path);
+	exit(1);
+    }
+    sync_dir();
+    return fd;
+}
+
+/* Make room for need more characters in the buffer being filled and return
+ * it.  Called with mutex_wal held. */
+static buffer_t *wal_reserve(size_t need) {
+    buffer_t *b = wal_fill;
+    char *ndata;
+
+    if (b->len + need > b->cap) {
+	size_t ncap = b->cap ? 2 * b->cap : 65536;
+
+	while (ncap < b->len + need) ncap *= 2;
+	if (!(ndata = (char *) realloc(b->data, ncap))) {
+	    perror("wal");
+	    exit(1);
+	}
+	b->data = ndata;
+	b->cap = ncap;
+    }
+    return b;
+}
+
+/* The record at offset at of b has been filled in: hand it to the replicas
+ * and, if the log is on disk, number it.  Without a log the record is taken
+ * back out of the buffer, and 0 is returned.  Called with mutex_wal held. */
+static unsigned long wal_record(buffer_t *b, size_t at) {
+    if (repl_publishing) repl_publish(b->data + at, b->len - at);
+    if (wal_fd == -1) {
+	b->len = at;
+	return 0;
+    }
+    return ++wal_appended;
+}
+
+/* Log a successful add (code 'a'), delete ('d') or update ('u') of name.
+ * Return its log sequence number, to hand to wal_commit once the database
+ * lock is released. */
+unsigned long wal_append(char code, char *name, char *value) {
+    size_t need = strlen(name) + (code != 'd' ? strlen(value) : 0) + 5;
+    buffer_t *b;
+    size_t at;
+    unsigned long lsn;
+
+    pthread_mutex_lock(&mutex_wal);
+    b = wal_reserve(need);
+    at = b->len;
+    if (code != 'd')
+	b->len += sprintf(b->data + b->len, "%c %s %s\n", code, name, value);
+    else
+	b->len += sprintf(b->data + b->len, "d %s\n", name);
+    lsn = wal_record(b, at);
+    pthread_mutex_unlock(&mutex_wal);
+    return lsn;
+}
+
+/* Log a command that made several changes at once (an ma or md) as one
+ * record, so replay makes all of them or, if the record is torn, none. */
+unsigned long wal_append_command(char *command) {
+    size_t need = strlen(command) + 1;
+    buffer_t *b;
+    size_t at;
+    unsigned long lsn;
+
+    pthread_mutex_lock(&mutex_wal);
+    b = wal_reserve(need);
+    at = b->len;
+    b->len += sprintf(b->data + b->len, "%s\n", command);
+    lsn = wal_record(b, at);
+    pthread_mutex_unlock(&mutex_wal);
+    return lsn;
+}
+
+/* Write and sync everything appended so far.  Called with mutex_wal held and
+ * no flush under way; the mutex is dropped during the I/O so appends go on
+ * into the other buffer. */
+static void wal_flush() {
+    buffer_t *out = wal_fill;
+    unsigned long upto = wal_appended;
+    size_t done = 0;
+    ssize_t n;
+
+    wal_fill = (out == &buffers[0]) ? &buffers[1] : &buffers[0];
+    wal_fill->len = 0;
+    wal_flushing = 1;
+    pthread_mutex_unlock(&mutex_wal);
+
+    while (done < out->len) {
+	if ((n = write(wal_fd, out->data + done, out->len - done)) == -1) {
+	    if (errno == EINTR) continue;
+	    perror("wal write");
+	    exit(1);
+	}
+	done += n;
+    }
+    if (out->len > 0 && fdatasync(wal_fd) == -1) {
+	perror("wal sync");
+	exit(1);
+    }
+
+    pthread_mutex_lock(&mutex_wal);
+    wal_flushing = 0;
+    wal_durable = upto;
+    pthread_cond_broadcast(&cond_wal);
+}
+
+/* Wait until the record with sequence number lsn is on disk.  lsn 0 (nothing
+ * was logged) returns at once. */
+void wal_commit(unsigned long lsn) {
+    if (lsn == 0) return;
+    pthread_mutex_lock(&mutex_wal);
+    while (wal_durable < lsn) {
+	if (wal_flushing) pthread_cond_wait(&cond_wal, &mutex_wal);
+	else wal_flush();
+    }
+    pthread_mutex_unlock(&mutex_wal);
+}
+
+/* Finish the current segment and start the next.  Return the new segment's
+ * number: every change logged from now on is in it or later ones. */
+static unsigned long wal_rotate() {
+    unsigned long seg;
+
+    pthread_mutex_lock(&mutex_wal);
+    while (wal_flushing || wal_durable < wal_appended) {
+	if (wal_flushing) pthread_cond_wait(&cond_wal, &mutex_wal);
+	else wal_flush();
+    }
+    close(wal_fd);
+    seg = ++wal_segment;
+    wal_fd = segment_open(seg);
+    pthread_mutex_unlock(&mutex_wal);
+    return seg;
+}
+
+/* Replay segment seg into the database.  A record torn by a crash is the
+ * last line and has no newline; it is cut off, since nobody was told it was
+ * done.  Return false if the segment does not exist. */
+static int replay(unsigned long seg) {
+    char path[FNLEN];
+    char response[256];
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    off_t good = 0;
+    FILE *f;
+
+    segment_name(path, seg);
+    if (!(f = fopen(path, "r"))) return 0;
+    while ((n = getline(&line, &cap, f)) > 0 && line[n - 1] == '\n') {
+	good += n;
+	line[n - 1] = '\0';
+	interpret_command(line, response, sizeof(response));
+    }
+    if (n > 0 && truncate(path, good) == -1) perror(path);
+    free(line);
+    fclose(f);
+    return 1;
+}
+
+/* Write a snapshot and drop the log segments it makes unnecessary.  Return
+ * true on success. */
+int wal_snapshot() {
+    static pthread_mutex_t mutex_one = PTHREAD_MUTEX_INITIALIZER;
+    char path[FNLEN], tmp[FNLEN];
+    unsigned long seg;
+    int ok;
+
+    pthread_mutex_lock(&mutex_one);
+    seg = wal_rotate();
+    snprintf(path, FNLEN, "%s/snapshot", wal_dir);
+    snprintf(tmp, FNLEN, "%s/snapshot.tmp", wal_dir);
+    if ((ok = snapshot_write(tmp, seg, 0) && rename(tmp, path) == 0)) {
+	sync_dir();
+	for (; wal_first < seg; wal_first++) {
+	    segment_name(tmp, wal_first);
+	    unlink(tmp);
+	}
+    }
+    pthread_mutex_unlock(&mutex_one);
+    return ok;
+}
+
+/* Body of the snapshot thread: a snapshot every snapshot_interval seconds
+ * until wal_stop */
+static void *snapshot_run(void *arg) {
+    struct timespec when;
+
+    pthread_mutex_lock(&mutex_snapshot);
+    while (!snapshot_stop) {
+	clock_gettime(CLOCK_REALTIME, &when);
+	when.tv_sec += snapshot_interval;
+	while (!snapshot_stop &&
+		pthread_cond_timedwait(&cond_snapshot, &mutex_snapshot, &when) != ETIMEDOUT)
+	    ;
+	if (snapshot_stop) break;
+	pthread_mutex_unlock(&mutex_snapshot);
+	wal_snapshot();
+	pthread_mutex_lock(&mutex_snapshot);
+    }
+    pthread_mutex_unlock(&mutex_snapshot);
+    return NULL;
+}
+
+/*
+ * Recover the database from the snapshot and log in dir, creating dir if
+ * needed, then start logging to it and, if interval is positive, snapshot
+ * every interval seconds.  Call before any client runs.  Return false if the
+ * existing data cannot be read.
+ */
+int wal_start(char *dir, int interval) {
+    char path[FNLEN];
+    unsigned long keys = 0;
+    unsigned long seg = 0;
+
+    wal_dir = dir;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+	perror(dir);
+	return 0;
+    }
+
+    snprintf(path, FNLEN, "%s/snapshot", dir);
+    if (snapshot_load(path, &seg, &keys) == -1) {
+	fprintf(stderr, "%s: damaged snapshot\n", path);
+	return 0;
+    }
+    /* Replay with logging still off */
+    for (wal_first = wal_segment = seg; replay(wal_segment); wal_segment++)
+	;
+    wal_fd = segment_open(wal_segment);
+    wal_enabled = 1;
+    fprintf(stderr, "Recovered %lu snapshot keys and %lu log segments from %s\n",
+	    keys, wal_segment - seg, dir);
+
+    if ((snapshot_interval = interval) > 0 &&
+	    pthread_create(&snapshot_thread, NULL, snapshot_run, NULL)) {
+	perror("snapshot thread");
+	snapshot_interval = 0;
+    }
+    return 1;
+}
+
+/* Stop the snapshot thread and take a last snapshot, so the next start has
+ * no log to replay.  Call once no client is running. */
+void wal_stop() {
+    if (wal_fd == -1) return;
+    if (snapshot_interval > 0) {
+	pthread_mutex_lock(&mutex_snapshot);
+	snapshot_stop = 1;
+	pthread_cond_signal(&cond_snapshot);
+	pthread_mutex_unlock(&mutex_snapshot);
+	pthread_join(snapshot_thread, NULL);
+    }
+    wal_snapshot();
+    wal_enabled = 0;
+    close(wal_fd);
+    wal_fd = -1;
+}
@@ -0,0 +1,29 @@
+#ifndef WAL_H
+#define WAL_H
+/*
+ * Durability for the database: an append-only write-ahead log of the adds,
+ * deletes and updates that succeeded, group committed, and periodic snapshots
+ * (snapshot.c) that let the log be cut short.  A restart loads the newest
+ * snapshot and replays the log written since.  All of this is off unless the
+ * server is given a data directory.
+ *
+ * A change is made and logged under its key's lock (pin_change_begin in
+ * pin.c), so the log has every key's changes in the order they happened even
+ * in the variants that do not serialize writers.  The client is answered
+ * after wal_commit says the record is on disk; everything appended meanwhile,
+ * by any client, goes to disk with the same write and fdatasync.
+ *
+ * The same records are the stream a primary publishes to its replicas
+ * (repl.c), so wal_enabled, which says changes are recorded, is also set
+ * with no log on disk when there are replicas to feed.  Then wal_append
+ * returns 0, which wal_commit does not wait for.
+ */
+extern int wal_enabled;
+
+int wal_start(char *, int);
+void wal_stop(void);
+int wal_snapshot(void);
+unsigned long wal_append(char, char *, char *);
+unsigned long wal_append_command(char *);
+void wal_commit(unsigned long);
+#endif
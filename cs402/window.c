@@ -12,9 +12,18 @@
 #include <signal.h>
 #include <string.h>
 #include <dirent.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 #include "window.h"
 
 #define FNLEN 256
+/* Bytes of input to ask for in one read */
+#define WINDOW_READ 4096
+/* Longest frame a client may send.  The longest command, a multi of
+ * MULTI_MAX adds of 255-byte names and values, is about 16 KB; a length
+ * beyond this is an error, not a reason to buffer up to 4 GB. */
+#define WINDOW_MAX_FRAME 32768
 
 /* Number of windows created so far.  Used to keep fifo names distinct */
 int window_count = 0;
@@ -61,6 +70,25 @@ static int create_fifos(window_t *new_window) {
     return 1;
 }
 
+/* Make reads of the window's input return at once when nothing is waiting.
+ * This matters for fifos; a regular file always has input or end of file. */
+static void set_nonblock(window_t *window) {
+    int fd = window_fd(window);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* Make writes of responses to a fifo return at once when its reader is not
+ * keeping up, so the worker that writes them is not stalled: they wait in
+ * obuf instead (window_flush).  A regular file always takes them. */
+static void set_out_nonblock(window_t *window) {
+    int fd = fileno(window->out);
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
 /* Create a window to communicate with an interface process (see interface.c)
  * running under an xterm (which this function also starts).  If anything
  * fails, return a NULL pointer.
@@ -76,6 +104,12 @@ window_t *window_create(char *label) {
     new_window->out = 0;
     new_window->pid = -1;
     new_window->echo = 0;
+    new_window->framed = 0;
+    new_window->bad = 0;
+    new_window->buf = NULL;
+    new_window->cap = new_window->len = new_window->pos = 0;
+    new_window->obuf = NULL;
+    new_window->ocap = new_window->olen = 0;
 
     if (!create_fifos(new_window)) goto fail;
     window_count++;
@@ -110,6 +144,8 @@ window_t *window_create(char *label) {
 	 */
 	if (!(new_window->in = fopen(new_window->ififo, "r"))) goto fail;
 	if (!(new_window->out = fopen(new_window->ofifo, "w"))) goto fail;
+	set_nonblock(new_window);
+	set_out_nonblock(new_window);
     }
     return new_window;
 
@@ -132,15 +168,57 @@ window_t *nowindow_create(char *infn, char *outfn) {
     new_window->ofifo = NULL;
     new_window->pid = -1;
     new_window->echo = 1;
+    new_window->framed = 0;
+    new_window->bad = 0;
+    new_window->buf = NULL;
+    new_window->cap = new_window->len = new_window->pos = 0;
+    new_window->obuf = NULL;
+    new_window->ocap = new_window->olen = 0;
     if ( !(new_window->in = fopen(infn, "r")) || 
 	    !(new_window->out = fopen(outfn, "w"))) {
 	window_destroy(new_window);
 	return NULL;
     }
+    set_nonblock(new_window);
+    set_out_nonblock(new_window);
     window_count++;
     return new_window;
 }
 
+/* Create a window for a client connected to the server's socket, using the
+ * binary protocol: every command and every response is a frame, a 32-bit
+ * length in network byte order followed by that many bytes.  A client can
+ * send any number of commands before reading, and gets exactly one response
+ * frame per command, in order.  Neither direction ever blocks the server: a
+ * client that does not read its responses just has them wait in the window
+ * (see window_flush).  The window owns fd. */
+window_t *socket_window_create(int fd) {
+    window_t *new_window = (window_t *) malloc(sizeof(window_t));
+
+    if (!new_window) {
+	close(fd);
+	return 0;
+    }
+    new_window->ififo = NULL;
+    new_window->ofifo = NULL;
+    new_window->pid = -1;
+    new_window->echo = 0;
+    new_window->framed = 1;
+    new_window->bad = 0;
+    new_window->buf = NULL;
+    new_window->cap = new_window->len = new_window->pos = 0;
+    new_window->obuf = NULL;
+    new_window->ocap = new_window->olen = 0;
+    /* Responses are sent from obuf, not through a stream */
+    new_window->out = NULL;
+    if (!(new_window->in = fdopen(fd, "r"))) {
+	close(fd);
+	free(new_window);
+	return NULL;
+    }
+    return new_window;
+}
+
 /*
  * Release window resources.  If fifos were created, delete them, if a process
  * was created, terminate it, close open files.  Release memory, including win.
@@ -152,25 +230,187 @@ void window_destroy(window_t * win) {
     if (win->ofifo) { unlink(win->ofifo); free(win->ofifo);win->ofifo = NULL; }
     if (win->in) { fclose(win->in); win->in = NULL; }
     if (win->out) { fclose(win->out); win->out = NULL; }
+    if (win->buf) { free(win->buf); win->buf = NULL; }
+    if (win->obuf) { free(win->obuf); win->obuf = NULL; }
     free(win);
 }
 
-/* The main interface for the server to interact with a window.  If query
- * points to a string (a non-NULL char *) and the window has echo set, print
- * that query to the output connection.  If response is longer than zero, print
- * that too.  Then wait for the next command.  getline will manage memory for
- * arbitrary sized queries.  This is safe to call from a thread *if* that is
- * the only thread with access to window and the other parameters.
- *
- * The function returns the return code of getline - notably -1 on end of input.
+/*
+ * The server interacts with a window without blocking: it reads whatever
+ * input is waiting with window_read, hands out the complete commands in it
+ * with window_next_command, and writes each result with window_respond.
+ * The input descriptor (window_fd) is made non-blocking when it is a fifo, and
+ * socket reads do not wait, so the server can wait for many windows at once
+ * with epoll.  These are safe to
+ * call from a thread *if* that is the only thread using the window at the
+ * time.
  */
-int serve(window_t * window, char *response, char **query, size_t *qlen) {
-    if ( window->echo && *query) 
-	fprintf(window->out, ">> %s", *query);
-    if (strlen(response) > 0 ) 
-	fprintf(window->out, "%s\n", response);
-    fflush(window->out);
-    return getline(query, qlen, window->in);
+
+/* The descriptor to watch for input */
+int window_fd(window_t *window) {
+    return fileno(window->in);
+}
+
+/* The descriptor responses are written to, to watch when window_flush could
+ * not send them all */
+int window_out_fd(window_t *window) {
+    return window->framed ? window_fd(window) : fileno(window->out);
+}
+
+/* Read the input waiting on the window, with one read (2), into the window's
+ * buffer.  Returns what read (2) does: the number of bytes read, 0 at end of
+ * input, or -1 (errno EAGAIN if nothing is waiting yet). */
+int window_read(window_t *window) {
+    ssize_t n;
+
+    /* Slide the unconsumed input to the front, and make room for more */
+    if (window->pos > 0) {
+	memmove(window->buf, window->buf + window->pos, window->len - window->pos);
+	window->len -= window->pos;
+	window->pos = 0;
+    }
+    if (window->cap - window->len < WINDOW_READ + 1) {
+	size_t ncap = window->len + WINDOW_READ + 1;
+	char *nbuf;
+
+	if (ncap < 2 * window->cap) ncap = 2 * window->cap;
+	if (!(nbuf = (char *) realloc(window->buf, ncap))) return -1;
+	window->buf = nbuf;
+	window->cap = ncap;
+    }
+    /* A socket is left blocking for the responses, so ask recv not to wait */
+    if (window->framed)
+	n = recv(window_fd(window), window->buf + window->len,
+		window->cap - window->len - 1, MSG_DONTWAIT);
+    else
+	n = read(window_fd(window), window->buf + window->len,
+		window->cap - window->len - 1);
+    if (n > 0)
+	window->len += n;
+    return n;
+}
+
+/* Return the next complete command in the window's buffer, without its
+ * newline, or NULL if there is none yet.  At end of input (eof true) an
+ * unterminated last line counts as complete; a partial frame never does.
+ * A frame longer than WINDOW_MAX_FRAME marks the window bad, and nothing
+ * more is handed out: the client should be dropped.  The string is valid
+ * until the next window_read. */
+char *window_next_command(window_t *window, int eof) {
+    char *start = window->buf + window->pos;
+    char *nl;
+    uint32_t flen;
+
+    if (window->framed) {
+	if (window->len - window->pos < sizeof(flen)) return NULL;
+	memcpy(&flen, start, sizeof(flen));
+	flen = ntohl(flen);
+	if (flen > WINDOW_MAX_FRAME) {
+	    window->bad = 1;
+	    window->pos = window->len;
+	    return NULL;
+	}
+	if (window->len - window->pos - sizeof(flen) < flen) return NULL;
+	/* Slide the command over its length so there is room for a NUL */
+	memmove(start, start + sizeof(flen), flen);
+	start[flen] = '\0';
+	window->pos += sizeof(flen) + flen;
+	return start;
+    }
+
+    if (window->pos >= window->len) return NULL;
+    if ((nl = memchr(start, '\n', window->len - window->pos))) {
+	*nl = '\0';
+	window->pos = nl - window->buf + 1;
+	return start;
+    }
+    if (!eof) return NULL;
+    window->buf[window->len] = '\0';
+    window->pos = window->len;
+    return start;
+}
+
+/* Make room for need more bytes of responses.  Return false if there is
+ * none. */
+static int obuf_reserve(window_t *window, size_t need) {
+    char *nobuf;
+
+    need += window->olen;
+    if (need > window->ocap) {
+	size_t ncap = window->ocap ? 2 * window->ocap : WINDOW_READ;
+
+	while (ncap < need) ncap *= 2;
+	if (!(nobuf = (char *) realloc(window->obuf, ncap))) return 0;
+	window->obuf = nobuf;
+	window->ocap = ncap;
+    }
+    return 1;
+}
+
+/* Add len bytes of data to the responses waiting in obuf */
+static void obuf_append(window_t *window, char *data, size_t len) {
+    memcpy(window->obuf + window->olen, data, len);
+    window->olen += len;
+}
+
+/* Report the result of command.  If the window has echo set, print the
+ * command first.  Output is buffered until window_flush, so a client that
+ * sent several commands at once gets all the answers in one write. */
+void window_respond(window_t *window, char *command, char *response) {
+    size_t rlen = strlen(response);
+    uint32_t flen;
+
+    if (window->framed) {
+	/* Every command gets a frame, even an empty one */
+	if (!obuf_reserve(window, sizeof(flen) + rlen)) return;
+	flen = htonl(rlen);
+	obuf_append(window, (char *) &flen, sizeof(flen));
+	obuf_append(window, response, rlen);
+	return;
+    }
+    if (!obuf_reserve(window, (window->echo ? strlen(command) + 4 : 0) +
+		rlen + 1))
+	return;
+    if (window->echo) {
+	obuf_append(window, ">> ", 3);
+	obuf_append(window, command, strlen(command));
+	obuf_append(window, "\n", 1);
+    }
+    if (rlen > 0) {
+	obuf_append(window, response, rlen);
+	obuf_append(window, "\n", 1);
+    }
+}
+
+/* Send the buffered responses.  A socket or fifo is only written as far as
+ * it takes without waiting; return the number of bytes still to send, which
+ * the caller should retry once window_out_fd is writable.  If the client has
+ * gone away its responses are dropped. */
+int window_flush(window_t *window) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < window->olen) {
+	if (window->framed)
+	    n = send(window_fd(window), window->obuf + done,
+		    window->olen - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+	else
+	    n = write(window_out_fd(window), window->obuf + done,
+		    window->olen - done);
+	if (n > 0)
+	    done += n;
+	else if (n == -1 && errno == EINTR)
+	    continue;
+	else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break;
+	else {
+	    done = window->olen;
+	    break;
+	}
+    }
+    memmove(window->obuf, window->obuf + done, window->olen - done);
+    window->olen -= done;
+    return window->olen;
 }
 
 /* Cleanup the tmp dir.  Remove all the fifos in it and then remove tmpdir.
@@ -5,10 +5,25 @@ typedef struct window {
 	char *ififo;
 	char *ofifo;
 	int echo;
+	int framed;	/* Length-prefixed binary protocol (socket clients) */
+	int bad;	/* Sent a frame too long to accept */
+	char *buf;	/* Input read but not yet handed out as commands */
+	size_t cap;	/* Size of buf */
+	size_t len;	/* Bytes of input in buf */
+	size_t pos;	/* Start of the next command in buf */
+	char *obuf;	/* Responses not yet sent */
+	size_t ocap;	/* Size of obuf */
+	size_t olen;	/* Bytes of responses in obuf */
 } window_t;
 
 window_t *window_create(char *);
 window_t *nowindow_create(char *, char *);
+window_t *socket_window_create(int);
 void window_destroy(window_t *);
-int serve(window_t *, char *, char **, size_t*);
+int window_fd(window_t *);
+int window_out_fd(window_t *);
+int window_read(window_t *);
+char *window_next_command(window_t *, int);
+void window_respond(window_t *, char *, char *);
+int window_flush(window_t *);
 void window_cleanup();
@@ -24,7 +24,7 @@ Name: Sean Saleh
 #endif
 
 #pragma region one
-#define MAX_TRIANGLES 2000
+#define MAX_TRIANGLES 200000
 #define MAX_SPHERES 10
 #define MAX_LIGHTS 10
 
@@ -158,18 +158,6 @@ void vector3_cross(double *in1, double *in2, double *output) {
 	output[2] = in1[0]*in2[1] - in1[1] * in2[0];
 }
 
-double vector3_tri_area (double *a, double *b, double *c) {
-		//Area is |AxB|
-		//So area_opposite_p0 = |(p2-p1)x(h-p1)|/2
-	//   area_opposite_p1 = |(p0-p2)x(h-p2)|/2
-	//   area_opposite_p2 = |(p1-p0)x(h-p0)|/2
-	//   area_total = |(p1-p0)x(p2-p0)|/2
-	double b_a[3];	 vector3_minus(b,a, b_a);
-	double c_a[3];	 vector3_minus(c,a, c_a);
-	double area[3];  vector3_cross(b_a, c_a, area);
-	return sqrt(area[0]*area[0] + area[1]*area[1] + area[2]*area[2])/2.f;
-}
-
 /*Assume that return_color has some value */
 void sphere_phong_color(double * hit_location, double* light_position, double * sphere_position, double * return_color, double * light_color, double * color_diffuse, double *color_specular, double shininess) {
 	double color = 0.0f;
@@ -210,7 +198,7 @@ void sphere_phong_color(double * hit_location, double* light_position, double *
 	return_color[2] += light_color[2] * (color_diffuse[2] * (l_dot_n) + color_specular[2] * pow(r_dot_v,shininess));
 }
 
-void triangle_phong_color(double * hit_location, double* light_position, Triangle * triangle, double * return_color, double * light_color) {
+void triangle_phong_color(double * hit_location, double* light_position, Triangle * triangle, double * barycentric, double * return_color, double * light_color) {
 	double color = 0.0f;
 
 	double color_diffuse[3];
@@ -220,19 +208,10 @@ void triangle_phong_color(double * hit_location, double* light_position, Triangl
 	double normal[3];
 
 	//CORRECT math is to do the area% opposite the vertex is how much of that vertex is used
-
-	//Area is |AxB|/2
-	//So area_opposite_p0 = |(p2-p1)x(h-p1)|/2
-	//   area_opposite_p1 = |(p0-p2)x(h-p2)|/2
-	//   area_opposite_p2 = |(p1-p0)x(h-p0)|/2
-	//   area_total = |(p1-p0)x(p2-p0)|/2
-	//
-	//Call area 4 times, then take area / area total
-	double total_area = vector3_tri_area(triangle->v[0].position, triangle->v[1].position, triangle->v[2].position);
-
-	double percent_p0 = vector3_tri_area(triangle->v[1].position, triangle->v[2].position, hit_location) / total_area;
-	double percent_p1 = vector3_tri_area(triangle->v[2].position, triangle->v[0].position, hit_location)/ total_area;
-	double percent_p2 = vector3_tri_area(triangle->v[0].position, triangle->v[1].position, hit_location)/ total_area;
+	//Those are the barycentric weights of the hit, which the intersection test already found
+	double percent_p0 = barycentric[0];
+	double percent_p1 = barycentric[1];
+	double percent_p2 = barycentric[2];
 
 	normal[0] = percent_p0 * triangle->v[0].normal[0] + percent_p1 * triangle->v[1].normal[0] + percent_p2 * triangle->v[2].normal[0];
 	normal[1] = percent_p0 * triangle->v[0].normal[1] + percent_p1 * triangle->v[1].normal[1] + percent_p2 * triangle->v[2].normal[1];
@@ -283,116 +262,389 @@ void triangle_phong_color(double * hit_location, double* light_position, Triangl
 	
 }
 
-/*TODO*/
-Triangle * collide_triangle(double *direction, double * distance_out, double * translation) {
-	Triangle * cur_triangle = NULL;
-	double normal_ray[3];
+/*
+The triangles again, ready for intersection tests: built once in loadScene(), since none of it depends
+on the ray. One array per component (structure of arrays), holding the first vertex, the edges from it to
+the other two and the plane normal e1 x e2, which is left unnormalized.
+*/
+struct TriangleTests
+{
+  double v0[3][MAX_TRIANGLES];
+  double e1[3][MAX_TRIANGLES];
+  double e2[3][MAX_TRIANGLES];
+  double normal[3][MAX_TRIANGLES];
+} triangle_tests;
+
+void precompute_triangle(int i) {
+	double e1[3];	 vector3_minus(triangles[i].v[1].position, triangles[i].v[0].position, e1);
+	double e2[3];	 vector3_minus(triangles[i].v[2].position, triangles[i].v[0].position, e2);
+	double n[3];	 vector3_cross(e1, e2, n);
+	for (int a = 0; a < 3; a++) {
+		triangle_tests.v0[a][i] = triangles[i].v[0].position[a];
+		triangle_tests.e1[a][i] = e1[a];
+		triangle_tests.e2[a][i] = e2[a];
+		triangle_tests.normal[a][i] = n[a];
+	}
+}
 
-	double transformed_direction[3];
-	transformed_direction[0] = direction[0] - translation[0];
-	transformed_direction[1] = direction[1] - translation[1];
-	transformed_direction[2] = direction[2] - translation[2];
-	normalize3d(transformed_direction, transformed_direction);
-
-	for(int x = 0; x < num_triangles; x++) {
-		//Get intersection point with polygon
-		//t = -(o-p)_dot_n/n_dot_d
-		//n_dot_d == 0
-		double n[3];
-		double p1_p0[3];	 vector3_minus(triangles[x].v[1].position,triangles[x].v[0].position,p1_p0);
-		double p2_p0[3];	 vector3_minus(triangles[x].v[2].position,triangles[x].v[0].position,p2_p0);
-		vector3_cross(p1_p0, p2_p0, n);
-		normalize3d(n, n);
-		double n_dot_d = dot_product(n,transformed_direction);
-		if (!(n_dot_d < 0.000001f && n_dot_d > 0.000001f)) { //If n_dot_p is zero, then this triangle is parallel to ray
-			double origin_minus_p[3]; //Check here if erroring, it could be the other way around?
-			origin_minus_p[0] = translation[0] - triangles[x].v[0].position[0];
-			origin_minus_p[1] = translation[1] - triangles[x].v[0].position[1];
-			origin_minus_p[2] = translation[2] - triangles[x].v[0].position[2];
-			double o_minus_p_dot_n = dot_product(origin_minus_p, n);
-			double t = - o_minus_p_dot_n/n_dot_d;
-			if (t>-.0000001f && t < .0000001f)
-				t = 0.f;
-			if (t>0.f) { //If the hit location is in front of us
-				double hit[3];
-				hit[0] = translation[0] + t * transformed_direction[0];
-				hit[1] = translation[1] + t * transformed_direction[1];
-				hit[2] = translation[2] + t * transformed_direction[2];
-				/* From math for checking if triangles are to the left of the lines so it is on the plane
-				(p1-p0)cross(hit-p0)dot n>=0
-				(p2-p1)cross(hit-p1)dot n>=0
-				(p0-p2)cross(hit-p2)dot n>=0
-				*/
-				/*This is already defined above *///double p1_p0[3];	 vector3_minus(triangles[x].v[1].position,triangles[x].v[0].position,p1_p0);
-				double p2_p1[3];	 vector3_minus(triangles[x].v[2].position,triangles[x].v[1].position,p2_p1);
-				double p0_p2[3];	 vector3_minus(triangles[x].v[0].position,triangles[x].v[2].position,p0_p2);
-				double hit_p1[3];	 vector3_minus(hit, triangles[x].v[0].position, hit_p1);
-				double hit_p2[3];	 vector3_minus(hit, triangles[x].v[1].position, hit_p2);
-				double hit_p3[3];	 vector3_minus(hit, triangles[x].v[2].position, hit_p3);
-				 
-				double cross_1[3];	 vector3_cross(p1_p0,hit_p1,cross_1);
-				double cross_2[3];	 vector3_cross(p2_p1,hit_p2,cross_2);
-				double cross_3[3];	 vector3_cross(p0_p2,hit_p3,cross_3);
-
-				if (dot_product(cross_1, n) >=0.0f && dot_product(cross_2, n) >=0.0f && dot_product(cross_3, n) >=0.0f) {
-					if (t<*distance_out) {
-						*distance_out = t;
-						cur_triangle = &triangles[x];
-					}
-				}
+/*
+Moller-Trumbore: returns whether the ray from origin along ray (normalized) hits triangle i in front of
+the origin and nearer than max_t, with the distance and the barycentric weights of vertices 1 and 2.
+With the normal precomputed the determinant and t are a dot product each, so rays that miss the plane's
+range are turned away before the one cross product:
+  det = -d.n    t = (o-v0).n/det    u = e2.((o-v0)xd)/det    v = -e1.((o-v0)xd)/det
+*/
+bool intersect_triangle(int i, double * origin, double * ray, double max_t, double * t_out, double * u_out, double * v_out) {
+	double det = -(ray[0]*triangle_tests.normal[0][i] + ray[1]*triangle_tests.normal[1][i] + ray[2]*triangle_tests.normal[2][i]);
+	if (det == 0.0) //The ray is parallel to the triangle
+		return false;
+	double inverse_det = 1.0 / det;
+
+	double o_v0[3];
+	o_v0[0] = origin[0] - triangle_tests.v0[0][i];
+	o_v0[1] = origin[1] - triangle_tests.v0[1][i];
+	o_v0[2] = origin[2] - triangle_tests.v0[2][i];
+	double t = (o_v0[0]*triangle_tests.normal[0][i] + o_v0[1]*triangle_tests.normal[1][i] + o_v0[2]*triangle_tests.normal[2][i]) * inverse_det;
+	if (t < .0000001f || t >= max_t) //Behind us (or where we start), or past something closer
+		return false;
+
+	double c[3];	 vector3_cross(o_v0, ray, c);
+	double u = (triangle_tests.e2[0][i]*c[0] + triangle_tests.e2[1][i]*c[1] + triangle_tests.e2[2][i]*c[2]) * inverse_det;
+	if (u < 0.0 || u > 1.0)
+		return false;
+	double v = -(triangle_tests.e1[0][i]*c[0] + triangle_tests.e1[1][i]*c[1] + triangle_tests.e1[2][i]*c[2]) * inverse_det;
+	if (v < 0.0 || u + v > 1.0)
+		return false;
+
+	*t_out = t;
+	*u_out = u;
+	*v_out = v;
+	return true;
+}
+
+/*Returns whether the ray from origin along ray (normalized) hits the sphere in front of the origin, and the nearest such distance*/
+bool intersect_sphere(Sphere * sphere, double * origin, double * ray, double * t_out) {
+	/*This math from the slides for ray-sphere intersection*/
+	double b = 2 * (ray[0]*(origin[0]-sphere->position[0]) + ray[1]*(origin[1]-sphere->position[1]) + ray[2]*(origin[2]-sphere->position[2]));
+	double c = (origin[0]-sphere->position[0])*(origin[0]-sphere->position[0]) + (origin[1]-sphere->position[1])*(origin[1]-sphere->position[1]) + (origin[2]-sphere->position[2])*(origin[2]-sphere->position[2]) - sphere->radius*sphere->radius;
+	double inside = b*b - 4 * c;
+
+	if (inside <0) //Unreal answer, abort
+		return false;
+	double t0 = (-b + sqrt(inside))/2;
+	double t1 = (-b - sqrt(inside))/2;
+	if (t0>-0.0001f && t0 <= 0.0001f)
+		t0 = 0.0f;
+	if (t1>-0.0001f && t1 < 0.0001f)
+		t1 = 0.0f; 
+	/*Note, if the ray is cast from within the sphere, it will hit that sphere*/
+	if (t1 > 0.f && (t1 < t0 || t0 <= 0.f))
+		t0 = t1;
+	if (t0 <= 0.f)
+		return false;
+	*t_out = t0;
+	return true;
+}
+
+/*
+Bounding volume hierarchy over all the triangles and spheres, so a ray only tests the objects
+in the boxes it passes through instead of every object in the scene.
+
+Objects are numbered with the triangles first: object i is triangles[i] if i < num_triangles,
+else spheres[i - num_triangles]. The tree is built once after the scene is loaded, splitting
+each node where the surface area heuristic (SAH) says rays will be cheapest to trace, and is
+stored depth first: an inner node's first child comes right after it.
+*/
+#define MAX_OBJECTS (MAX_TRIANGLES + MAX_SPHERES)
+#define BVH_BINS 16			//Candidate split planes tried per axis are the edges of this many bins
+#define BVH_LEAF_SIZE 2		//Nodes this small are not split any further
+#define BVH_MAX_LEAF_SIZE 8	//Nodes bigger than this are split even where the SAH says not to
+#define BVH_MAX_DEPTH 64	//Also bounds the traversal stack
+#define BVH_TRAVERSAL_COST 1.0	//Cost of visiting a node, relative to intersecting an object
+
+typedef struct _BVHNode
+{
+  double min[3];
+  double max[3];
+  int first;	//Leaf: first of its objects in bvh_objects. Inner node: its second child
+  int count;	//Objects in a leaf, 0 for an inner node
+  int axis;		//Axis an inner node was split on
+} BVHNode;
+
+typedef struct _BVHBuildObject
+{
+  double min[3];
+  double max[3];
+  double center[3];
+} BVHBuildObject;
+
+BVHNode bvh_nodes[2 * MAX_OBJECTS];
+int bvh_objects[MAX_OBJECTS];
+int num_bvh_nodes = 0;
+
+double box_area(double *min, double *max) {
+	double d[3];	 vector3_minus(max, min, d);
+	return 2 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+void box_grow(double *min, double *max, double *add_min, double *add_max) {
+	for (int a = 0; a < 3; a++) {
+		if (add_min[a] < min[a]) min[a] = add_min[a];
+		if (add_max[a] > max[a]) max[a] = add_max[a];
+	}
+}
+
+void box_empty(double *min, double *max) {
+	for (int a = 0; a < 3; a++) {
+		min[a] = 1e300;
+		max[a] = -1e300;
+	}
+}
+
+int bvh_bin(double center, double low, double extent) {
+	int bin = (int)(BVH_BINS * (center - low) / extent);
+	return bin < BVH_BINS ? bin : BVH_BINS - 1;
+}
+
+/*Builds the subtree at node over the count objects from bvh_objects[first]*/
+void bvh_build_node(int node, int first, int count, int depth, BVHBuildObject *objects) {
+	BVHNode *n = &bvh_nodes[node];
+	double center_min[3], center_max[3];
+
+	box_empty(n->min, n->max);
+	box_empty(center_min, center_max);
+	for (int i = first; i < first + count; i++) {
+		box_grow(n->min, n->max, objects[bvh_objects[i]].min, objects[bvh_objects[i]].max);
+		box_grow(center_min, center_max, objects[bvh_objects[i]].center, objects[bvh_objects[i]].center);
+	}
+	n->first = first;
+	n->count = count;
+	n->axis = 0;
+	if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH)
+		return;
+
+	//Try every bin edge on every axis: a split costs a visit plus the objects on each side weighted by
+	//the chance a ray through this node passes through that side's box, which is proportional to its area
+	double area = box_area(n->min, n->max);
+	double best_cost = 1e300;
+	int best_axis = -1, best_split = 0;
+	if (area <= 0.0)
+		area = 1e-300;
+	for (int a = 0; a < 3; a++) {
+		double extent = center_max[a] - center_min[a];
+		if (extent <= 0.0)
+			continue;
+
+		int bin_count[BVH_BINS] = {0};
+		double bin_min[BVH_BINS][3], bin_max[BVH_BINS][3];
+		for (int b = 0; b < BVH_BINS; b++)
+			box_empty(bin_min[b], bin_max[b]);
+		for (int i = first; i < first + count; i++) {
+			BVHBuildObject *o = &objects[bvh_objects[i]];
+			int b = bvh_bin(o->center[a], center_min[a], extent);
+			bin_count[b]++;
+			box_grow(bin_min[b], bin_max[b], o->min, o->max);
+		}
+
+		//Sweep from the right to get the cost of everything right of each edge, then from the left
+		double right_cost[BVH_BINS];
+		double min[3], max[3];
+		int seen = 0;
+		box_empty(min, max);
+		for (int b = BVH_BINS - 1; b > 0; b--) {
+			seen += bin_count[b];
+			box_grow(min, max, bin_min[b], bin_max[b]);
+			right_cost[b] = seen ? seen * box_area(min, max) : 0.0;
+		}
+		seen = 0;
+		box_empty(min, max);
+		for (int b = 0; b < BVH_BINS - 1; b++) {
+			seen += bin_count[b];
+			box_grow(min, max, bin_min[b], bin_max[b]);
+			if (seen == 0 || seen == count)
+				continue;
+			double cost = BVH_TRAVERSAL_COST + (seen * box_area(min, max) + right_cost[b + 1]) / area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = a;
+				best_split = b + 1;
 			}
 		}
 	}
-	return cur_triangle;
+	//Staying a leaf costs an intersection per object. A big node is split anyway: a few large objects
+	//at both ends can make every split look as bad as none, and splitting again separates them
+	if (best_axis == -1 || (best_cost >= count && count <= BVH_MAX_LEAF_SIZE))
+		return;
+
+	//Objects in the bins left of the split go first
+	double extent = center_max[best_axis] - center_min[best_axis];
+	int middle = first;
+	for (int i = first; i < first + count; i++) {
+		if (bvh_bin(objects[bvh_objects[i]].center[best_axis], center_min[best_axis], extent) < best_split) {
+			int swap = bvh_objects[i];
+			bvh_objects[i] = bvh_objects[middle];
+			bvh_objects[middle++] = swap;
+		}
+	}
+
+	n->count = 0;
+	n->axis = best_axis;
+	bvh_build_node(num_bvh_nodes++, first, middle - first, depth + 1, objects);
+	n->first = num_bvh_nodes++;
+	bvh_build_node(n->first, middle, first + count - middle, depth + 1, objects);
 }
 
-Sphere* collide_sphere(double * direction, double * distance_out, double * translation){
-	Sphere * cur_sphere = NULL;
-	double normal_ray[3];
+/*Puts entry order[i] of one of triangle_tests' arrays at i*/
+void reorder_column(double *entries, int *order, double *scratch) {
+	for (int i = 0; i < num_triangles; i++)
+		scratch[i] = entries[order[i]];
+	memcpy(entries, scratch, num_triangles * sizeof(double));
+}
 
-	double transformed_direction[3];
-	transformed_direction[0] = direction[0] - translation[0];
-	transformed_direction[1] = direction[1] - translation[1];
-	transformed_direction[2] = direction[2] - translation[2];
-	normalize3d(transformed_direction, normal_ray);
-
-	for(int x = 0; x < num_spheres; x++) {
-		/*This math from the slides for ray-sphere intersection*/
-		double b = 2 * (normal_ray[0]*(translation[0]-spheres[x].position[0]) + normal_ray[1]*(translation[1]-spheres[x].position[1]) + normal_ray[2]*(translation[2]-spheres[x].position[2]));
-		double c = (translation[0]-spheres[x].position[0])*(translation[0]-spheres[x].position[0]) + (translation[1]-spheres[x].position[1])*(translation[1]-spheres[x].position[1]) + (translation[2]-spheres[x].position[2])*(translation[2]-spheres[x].position[2]) - spheres[x].radius*spheres[x].radius;
-		double inside = b*b - 4 * c;
-
-		if (inside >=0) { //Else unreal answer, abort
-			double t0 = (-b + sqrt(inside))/2;
-			double t1 = (-b - sqrt(inside))/2;
-			if (t0>-0.0001f && t0 <= 0.0001f)
-				t0 = 0.0f;
-			if (t1>-0.0001f && t1 < 0.0001f)
-				t1 = 0.0f; 
-			/*Note, if the ray is cast from within the sphere, it will hit that sphere*/
-			if (t0 > 0.f && t0 < *distance_out) { //If Closer
-				*distance_out = t0;
-				cur_sphere = &spheres[x];
+/*Builds the hierarchy over the loaded scene. Call once after loadScene()*/
+void build_bvh() {
+	int num_objects = num_triangles + num_spheres;
+	BVHBuildObject *objects = (BVHBuildObject *) malloc((num_objects ? num_objects : 1) * sizeof(BVHBuildObject));
+
+	for (int i = 0; i < num_triangles; i++) {
+		box_empty(objects[i].min, objects[i].max);
+		for (int j = 0; j < 3; j++)
+			box_grow(objects[i].min, objects[i].max, triangles[i].v[j].position, triangles[i].v[j].position);
+		for (int a = 0; a < 3; a++)
+			objects[i].center[a] = (triangles[i].v[0].position[a] + triangles[i].v[1].position[a] + triangles[i].v[2].position[a]) / 3;
+	}
+	for (int i = 0; i < num_spheres; i++) {
+		BVHBuildObject *o = &objects[num_triangles + i];
+		for (int a = 0; a < 3; a++) {
+			o->min[a] = spheres[i].position[a] - spheres[i].radius;
+			o->max[a] = spheres[i].position[a] + spheres[i].radius;
+			o->center[a] = spheres[i].position[a];
+		}
+	}
+	for (int i = 0; i < num_objects; i++)
+		bvh_objects[i] = i;
+
+	num_bvh_nodes = 1;
+	bvh_build_node(0, 0, num_objects, 0, objects);
+	free(objects);
+
+	//Renumber the triangles in the order the leaves hold them, so the tests of a leaf's triangles read
+	//neighbouring entries of triangle_tests instead of ones scattered over the whole scene
+	int *order = (int *) malloc((num_triangles ? num_triangles : 1) * sizeof(int));
+	int next = 0;
+	for (int i = 0; i < num_objects; i++) {
+		if (bvh_objects[i] < num_triangles) {
+			order[next] = bvh_objects[i];
+			bvh_objects[i] = next++;
+		}
+	}
+	Triangle *sorted = (Triangle *) malloc((num_triangles ? num_triangles : 1) * sizeof(Triangle));
+	for (int i = 0; i < num_triangles; i++)
+		sorted[i] = triangles[order[i]];
+	memcpy(triangles, sorted, num_triangles * sizeof(Triangle));
+	free(sorted);
+	double *column = (double *) malloc((num_triangles ? num_triangles : 1) * sizeof(double));
+	for (int a = 0; a < 3; a++) {
+		reorder_column(triangle_tests.v0[a], order, column);
+		reorder_column(triangle_tests.e1[a], order, column);
+		reorder_column(triangle_tests.e2[a], order, column);
+		reorder_column(triangle_tests.normal[a], order, column);
+	}
+	free(column);
+	free(order);
+	printf("BVH: %d nodes over %d objects\n", num_bvh_nodes, num_objects);
+}
+
+/*Returns whether the ray enters the box before max_distance. inverse_ray is 1/ray per axis*/
+bool ray_hits_box(BVHNode *node, double *origin, double *inverse_ray, double max_distance) {
+	double near_t = 0.0, far_t = max_distance;
+	for (int a = 0; a < 3; a++) {
+		double t0 = (node->min[a] - origin[a]) * inverse_ray[a];
+		double t1 = (node->max[a] - origin[a]) * inverse_ray[a];
+		if (t0 > t1) {
+			double swap = t0; t0 = t1; t1 = swap;
+		}
+		if (t0 > near_t) near_t = t0;
+		if (t1 < far_t) far_t = t1;
+		if (near_t > far_t)
+			return false;
+	}
+	return true;
+}
+
+/*
+Finds the closest object the ray from translation towards direction hits nearer than *distance_out,
+setting *distance_out and either *hit_triangle, with the hit's barycentric weights, or *hit_sphere. If
+any_hit, returns as soon as any such object is found, which is all a shadow ray needs to know. Returns
+whether something was hit.
+*/
+bool collide_scene(double *direction, double * distance_out, double * translation, Triangle **hit_triangle, double * barycentric, Sphere **hit_sphere, bool any_hit) {
+	double ray[3];
+	vector3_minus(direction, translation, ray);
+	normalize3d(ray, ray);
+	double inverse_ray[3];
+	for (int a = 0; a < 3; a++)
+		inverse_ray[a] = 1.0 / ray[a];
+
+	Triangle *triangle = NULL;
+	Sphere *sphere = NULL;
+	double u = 0.0, v = 0.0;
+	int stack[BVH_MAX_DEPTH + 2];
+	int top = 0;
+	if (num_triangles + num_spheres > 0)
+		stack[top++] = 0;
+	while (top > 0) {
+		BVHNode *node = &bvh_nodes[stack[--top]];
+		if (!ray_hits_box(node, translation, inverse_ray, *distance_out))
+			continue;
+		if (node->count == 0) {
+			//Visit the child on the ray's side of the split first, so closer hits cut off the other one sooner
+			int first_child = (int)(node - bvh_nodes) + 1;
+			if (ray[node->axis] < 0) {
+				stack[top++] = first_child;
+				stack[top++] = node->first;
+			} else {
+				stack[top++] = node->first;
+				stack[top++] = first_child;
 			}
-			if (t1 > 0.f && t1 < *distance_out) { //If Closerer
-				*distance_out = t1;
-				cur_sphere = &spheres[x];
+			continue;
+		}
+		for (int i = node->first; i < node->first + node->count; i++) {
+			int object = bvh_objects[i];
+			double t;
+			if (object < num_triangles) {
+				if (!intersect_triangle(object, translation, ray, *distance_out, &t, &u, &v))
+					continue;
+				triangle = &triangles[object];
+				sphere = NULL;
+			} else {
+				if (!intersect_sphere(&spheres[object - num_triangles], translation, ray, &t) || t >= *distance_out)
+					continue;
+				sphere = &spheres[object - num_triangles];
+				triangle = NULL;
+			}
+			*distance_out = t;
+			if (any_hit) {
+				top = 0;
+				break;
 			}
 		}
 	}
-	return cur_sphere;
+	if (hit_triangle) *hit_triangle = triangle;
+	if (barycentric) {
+		barycentric[0] = 1.0 - u - v;
+		barycentric[1] = u;
+		barycentric[2] = v;
+	}
+	if (hit_sphere) *hit_sphere = sphere;
+	return triangle || sphere;
 }
 
 bool check_in_shadow(double * source_transform, Light * destination_light) {
 	/*To make sure that it doesn't collide with anything past the light*/
-	double light_sphere_distance = sqrt((destination_light->position[0]-source_transform[0])*(destination_light->position[0]-source_transform[0]) + (destination_light->position[1]-source_transform[1])*(destination_light->position[1]-source_transform[1]) + (destination_light->position[2]-source_transform[2])*(destination_light->position[2]-source_transform[2]));
-	double light_tri_distance = light_sphere_distance;
+	double light_distance = sqrt((destination_light->position[0]-source_transform[0])*(destination_light->position[0]-source_transform[0]) + (destination_light->position[1]-source_transform[1])*(destination_light->position[1]-source_transform[1]) + (destination_light->position[2]-source_transform[2])*(destination_light->position[2]-source_transform[2]));
 
-	if (collide_sphere(destination_light->position, &light_sphere_distance, source_transform))
-		return true;
-	if(collide_triangle(destination_light->position, &light_tri_distance, source_transform))
-		return true;
-	return false;
+	return collide_scene(destination_light->position, &light_distance, source_transform, NULL, NULL, NULL, true);
 }
 
 void cast_ray(double x, double y, double *color) {
@@ -405,31 +657,32 @@ void cast_ray(double x, double y, double *color) {
 
 	double translation [3] = {0.0f, 0.0f, 0.0f};
 
-	double sphere_distance	= 200000000000.f;
-	Sphere *hit_sphere = collide_sphere(screen_position, &sphere_distance, translation);
-	double tri_distance		= 100000000000.f;
-	Triangle *hit_triangle = collide_triangle(screen_position, &tri_distance, translation);
+	double distance = 100000000000.f;
+	Triangle *hit_triangle;
+	double barycentric[3];
+	Sphere *hit_sphere;
+	collide_scene(screen_position, &distance, translation, &hit_triangle, barycentric, &hit_sphere, false);
 
 	double ray_hit_location[3];
 	double normal_ray[3];
 	normalize3d(screen_position, normal_ray);
-	if (sphere_distance<tri_distance && hit_sphere) {
+	if (hit_sphere) {
 		//Convert hit_sphere->position to actual hit location using distance and camera normal
-		ray_hit_location[0] = sphere_distance * normal_ray[0];	
-		ray_hit_location[1] = sphere_distance * normal_ray[1];	
-		ray_hit_location[2] = sphere_distance * normal_ray[2];
+		ray_hit_location[0] = distance * normal_ray[0];	
+		ray_hit_location[1] = distance * normal_ray[1];	
+		ray_hit_location[2] = distance * normal_ray[2];
 		for (int x = 0; x < num_lights; x++ ) {
 			if (!check_in_shadow(ray_hit_location, &lights[x])) {//If not in shadow
 				sphere_phong_color(ray_hit_location, lights[x].position, hit_sphere->position, color, lights[x].color, hit_sphere->color_diffuse, hit_sphere->color_specular, hit_sphere->shininess);
 			}
 		}
 	} else if (hit_triangle) {
-		ray_hit_location[0] = tri_distance * normal_ray[0];	
-		ray_hit_location[1] = tri_distance * normal_ray[1];	
-		ray_hit_location[2] = tri_distance * normal_ray[2];
+		ray_hit_location[0] = distance * normal_ray[0];	
+		ray_hit_location[1] = distance * normal_ray[1];	
+		ray_hit_location[2] = distance * normal_ray[2];
 		for (int x = 0; x < num_lights; x++ ) {
 			if (!check_in_shadow(ray_hit_location, &lights[x])) {//If not in shadow
-				triangle_phong_color(ray_hit_location, lights[x].position, hit_triangle, color, lights[x].color);
+				triangle_phong_color(ray_hit_location, lights[x].position, hit_triangle, barycentric, color, lights[x].color);
 			}
 		}
 	} else {//else didn't hit 
@@ -616,7 +869,8 @@ int loadScene(char *argv)
 	      printf("too many triangles, you should increase MAX_TRIANGLES!\n");
 	      exit(0);
 	    }
-	  triangles[num_triangles++] = t;
+	  triangles[num_triangles] = t;
+	  precompute_triangle(num_triangles++);
 	}
       else if(stricmp(type,"sphere")==0)
 	{
@@ -704,6 +958,7 @@ int main (int argc, char ** argv)
 
   glutInit(&argc,argv);
   loadScene(argv[1]);
+  build_bvh();
 
   glutInitDisplayMode(GLUT_RGBA | GLUT_SINGLE);
   glutInitWindowPosition(0,0);